@@ -0,0 +1,435 @@
+
+/**
+
+Copyright 2019 - Auke Kok <sofar@foo-projects.org
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject
+to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**/
+
+/*
+ * Benchmark of the panel-pub hot path: register block -> decode ->
+ * serialize -> publish. Runs a recorded trace (a panel-dump -a
+ * snapshot file) or a synthetic one, reports the cost of every stage
+ * and fails if one of them got slower or allocates more than it should.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/resource.h>
+
+#include "renogy.h"
+#include "snapshot.h"
+#include "mqtt.h"
+#include "queue.h"
+
+// upper limits, the times are scaled with -s or PANEL_BENCH_SCALE for
+// slower machines
+#define MAX_DECODE_NS 500
+#define MAX_BATCH_NS 500
+#define MAX_CBOR_NS 2000
+#define MAX_JSON_NS 20000
+#define MAX_SINK_NS 1000
+#define MAX_BROKER_NS 20000
+#define MAX_JSON_ALLOCS 6
+#define MAX_PEAK_RSS_KB (32 * 1024)
+
+#define SYNTHETIC_SAMPLES 4096
+
+// s to wait for the broker connection to take what was published
+#define BROKER_TIMEOUT 10
+
+struct stage {
+	const char *name;
+	double ns;       // per sample
+	double allocs;   // per sample
+	double max_ns;
+	double max_allocs;
+};
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+// per thread, the network thread's allocations are not the stage's
+static _Thread_local unsigned long allocs = 0;
+
+// count every allocation the code under test makes
+void *malloc(size_t size)
+{
+	allocs++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	allocs++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	allocs++;
+	return __libc_realloc(ptr, size);
+}
+
+static uint16_t (*trace)[SNAPSHOT_LIVE_COUNT];
+static size_t trace_len;
+
+static struct renogy_sample *samples;
+static struct renogy_batch *batch;
+static struct mqtt_topic *topic = NULL;
+static unsigned long queued = 0;
+
+static volatile uint64_t sink_sum;
+static uint8_t sink_buf[1024];
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: panel-bench [-t <snapshot file>] [-n <samples>] "
+		"[-b <host[:port]>] [-s <time scale>]\n");
+	exit(EXIT_FAILURE);
+}
+
+/* a day of a small system, with some faults and state changes mixed in */
+static void synthetic_trace(void)
+{
+	unsigned int seed = 1;
+
+	trace_len = SYNTHETIC_SAMPLES;
+	trace = calloc(trace_len, sizeof(*trace));
+	if (!trace)
+		exit(EXIT_FAILURE);
+
+	for (size_t i = 0; i < trace_len; i++) {
+		uint16_t *r = trace[i];
+		double sun = sin(M_PI * i / trace_len);
+		double noise = (rand_r(&seed) % 100) / 100.;
+
+		r[0] = 40 + 50 * sun;                     // capacity
+		r[1] = 124 + 20 * sun;                    // battery V * 10
+		r[2] = 500 * sun + 20 * noise;            // battery A * 100
+		r[3] = (uint16_t)((20 + 15 * sun) * 256) | 18;
+		r[4] = r[1];
+		r[5] = 50 + 30 * noise;
+		r[6] = r[4] * r[5] / 1000;
+		r[7] = 180 * sun;
+		r[8] = 400 * sun;
+		r[9] = r[7] * r[8] / 1000;
+		for (int k = 0xb; k <= 0x14; k++)
+			r[k] = rand_r(&seed) % 1000;
+		r[0x20] = (rand_r(&seed) % 7) | ((noise > 0.5) ? 0x8000 | 0x3200 : 0);
+		r[0x21] = (i % 97 == 0) ? 0x0402 : ((i % 512 == 0) ? 0x0003 : 0);
+	}
+}
+
+static void load_trace(const char *path)
+{
+	const struct snapshot *s;
+	size_t count;
+
+	s = snapshot_map(path, &count);
+	if (!s)
+		exit(EXIT_FAILURE);
+
+	trace = calloc(count, sizeof(*trace));
+	if (!trace)
+		exit(EXIT_FAILURE);
+	for (size_t i = 0; i < count; i++)
+		if (s[i].valid & SNAPSHOT_LIVE)
+			memcpy(trace[trace_len++], s[i].live, sizeof(*trace));
+	snapshot_unmap(s, count);
+
+	if (trace_len == 0) {
+		fprintf(stderr, "No live blocks in %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* wait until no more than 'max' published messages are still queued */
+static void wait_sent(unsigned long max)
+{
+	double deadline = now_ns() + BROKER_TIMEOUT * 1e9;
+
+	while (queued - mqtt_sent() > max) {
+		if (now_ns() > deadline) {
+			fprintf(stderr, "Broker did not take %lu messages in %d s\n",
+				queued - mqtt_sent() - max, BROKER_TIMEOUT);
+			exit(EXIT_FAILURE);
+		}
+		sched_yield();
+	}
+}
+
+static void publish(const void *payload, size_t len)
+{
+	if (topic) {
+		// a message dropped from a full queue was not published
+		wait_sent(QUEUE_SIZE - 1);
+		if (mqtt_publish(topic, payload, len) == 0)
+			queued++;
+		return;
+	}
+
+	// null sink: hand the message off, as the mqtt module would copy it
+	memcpy(sink_buf, payload, (len < sizeof(sink_buf)) ? len : sizeof(sink_buf));
+	sink_sum += sink_buf[len / 2 % sizeof(sink_buf)];
+}
+
+static void run_stage(struct stage *st, size_t n, void (*fn)(size_t i))
+{
+	unsigned long a = allocs;
+	double t = now_ns();
+
+	for (size_t i = 0; i < n; i++)
+		fn(i % trace_len);
+	// only what went out to the broker is published
+	if (topic)
+		wait_sent(0);
+
+	st->ns = (now_ns() - t) / n;
+	st->allocs = (double)(allocs - a) / n;
+}
+
+static void stage_decode(size_t i)
+{
+	renogy_decode(trace[i], &samples[i]);
+	sink_sum += samples[i].panel_power;
+}
+
+/* decode the whole trace at once, as often as needed for 'n' samples */
+static void run_batch(struct stage *st, size_t n)
+{
+	unsigned long a = allocs;
+	double t = now_ns();
+	size_t done = 0;
+
+	while (done < n) {
+		size_t m = (n - done < trace_len) ? n - done : trace_len;
+
+		renogy_decode_batch(trace[0], SNAPSHOT_LIVE_COUNT, m, batch);
+		sink_sum += batch->panel_power[m - 1];
+		done += m;
+	}
+
+	st->ns = (now_ns() - t) / n;
+	st->allocs = (double)(allocs - a) / n;
+}
+
+/* the batch decoder must give exactly what the per sample one does */
+static bool check_batch(void)
+{
+	struct renogy_sample s;
+
+	renogy_decode_batch(trace[0], SNAPSHOT_LIVE_COUNT, trace_len, batch);
+	for (size_t i = 0; i < trace_len; i++) {
+		renogy_batch_sample(batch, i, &s);
+		if (memcmp(&s, &samples[i], sizeof(s)) != 0) {
+			printf("batch decode differs at sample %zu\n", i);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void stage_cbor(size_t i)
+{
+	uint8_t buf[256];
+
+	sink_sum += renogy_cbor(&samples[i], buf, sizeof(buf));
+}
+
+static void stage_json(size_t i)
+{
+	char *msg = renogy_json(&samples[i]);
+
+	sink_sum += msg[1];
+	free(msg);
+}
+
+static void stage_publish(size_t i)
+{
+	static const char msg[180];
+
+	publish(msg, sizeof(msg) - i % 16);
+}
+
+static void pipeline_cbor(size_t i)
+{
+	struct renogy_sample s;
+	uint8_t buf[256];
+	size_t len;
+
+	renogy_decode(trace[i], &s);
+	len = renogy_cbor(&s, buf, sizeof(buf));
+	publish(buf, len);
+}
+
+static void pipeline_json(size_t i)
+{
+	struct renogy_sample s;
+	char *msg;
+
+	renogy_decode(trace[i], &s);
+	msg = renogy_json(&s);
+	publish(msg, strlen(msg));
+	free(msg);
+}
+
+static bool report(const struct stage *st)
+{
+	bool ok = (st->ns <= st->max_ns) && (st->allocs <= st->max_allocs);
+
+	printf("%-14s %10.1f ns/sample %12.0f samples/s %6.2f allocs/sample  %s\n",
+		st->name, st->ns, 1e9 / st->ns, st->allocs, ok ? "ok" : "FAIL");
+	if (!ok)
+		printf("%-14s limits: %.0f ns, %.2f allocs\n", "", st->max_ns, st->max_allocs);
+
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	struct mqtt_conf conf = { .port = 1883, .protocol = MQTT_PROTOCOL_V311 };
+	const char *trace_file = NULL;
+	char *broker = NULL;
+	size_t n = 200000;
+	double scale = 1.;
+	struct rusage ru;
+	bool ok = true;
+	int opt;
+
+	// make check has no way to pass -s or -t
+	if (getenv("PANEL_BENCH_SCALE"))
+		scale = atof(getenv("PANEL_BENCH_SCALE"));
+	if (getenv("PANEL_BENCH_TRACE") && *getenv("PANEL_BENCH_TRACE"))
+		trace_file = getenv("PANEL_BENCH_TRACE");
+
+	while ((opt = getopt(argc, argv, "t:n:b:s:")) != -1) {
+		switch (opt) {
+		case 't':
+			trace_file = optarg;
+			break;
+		case 'n':
+			n = strtoul(optarg, NULL, 10);
+			break;
+		case 'b':
+			broker = strdup(optarg);
+			break;
+		case 's':
+			scale = atof(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if ((optind != argc) || (n == 0) || (scale <= 0))
+		usage();
+
+	if (trace_file)
+		load_trace(trace_file);
+	else
+		synthetic_trace();
+
+	samples = calloc(trace_len, sizeof(*samples));
+	batch = renogy_batch_new(trace_len);
+	if (!samples || !batch)
+		exit(EXIT_FAILURE);
+
+	if (broker) {
+		char *p = strchr(broker, ':');
+
+		if (p) {
+			*p++ = 0;
+			conf.port = atoi(p);
+		}
+		conf.server = broker;
+		mqtt_connect(&conf, (const char *[]){ NULL }, NULL);
+		topic = mqtt_topic("/bench/renogy/state", MQTT_QUEUE, false, 0);
+
+		// connect before anything is timed
+		publish("", 0);
+		wait_sent(0);
+	}
+
+	printf("%zu samples from %s trace of %zu, publishing to %s\n", n,
+		trace_file ? trace_file : "synthetic", trace_len, broker ? broker : "null sink");
+
+	struct stage stages[] = {
+		{ "decode", 0, 0, MAX_DECODE_NS, 0 },
+		{ "cbor", 0, 0, MAX_CBOR_NS, 0 },
+		{ "json", 0, 0, MAX_JSON_NS, MAX_JSON_ALLOCS },
+		{ "publish", 0, 0, broker ? MAX_BROKER_NS : MAX_SINK_NS, broker ? 1 : 0 },
+		{ "cbor pipeline", 0, 0, MAX_DECODE_NS + MAX_CBOR_NS + (broker ? MAX_BROKER_NS : MAX_SINK_NS), broker ? 1 : 0 },
+		{ "json pipeline", 0, 0, MAX_DECODE_NS + MAX_JSON_NS + (broker ? MAX_BROKER_NS : MAX_SINK_NS), MAX_JSON_ALLOCS + (broker ? 1 : 0) },
+	};
+	void (*fns[])(size_t) = {
+		stage_decode, stage_cbor, stage_json, stage_publish, pipeline_cbor, pipeline_json,
+	};
+
+	// warm up caches and the decoded samples the serializers work on
+	run_stage(&stages[0], trace_len, stage_decode);
+
+	for (size_t i = 0; i < sizeof(stages) / sizeof(stages[0]); i++) {
+		stages[i].max_ns *= scale;
+		run_stage(&stages[i], n, fns[i]);
+		ok &= report(&stages[i]);
+	}
+
+	struct stage batch_stage = { "batch decode", 0, 0, MAX_BATCH_NS * scale, 0 };
+
+	run_batch(&batch_stage, n);
+	ok &= report(&batch_stage);
+	printf("%-14s %10.2fx per sample decode\n", "", stages[0].ns / batch_stage.ns);
+	ok &= check_batch();
+
+	getrusage(RUSAGE_SELF, &ru);
+	printf("%-14s %10ld kB %s\n", "peak rss", ru.ru_maxrss,
+		(ru.ru_maxrss <= MAX_PEAK_RSS_KB) ? "ok" : "FAIL");
+	ok &= (ru.ru_maxrss <= MAX_PEAK_RSS_KB);
+
+	if (broker)
+		mqtt_close();
+
+	renogy_batch_free(batch);
+	free(samples);
+	free(trace);
+	free(broker);
+
+	exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
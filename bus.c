@@ -0,0 +1,417 @@
+
+/**
+
+Copyright 2019 - Auke Kok <sofar@foo-projects.org
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject
+to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "bus.h"
+#include "conf.h"
+#ifdef ENABLE_SIM
+#include "sim.h"
+#endif
+
+// attempts per transaction after the first one
+#define BUS_RETRIES 2
+// ms before the first retry, doubled for every next one
+#define BUS_RETRY_DELAY 100
+// failed transactions in a row that open the circuit breaker
+#define BUS_TRIP_FAILURES 3
+// ms the breaker stays open, doubled every time a try fails
+#define BUS_BREAKER_MIN 5000
+#define BUS_BREAKER_MAX 300000
+
+struct bus {
+	struct bus_conf conf;
+	modbus_t *ctx;          // NULL while it could not be reopened
+	int failures;           // failed transactions in a row
+	int breaker_delay;      // ms, 0 while the breaker is closed
+	struct timespec retry;  // when the breaker lets a try through
+	struct timespec tripped;
+	unsigned int seed;
+	struct bus_stats stats;
+};
+
+void bus_config(const config_t *cfg, struct bus_conf *conf)
+{
+	const char *device = "/dev/ttyS1";
+	const char *gateway = NULL;
+	const char *inventory = NULL;
+	config_t inv;
+
+	conf->baud = 9600;
+	conf->slave = 1;
+
+	if (cfg)
+		inventory = conf_string(cfg, "modbus.inventory", NULL);
+
+	// the first device modbus-scan found replaces the defaults
+	if (inventory) {
+		config_init(&inv);
+		if (config_read_file(&inv, inventory)) {
+			config_setting_t *list = config_lookup(&inv, "devices");
+			config_setting_t *first = list ? config_setting_get_elem(list, 0) : NULL;
+
+			device = conf_setting_string(first, "device", device);
+			conf->baud = conf_setting_int(first, "baud", conf->baud);
+			conf->slave = conf_setting_int(first, "slave", conf->slave);
+		} else {
+			fprintf(stderr, "%s:%d - %s\n", inventory, config_error_line(&inv), config_error_text(&inv));
+		}
+	}
+
+	if (cfg) {
+		device = conf_string(cfg, "modbus.device", device);
+		conf->baud = conf_int(cfg, "modbus.baud", conf->baud);
+		conf->slave = conf_int(cfg, "modbus.slave", conf->slave);
+		gateway = conf_string(cfg, "modbus.gateway", NULL);
+	}
+
+	conf->device = strdup(device);
+	conf->gateway = gateway ? strdup(gateway) : NULL;
+	if (!conf->device || (gateway && !conf->gateway))
+		exit(EXIT_FAILURE);
+
+	if (inventory)
+		config_destroy(&inv);
+}
+
+void bus_config_free(struct bus_conf *conf)
+{
+	free(conf->device);
+	free(conf->gateway);
+	conf->device = NULL;
+	conf->gateway = NULL;
+}
+
+void bus_config_load(struct bus_conf *conf)
+{
+	config_t cfg;
+
+	if (access(CONFIG_PATH, R_OK) != 0) {
+		bus_config(NULL, conf);
+		return;
+	}
+
+	conf_read(&cfg);
+	bus_config(&cfg, conf);
+	config_destroy(&cfg);
+}
+
+bool bus_config_equal(const struct bus_conf *a, const struct bus_conf *b)
+{
+	return (strcmp(a->device, b->device) == 0) &&
+		(a->baud == b->baud) &&
+		(a->slave == b->slave) &&
+		((a->gateway == b->gateway) ||
+		 (a->gateway && b->gateway && (strcmp(a->gateway, b->gateway) == 0)));
+}
+
+/*
+ * libmodbus only talks TCP over sockets it connected itself, but it
+ * happily uses any stream socket handed to it with modbus_set_socket().
+ */
+static modbus_t *gateway_open(const struct bus_conf *conf)
+{
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	modbus_t *ctx;
+	int fd;
+
+	if (strlen(conf->gateway) >= sizeof(sa.sun_path)) {
+		fprintf(stderr, "Gateway socket path too long: %s\n", conf->gateway);
+		return NULL;
+	}
+	strcpy(sa.sun_path, conf->gateway);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		fprintf(stderr, "socket(): %s\n", strerror(errno));
+		return NULL;
+	}
+
+	if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		fprintf(stderr, "Connection to gateway %s failed: %s\n", conf->gateway, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	ctx = modbus_new_tcp("127.0.0.1", MODBUS_TCP_DEFAULT_PORT);
+	if (!ctx) {
+		fprintf(stderr, "Unable to create the libmodbus context: %s\n", strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	modbus_set_socket(ctx, fd);
+	modbus_set_slave(ctx, conf->slave);
+	// requests may have to wait for others on the serial bus
+	modbus_set_response_timeout(ctx, 5, 0);
+
+	return ctx;
+}
+
+modbus_t *bus_open(const struct bus_conf *conf)
+{
+	if (conf->gateway)
+		return gateway_open(conf);
+	return bus_open_device(conf);
+}
+
+modbus_t *bus_open_device(const struct bus_conf *conf)
+{
+	modbus_t *ctx;
+
+#ifdef ENABLE_SIM
+	if (strcmp(conf->device, SIM_DEVICE) == 0)
+		return sim_open(conf);
+#endif
+
+	ctx = modbus_new_rtu(conf->device, conf->baud, 'N', 8, 1);
+	if (!ctx) {
+		fprintf(stderr, "Unable to create the libmodbus context: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	modbus_set_slave(ctx, conf->slave);
+
+	if (modbus_connect(ctx) == -1) {
+		fprintf(stderr, "Connection to %s failed: %s\n", conf->device, modbus_strerror(errno));
+		modbus_free(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+static double elapsed(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/* 'ms' give or take half of it */
+static int jitter(struct bus *b, int ms)
+{
+	return ms / 2 + rand_r(&b->seed) % (ms / 2 + 1);
+}
+
+struct bus *bus_new(const struct bus_conf *conf)
+{
+	struct bus *b = calloc(1, sizeof(*b));
+
+	if (!b)
+		exit(EXIT_FAILURE);
+
+	b->conf = *conf;
+	b->conf.device = strdup(conf->device);
+	b->conf.gateway = conf->gateway ? strdup(conf->gateway) : NULL;
+	if (!b->conf.device || (conf->gateway && !b->conf.gateway))
+		exit(EXIT_FAILURE);
+	b->seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+
+	b->ctx = bus_open(&b->conf);
+	if (!b->ctx) {
+		bus_free(b);
+		return NULL;
+	}
+
+	return b;
+}
+
+void bus_free(struct bus *b)
+{
+	if (!b)
+		return;
+
+	if (b->ctx) {
+		modbus_close(b->ctx);
+		modbus_free(b->ctx);
+	}
+	bus_config_free(&b->conf);
+	free(b);
+}
+
+static void reconnect(struct bus *b)
+{
+	b->stats.reconnects++;
+
+	if (b->ctx) {
+		modbus_close(b->ctx);
+		modbus_free(b->ctx);
+	}
+	b->ctx = bus_open(&b->conf);
+}
+
+/*
+ * The device answered, even if it was with an exception. The gateway
+ * exceptions mean it did not, they come from modbus-gateway.
+ */
+static bool answered(int err)
+{
+	return (err > MODBUS_ENOBASE) && (err < MODBUS_ENOBASE + MODBUS_EXCEPTION_GATEWAY_PATH);
+}
+
+static void transaction_failed(struct bus *b, bool trial)
+{
+	struct timespec now;
+
+	b->stats.failures++;
+	b->failures++;
+
+	if (!trial && (b->failures < BUS_TRIP_FAILURES))
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (!trial) {
+		b->stats.trips++;
+		b->tripped = now;
+		b->breaker_delay = BUS_BREAKER_MIN;
+		fprintf(stderr, "%s: %d failed transactions in a row, backing off\n",
+			b->conf.device, b->failures);
+	} else if (b->breaker_delay < BUS_BREAKER_MAX) {
+		b->breaker_delay *= 2;
+		if (b->breaker_delay > BUS_BREAKER_MAX)
+			b->breaker_delay = BUS_BREAKER_MAX;
+	}
+
+	int delay = jitter(b, b->breaker_delay);
+	b->retry.tv_sec = now.tv_sec + delay / 1000;
+	b->retry.tv_nsec = now.tv_nsec + (delay % 1000) * 1000000L;
+	if (b->retry.tv_nsec >= 1000000000L) {
+		b->retry.tv_sec++;
+		b->retry.tv_nsec -= 1000000000L;
+	}
+}
+
+static void transaction_done(struct bus *b)
+{
+	if (b->breaker_delay) {
+		struct timespec now;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		b->stats.recoveries++;
+		fprintf(stderr, "%s: back after %.1f s\n", b->conf.device, elapsed(&b->tripped, &now));
+	}
+
+	b->failures = 0;
+	b->breaker_delay = 0;
+}
+
+static int transact(struct bus *b, bool write, int addr, int count, uint16_t *regs)
+{
+	bool trial = false;
+	int retries = BUS_RETRIES;
+	int err = 0;
+
+	b->stats.requests++;
+
+	if (b->breaker_delay) {
+		struct timespec now;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (elapsed(&b->retry, &now) < 0) {
+			b->stats.rejected++;
+			errno = EAGAIN;
+			return -1;
+		}
+		// just see if it is back, without retries
+		trial = true;
+		retries = 0;
+	}
+
+	for (int attempt = 0; attempt <= retries; attempt++) {
+		int ret;
+
+		if (attempt > 0) {
+			int ms = jitter(b, BUS_RETRY_DELAY << (attempt - 1));
+			struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+
+			b->stats.retries++;
+			nanosleep(&ts, NULL);
+		}
+
+		// the last retry gets a fresh connection
+		if (!b->ctx || ((attempt > 0) && (attempt == retries)))
+			reconnect(b);
+		if (!b->ctx) {
+			err = errno;
+			b->stats.errors++;
+			continue;
+		}
+
+		if (write)
+			ret = modbus_write_register(b->ctx, addr, regs[0]);
+		else
+			ret = modbus_read_registers(b->ctx, addr, count, regs);
+		if (ret >= 0) {
+			transaction_done(b);
+			return ret;
+		}
+
+		err = errno;
+		b->stats.errors++;
+		fprintf(stderr, "%s: %s of %04x failed: %s\n", b->conf.device,
+			write ? "write" : "read", addr, modbus_strerror(err));
+
+		// an exception won't go away by asking again
+		if (answered(err)) {
+			transaction_done(b);
+			errno = err;
+			return -1;
+		}
+
+		// the rest of a garbled or late reply must not be taken for the next one
+		modbus_flush(b->ctx);
+	}
+
+	transaction_failed(b, trial);
+	errno = err;
+	return -1;
+}
+
+int bus_read_registers(struct bus *b, int addr, int count, uint16_t *dest)
+{
+	return transact(b, false, addr, count, dest);
+}
+
+int bus_write_register(struct bus *b, int addr, uint16_t value)
+{
+	return transact(b, true, addr, 1, &value);
+}
+
+const struct bus_stats *bus_stats(const struct bus *b)
+{
+	return &b->stats;
+}
+
+bool bus_tripped(const struct bus *b)
+{
+	return b->breaker_delay != 0;
+}
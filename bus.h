@@ -0,0 +1,98 @@
+
+/**
+
+Copyright 2019 - Auke Kok <sofar@foo-projects.org
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject
+to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**/
+
+#ifndef BUS_H
+#define BUS_H
+
+#include <stdbool.h>
+
+#include <modbus.h>
+#include <libconfig.h>
+
+/* serial settings of the charge controller, the "modbus" config group */
+struct bus_conf {
+	char *device;
+	int baud;
+	int slave;
+	char *gateway; // modbus-gateway socket, NULL to use the device directly
+};
+
+/* fill in from the config, NULL for the built in defaults */
+void bus_config(const config_t *cfg, struct bus_conf *conf);
+void bus_config_free(struct bus_conf *conf);
+
+/* for the tools: read just the "modbus" group, defaults without a config */
+void bus_config_load(struct bus_conf *conf);
+bool bus_config_equal(const struct bus_conf *a, const struct bus_conf *b);
+
+/*
+ * Create and connect a context, NULL on failure. With a gateway
+ * configured this is a Modbus TCP context on the gateway socket,
+ * otherwise an RTU context on the serial device.
+ */
+modbus_t *bus_open(const struct bus_conf *conf);
+
+/*
+ * Always the serial device, for the gateway itself. In a build with
+ * --enable-sim, device "sim" is the simulated controller from sim.h.
+ */
+modbus_t *bus_open_device(const struct bus_conf *conf);
+
+/*
+ * A session with one device that rides out a noisy line. A failed
+ * transaction is retried a few times with jittered backoff, flushing
+ * whatever is left of a garbled reply first, and over a fresh
+ * connection for the last try. When a device fails several
+ * transactions in a row its circuit breaker opens: transactions fail
+ * right away, without touching the bus, until a growing delay has passed
+ * and a single try gets through again.
+ */
+
+struct bus_stats {
+	unsigned long requests;   // transactions asked for
+	unsigned long failures;   // transactions that failed in the end
+	unsigned long errors;     // failed attempts, retried or not
+	unsigned long retries;
+	unsigned long reconnects;
+	unsigned long rejected;   // not tried because the breaker was open
+	unsigned long trips;      // times the breaker opened
+	unsigned long recoveries; // times it closed again
+};
+
+struct bus;
+
+/* open a session, NULL if the device can't be opened at all */
+struct bus *bus_new(const struct bus_conf *conf);
+void bus_free(struct bus *b);
+
+/* like the libmodbus calls, -1 with errno set on failure */
+int bus_read_registers(struct bus *b, int addr, int count, uint16_t *dest);
+int bus_write_register(struct bus *b, int addr, uint16_t value);
+
+const struct bus_stats *bus_stats(const struct bus *b);
+bool bus_tripped(const struct bus *b);
+
+#endif
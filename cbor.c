@@ -0,0 +1,211 @@
+
+/**
+
+Copyright 2019 - Auke Kok <sofar@foo-projects.org
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject
+to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**/
+
+#include <string.h>
+#include <math.h>
+
+#include "cbor.h"
+
+void cbor_init(struct cbor *c, uint8_t *buf, size_t size)
+{
+	c->buf = buf;
+	c->len = 0;
+	c->size = size;
+}
+
+bool cbor_ok(const struct cbor *c)
+{
+	return c->len <= c->size;
+}
+
+static void put(struct cbor *c, const void *data, size_t len)
+{
+	if (c->len + len <= c->size)
+		memcpy(c->buf + c->len, data, len);
+	c->len += len;
+}
+
+static void head(struct cbor *c, int major, uint64_t v)
+{
+	uint8_t b[9];
+	size_t n;
+
+	if (v < 24) {
+		b[0] = (major << 5) | v;
+		n = 1;
+	} else if (v <= 0xff) {
+		b[0] = (major << 5) | 24;
+		b[1] = v;
+		n = 2;
+	} else if (v <= 0xffff) {
+		b[0] = (major << 5) | 25;
+		b[1] = v >> 8;
+		b[2] = v;
+		n = 3;
+	} else if (v <= 0xffffffff) {
+		b[0] = (major << 5) | 26;
+		for (int i = 0; i < 4; i++)
+			b[1 + i] = v >> (24 - 8 * i);
+		n = 5;
+	} else {
+		b[0] = (major << 5) | 27;
+		for (int i = 0; i < 8; i++)
+			b[1 + i] = v >> (56 - 8 * i);
+		n = 9;
+	}
+	put(c, b, n);
+}
+
+void cbor_map(struct cbor *c, size_t pairs)
+{
+	head(c, CBOR_MAP, pairs);
+}
+
+void cbor_array(struct cbor *c, size_t items)
+{
+	head(c, CBOR_ARRAY, items);
+}
+
+void cbor_uint(struct cbor *c, uint64_t v)
+{
+	head(c, CBOR_UINT, v);
+}
+
+void cbor_int(struct cbor *c, int64_t v)
+{
+	if (v < 0)
+		head(c, CBOR_NINT, (uint64_t)(-1 - v));
+	else
+		head(c, CBOR_UINT, v);
+}
+
+void cbor_float(struct cbor *c, float v)
+{
+	uint32_t u;
+	uint8_t b[5];
+
+	// integral values are smaller and exact as plain integers
+	if ((v > -2147483648.f) && (v < 2147483648.f) && (v == (float)(int32_t)v)) {
+		cbor_int(c, (int32_t)v);
+		return;
+	}
+
+	memcpy(&u, &v, sizeof(u));
+	b[0] = (CBOR_SIMPLE << 5) | 26;
+	b[1] = u >> 24;
+	b[2] = u >> 16;
+	b[3] = u >> 8;
+	b[4] = u;
+	put(c, b, sizeof(b));
+}
+
+void cbor_bool(struct cbor *c, bool v)
+{
+	uint8_t b = (CBOR_SIMPLE << 5) | (v ? 21 : 20);
+	put(c, &b, 1);
+}
+
+void cbor_bytes(struct cbor *c, const void *data, size_t len)
+{
+	head(c, CBOR_BYTES, len);
+	put(c, data, len);
+}
+
+void cbor_text(struct cbor *c, const char *s)
+{
+	size_t len = strlen(s);
+
+	head(c, CBOR_TEXT, len);
+	put(c, s, len);
+}
+
+static uint64_t be(const uint8_t *p, int n)
+{
+	uint64_t v = 0;
+
+	for (int i = 0; i < n; i++)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+int cbor_read(struct cbor_reader *r, struct cbor_item *it)
+{
+	int ai;
+	int n;
+
+	if (r->p >= r->end)
+		return -1;
+
+	it->major = *r->p >> 5;
+	it->is_float = false;
+	it->data = NULL;
+	ai = *r->p & 0x1f;
+	r->p++;
+
+	if (ai < 24)
+		n = 0;
+	else if (ai <= 27)
+		n = 1 << (ai - 24);
+	else
+		return -1; // indefinite lengths are never written by us
+
+	if (r->end - r->p < n)
+		return -1;
+	it->val = (n == 0) ? (uint64_t)ai : be(r->p, n);
+	r->p += n;
+
+	if (it->major == CBOR_SIMPLE && n >= 2) {
+		it->is_float = true;
+		if (n == 2) {
+			int e = (it->val >> 10) & 0x1f;
+			int m = it->val & 0x3ff;
+			double f;
+
+			if (e == 0)
+				f = m / 16777216.;
+			else if (e != 31)
+				f = (m + 1024) * (double)(1 << e) / 33554432.;
+			else
+				f = (m == 0) ? INFINITY : NAN;
+			it->f = (it->val & 0x8000) ? -f : f;
+		} else if (n == 4) {
+			uint32_t u = it->val;
+			float f;
+
+			memcpy(&f, &u, sizeof(f));
+			it->f = f;
+		} else {
+			memcpy(&it->f, &it->val, sizeof(it->f));
+		}
+	} else if (it->major == CBOR_BYTES || it->major == CBOR_TEXT) {
+		if ((uint64_t)(r->end - r->p) < it->val)
+			return -1;
+		it->data = r->p;
+		r->p += it->val;
+	}
+
+	return 0;
+}
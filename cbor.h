@@ -0,0 +1,83 @@
+
+/**
+
+Copyright 2019 - Auke Kok <sofar@foo-projects.org
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject
+to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**/
+
+#ifndef CBOR_H
+#define CBOR_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Minimal CBOR (RFC 8949) writer and reader. The writer never allocates;
+ * it writes into a caller supplied buffer and keeps counting past the end
+ * so the caller can detect an overflow with cbor_ok().
+ */
+
+#define CBOR_UINT   0
+#define CBOR_NINT   1
+#define CBOR_BYTES  2
+#define CBOR_TEXT   3
+#define CBOR_ARRAY  4
+#define CBOR_MAP    5
+#define CBOR_TAG    6
+#define CBOR_SIMPLE 7
+
+struct cbor {
+	uint8_t *buf;
+	size_t len;
+	size_t size;
+};
+
+void cbor_init(struct cbor *c, uint8_t *buf, size_t size);
+bool cbor_ok(const struct cbor *c);
+
+void cbor_map(struct cbor *c, size_t pairs);
+void cbor_array(struct cbor *c, size_t items);
+void cbor_uint(struct cbor *c, uint64_t v);
+void cbor_int(struct cbor *c, int64_t v);
+void cbor_float(struct cbor *c, float v);
+void cbor_bool(struct cbor *c, bool v);
+void cbor_bytes(struct cbor *c, const void *data, size_t len);
+void cbor_text(struct cbor *c, const char *s);
+
+struct cbor_reader {
+	const uint8_t *p;
+	const uint8_t *end;
+};
+
+struct cbor_item {
+	int major;
+	uint64_t val;        // integer value, length or item count
+	double f;            // float value for CBOR_SIMPLE floats
+	bool is_float;
+	const uint8_t *data; // payload of byte and text strings
+};
+
+/* returns 0 on success, -1 on truncated or unsupported input */
+int cbor_read(struct cbor_reader *r, struct cbor_item *it);
+
+#endif
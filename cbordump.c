@@ -0,0 +1,194 @@
+
+/**
+
+Copyright 2019 - Auke Kok <sofar@foo-projects.org
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject
+to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cbor.h"
+#include "schema.h"
+
+/*
+ * Decode CBOR encoded messages from a file or stdin and print them as
+ * JSON, translating numeric map keys to field names using schema.h.
+ */
+
+static int print_item(struct cbor_reader *r, int depth, int schema);
+
+static void print_key(const struct cbor_item *it, int schema)
+{
+	const char *name = NULL;
+
+	if (it->major == CBOR_UINT)
+		name = schema_key_name(schema, it->val);
+
+	if (name)
+		printf("\"%s\"", name);
+	else if (it->major == CBOR_UINT)
+		printf("\"%llu\"", (unsigned long long)it->val);
+	else if (it->major == CBOR_TEXT)
+		printf("\"%.*s\"", (int)it->val, it->data);
+	else
+		printf("\"?\"");
+}
+
+static int print_map(struct cbor_reader *r, uint64_t n, int depth)
+{
+	int schema = 0;
+
+	printf("{");
+	for (uint64_t i = 0; i < n; i++) {
+		struct cbor_item key;
+
+		if (cbor_read(r, &key) < 0)
+			return -1;
+
+		// top level maps carry the schema id as the first pair
+		if ((depth == 0) && (i == 0) && (key.major == CBOR_UINT) && (key.val == SCHEMA_KEY)) {
+			struct cbor_reader peek = *r;
+			struct cbor_item val;
+
+			if ((cbor_read(&peek, &val) == 0) && (val.major == CBOR_UINT))
+				schema = val.val;
+		}
+
+		if (i > 0)
+			printf(",");
+		print_key(&key, schema);
+		printf(":");
+		if (print_item(r, depth + 1, schema) < 0)
+			return -1;
+	}
+	printf("}");
+
+	return 0;
+}
+
+static int print_item(struct cbor_reader *r, int depth, int schema)
+{
+	struct cbor_item it;
+
+	if (cbor_read(r, &it) < 0)
+		return -1;
+
+	switch (it.major) {
+	case CBOR_UINT:
+		printf("%llu", (unsigned long long)it.val);
+		break;
+	case CBOR_NINT:
+		printf("-%llu", (unsigned long long)it.val + 1);
+		break;
+	case CBOR_BYTES:
+		printf("\"");
+		for (uint64_t i = 0; i < it.val; i++)
+			printf("%02x", it.data[i]);
+		printf("\"");
+		break;
+	case CBOR_TEXT:
+		printf("\"%.*s\"", (int)it.val, it.data);
+		break;
+	case CBOR_ARRAY:
+		printf("[");
+		for (uint64_t i = 0; i < it.val; i++) {
+			if (i > 0)
+				printf(",");
+			if (print_item(r, depth + 1, schema) < 0)
+				return -1;
+		}
+		printf("]");
+		break;
+	case CBOR_MAP:
+		return print_map(r, it.val, depth);
+	case CBOR_TAG:
+		return print_item(r, depth, schema);
+	case CBOR_SIMPLE:
+		if (it.is_float)
+			printf("%g", it.f);
+		else if (it.val == 20)
+			printf("false");
+		else if (it.val == 21)
+			printf("true");
+		else
+			printf("null");
+		break;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	FILE *f = stdin;
+	uint8_t *buf = NULL;
+	size_t len = 0;
+	size_t size = 0;
+	struct cbor_reader r;
+
+	if (argc > 2) {
+		fprintf(stderr, "Usage: cbor-dump [file]\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if ((argc == 2) && (strcmp(argv[1], "-") != 0)) {
+		f = fopen(argv[1], "r");
+		if (!f) {
+			perror(argv[1]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (;;) {
+		if (len == size) {
+			size = size ? size * 2 : 4096;
+			buf = realloc(buf, size);
+			if (!buf)
+				exit(EXIT_FAILURE);
+		}
+		size_t n = fread(buf + len, 1, size - len, f);
+		if (n == 0)
+			break;
+		len += n;
+	}
+
+	if (f != stdin)
+		fclose(f);
+
+	// the input may hold several concatenated messages
+	r.p = buf;
+	r.end = buf + len;
+	while (r.p < r.end) {
+		if (print_item(&r, 0, 0) < 0) {
+			fprintf(stderr, "Malformed CBOR at offset %zu\n", (size_t)(r.p - buf));
+			free(buf);
+			exit(EXIT_FAILURE);
+		}
+		printf("\n");
+	}
+
+	free(buf);
+}
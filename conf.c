@@ -0,0 +1,145 @@
+
+/**
+
+Copyright 2019 - Auke Kok <sofar@foo-projects.org
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject
+to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/inotify.h>
+
+#include "conf.h"
+
+int conf_load(config_t *cfg)
+{
+	config_init(cfg);
+	if (!config_read_file(cfg, CONFIG_PATH)) {
+		fprintf(stderr, "%s:%d - %s\n", config_error_file(cfg), config_error_line(cfg), config_error_text(cfg));
+		config_destroy(cfg);
+		return -1;
+	}
+
+	return 0;
+}
+
+void conf_read(config_t *cfg)
+{
+	if (conf_load(cfg) < 0)
+		exit(EXIT_FAILURE);
+}
+
+int conf_int(const config_t *cfg, const char *path, int def)
+{
+	int val;
+
+	if (config_lookup_int(cfg, path, &val))
+		return val;
+	return def;
+}
+
+const char *conf_string(const config_t *cfg, const char *path, const char *def)
+{
+	const char *val;
+
+	if (config_lookup_string(cfg, path, &val))
+		return val;
+	return def;
+}
+
+int conf_setting_int(const config_setting_t *s, const char *name, int def)
+{
+	int val;
+
+	if (s && config_setting_lookup_int(s, name, &val))
+		return val;
+	return def;
+}
+
+const char *conf_setting_string(const config_setting_t *s, const char *name, const char *def)
+{
+	const char *val;
+
+	if (s && config_setting_lookup_string(s, name, &val))
+		return val;
+	return def;
+}
+
+double conf_setting_float(const config_setting_t *s, const char *name, double def)
+{
+	double val;
+	int ival;
+
+	if (s && config_setting_lookup_float(s, name, &val))
+		return val;
+	if (s && config_setting_lookup_int(s, name, &ival))
+		return ival;
+	return def;
+}
+
+int conf_watch(void)
+{
+	char path[] = CONFIG_PATH;
+	int fd;
+
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "inotify_init1: %s\n", strerror(errno));
+		return -1;
+	}
+
+	// watch the directory, editors often replace the file by renaming
+	if (inotify_add_watch(fd, dirname(path), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		fprintf(stderr, "inotify_add_watch: %s\n", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+bool conf_changed(int fd)
+{
+	char path[] = CONFIG_PATH;
+	const char *name = basename(path);
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	bool changed = false;
+	ssize_t len;
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		for (char *p = buf; p < buf + len; ) {
+			struct inotify_event *ev = (struct inotify_event *)p;
+
+			if ((ev->len > 0) && (strcmp(ev->name, name) == 0))
+				changed = true;
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+
+	return changed;
+}
@@ -0,0 +1,62 @@
+
+/**
+
+Copyright 2019 - Auke Kok <sofar@foo-projects.org
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject
+to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**/
+
+#ifndef CONF_H
+#define CONF_H
+
+#include <stdbool.h>
+
+#include <libconfig.h>
+
+#define CONFIG_PATH "/etc/mqtt.conf"
+
+/* parse CONFIG_PATH, returns -1 after printing the error */
+int conf_load(config_t *cfg);
+
+/* like conf_load() but a parse error is fatal */
+void conf_read(config_t *cfg);
+
+/* lookups with a default value for missing settings */
+int conf_int(const config_t *cfg, const char *path, int def);
+const char *conf_string(const config_t *cfg, const char *path, const char *def);
+
+/* the same for members of a group or list element, 's' may be NULL */
+int conf_setting_int(const config_setting_t *s, const char *name, int def);
+const char *conf_setting_string(const config_setting_t *s, const char *name, const char *def);
+
+/* a float setting, which may also be written as an integer */
+double conf_setting_float(const config_setting_t *s, const char *name, double def);
+
+/*
+ * Watch CONFIG_PATH for changes. The returned inotify fd becomes readable
+ * when something in the config directory changed, conf_changed() then
+ * tells whether it was our file. Editors that replace the file instead
+ * of rewriting it are handled as well.
+ */
+int conf_watch(void);
+bool conf_changed(int fd);
+
+#endif
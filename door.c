@@ -34,13 +34,84 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <string.h>
 #include <signal.h>
 #include <limits.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 
-#include <mosquitto.h>
 #include <gpiod.h>
 #include <libconfig.h>
 
+#include "mqtt.h"
+#include "conf.h"
+
 #define GPIOD_CONSUMER "renogy-door"
-#define CONFIG_PATH "/etc/mqtt.conf"
+
+// each door has a state topic, the mqtt module holds 16 in total
+#define DOORS_MAX 8
+
+#ifdef ENABLE_SIM
+// doors on this chip are simulated, for testing without hardware
+#define SIM_CHIP "sim"
+#endif
+
+struct door_conf {
+	char *chip;
+	int sensor_closed;
+	int sensor_open;
+	int actuator_close;
+	int actuator_open;
+	int timeout;   // seconds a command may take before it is an error
+	int pulse_width; // ms an actuator is driven, also the pause after
+#ifdef ENABLE_SIM
+	int travel;    // ms a simulated door takes to open or close
+#endif
+	char *topic;   // topics are /<hostname>/<topic>/{state,control}
+};
+
+/* all lines of one chip, held for as long as the config stays the same */
+struct chip {
+	char *name;
+	struct gpiod_chip *chip;
+	struct gpiod_line_bulk inputs;  // sensors, with edge events
+	struct gpiod_line_bulk outputs; // actuators
+	int values[GPIOD_LINE_BULK_MAX_LINES]; // last read sensor values
+	int shadow[GPIOD_LINE_BULK_MAX_LINES]; // actuator values, set in bulk
+#ifdef ENABLE_SIM
+	int sim_fd;    // timerfd moving the simulated doors, -1 for real chips
+	int sim_values[GPIOD_LINE_BULK_MAX_LINES]; // simulated sensor lines
+#endif
+};
+
+struct door {
+	struct door_conf conf;
+	struct chip *chip;
+	int in_closed;   // line indexes in chip->inputs
+	int in_open;
+	int out_close;   // line indexes in chip->outputs
+	int out_open;
+
+	int state;       // door_states
+	int published_state;
+	int sensor_closed;
+	int sensor_open;
+	time_t command_time; // time() of last command received
+	bool command;        // command pending
+
+	int pulse_line;      // actuator being pulsed, -1 if none
+	int pulse_next;      // actuator to pulse after the pause, -1 if none
+	bool pulse_pause;    // in the pause after a pulse
+	struct timespec pulse_start;
+	struct timespec pulse_deadline; // end of the pulse or pause
+
+#ifdef ENABLE_SIM
+	int sim_target;      // sensor a simulated door moves to, -1 if none
+	struct timespec sim_arrival;
+#endif
+
+	char *topic_control;
+	char *topic_state;
+	struct mqtt_topic *state_topic;
+};
 
 static const char* door_states[] = {
 	"closed", //0
@@ -51,280 +122,890 @@ static const char* door_states[] = {
 	"initializing" //5
 };
 
-static int state = 5; // door_states, -1 means unknown state (initializing).
-static int published_state = -1;
+static struct door doors[DOORS_MAX];
+static int ndoors = 0;
 
-static int sensor_closed = 0;
-static int sensor_open = 0;
+static struct chip chips[DOORS_MAX];
+static int nchips = 0;
 
-static char *topic_control = NULL;
-static char *topic_state = NULL;
+static int events_fd = -1; // epoll set of all sensor line events
+static int timer_fd = -1;  // ends actuator pulses
 
-static int stop = 0;
-
-static time_t command_time = 0; // time() of last command received
-static bool command = false; // command pending
+static char hostname[HOST_NAME_MAX+1];
 
-// 2 minute intervals between normal idle publishes
-#define CHECK_INTERVAL 150
+static int stop = 0;
 
 static void sigfunc(int s __attribute__ ((unused)))
 {
 	stop = 1;
 }
 
-static void get_sensor_data()
+static void doors_close(void)
 {
-	int closed = gpiod_ctxless_get_value("3", 22, true, GPIOD_CONSUMER);
-	if (closed < 0) {
-		fprintf(stderr, "gpiod sensor read 15: %d\n", closed);
-		state = 4;
-	} else {
-		sensor_closed = closed;
+	for (int i = 0; i < nchips; i++) {
+		// closing the event fds also drops them from the epoll set
+#ifdef ENABLE_SIM
+		if (chips[i].sim_fd >= 0) {
+			close(chips[i].sim_fd);
+			free(chips[i].name);
+			continue;
+		}
+#endif
+		gpiod_line_release_bulk(&chips[i].inputs);
+		gpiod_line_release_bulk(&chips[i].outputs);
+		gpiod_chip_close(chips[i].chip);
+		free(chips[i].name);
 	}
+	nchips = 0;
 
-	int open = gpiod_ctxless_get_value("3", 15, true, GPIOD_CONSUMER);
-	if (open < 0) {
-		fprintf(stderr, "gpiod sensor read 22: %d\n", open);
-		state = 4;
-	} else {
-		sensor_open = open;
+	for (int i = 0; i < ndoors; i++)
+		doors[i].chip = NULL;
+}
+
+static struct chip *get_chip(const char *name)
+{
+	struct chip *c;
+
+	for (int i = 0; i < nchips; i++)
+		if (strcmp(chips[i].name, name) == 0)
+			return &chips[i];
+
+	c = &chips[nchips];
+	memset(c, 0, sizeof(*c));
+#ifdef ENABLE_SIM
+	c->sim_fd = -1;
+	if (strcmp(name, SIM_CHIP) == 0) {
+		c->sim_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (c->sim_fd < 0) {
+			fprintf(stderr, "timerfd_create: %s\n", strerror(errno));
+			return NULL;
+		}
+		goto opened;
+	}
+#endif
+	c->chip = gpiod_chip_open_lookup(name);
+	if (!c->chip) {
+		fprintf(stderr, "Unable to open gpio chip %s: %s\n", name, strerror(errno));
+		return NULL;
+	}
+#ifdef ENABLE_SIM
+opened:
+#endif
+	c->name = strdup(name);
+	if (!c->name)
+		exit(EXIT_FAILURE);
+	nchips++;
+
+	return c;
+}
+
+/*
+ * Request the lines of all doors, one bulk of inputs and one of outputs
+ * per chip, and add the sensor events to the epoll set.
+ */
+static int doors_open(void)
+{
+	unsigned int in[DOORS_MAX][GPIOD_LINE_BULK_MAX_LINES];
+	unsigned int out[DOORS_MAX][GPIOD_LINE_BULK_MAX_LINES];
+	unsigned int nin[DOORS_MAX] = { 0 };
+	unsigned int nout[DOORS_MAX] = { 0 };
+
+	for (int i = 0; i < ndoors; i++) {
+		struct door *d = &doors[i];
+		struct chip *c = get_chip(d->conf.chip);
+		int n;
+
+		if (!c)
+			goto fail;
+		n = c - chips;
+
+		d->chip = c;
+		d->in_closed = nin[n];
+		in[n][nin[n]++] = d->conf.sensor_closed;
+		d->in_open = nin[n];
+		in[n][nin[n]++] = d->conf.sensor_open;
+		d->out_close = nout[n];
+		out[n][nout[n]++] = d->conf.actuator_close;
+		d->out_open = nout[n];
+		out[n][nout[n]++] = d->conf.actuator_open;
+	}
+
+	for (int n = 0; n < nchips; n++) {
+		struct chip *c = &chips[n];
+
+#ifdef ENABLE_SIM
+		if (c->sim_fd >= 0) {
+			struct epoll_event ev = { .events = EPOLLIN, .data.fd = c->sim_fd };
+
+			// simulated doors start out closed
+			for (int i = 0; i < ndoors; i++)
+				if (doors[i].chip == c)
+					c->sim_values[doors[i].in_closed] = 1;
+			if (epoll_ctl(events_fd, EPOLL_CTL_ADD, c->sim_fd, &ev) < 0) {
+				fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+				goto fail;
+			}
+			continue;
+		}
+#endif
+
+		if ((gpiod_chip_get_lines(c->chip, in[n], nin[n], &c->inputs) < 0) ||
+		    (gpiod_chip_get_lines(c->chip, out[n], nout[n], &c->outputs) < 0)) {
+			fprintf(stderr, "Invalid door GPIO line on chip %s\n", c->name);
+			goto fail;
+		}
+
+		if (gpiod_line_request_bulk_both_edges_events_flags(&c->inputs, GPIOD_CONSUMER,
+				GPIOD_LINE_REQUEST_FLAG_ACTIVE_LOW) < 0) {
+			fprintf(stderr, "Unable to request sensor lines on chip %s: %s\n", c->name, strerror(errno));
+			gpiod_line_bulk_init(&c->inputs);
+			gpiod_line_bulk_init(&c->outputs);
+			goto fail;
+		}
+
+		if (gpiod_line_request_bulk_output_flags(&c->outputs, GPIOD_CONSUMER,
+				GPIOD_LINE_REQUEST_FLAG_ACTIVE_LOW, c->shadow) < 0) {
+			fprintf(stderr, "Unable to request actuator lines on chip %s: %s\n", c->name, strerror(errno));
+			gpiod_line_bulk_init(&c->outputs);
+			goto fail;
+		}
+
+		for (unsigned int i = 0; i < nin[n]; i++) {
+			struct epoll_event ev = { .events = EPOLLIN };
+
+			ev.data.fd = gpiod_line_event_get_fd(gpiod_line_bulk_get_line(&c->inputs, i));
+			if (epoll_ctl(events_fd, EPOLL_CTL_ADD, ev.data.fd, &ev) < 0) {
+				fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+				goto fail;
+			}
+		}
+	}
+
+	return 0;
+
+fail:
+	doors_close();
+	return -1;
+}
+
+static double ms_between(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1e3 + (b->tv_nsec - a->tv_nsec) / 1e6;
+}
+
+static void add_ms(struct timespec *t, int ms)
+{
+	t->tv_sec += ms / 1000;
+	t->tv_nsec += (ms % 1000) * 1000000L;
+	if (t->tv_nsec >= 1000000000L) {
+		t->tv_sec++;
+		t->tv_nsec -= 1000000000L;
+	}
+}
+
+#ifdef ENABLE_SIM
+/* wake up when the first simulated door on 'c' reaches its end */
+static void sim_arm(struct chip *c)
+{
+	struct itimerspec its = { 0 };
+	bool armed = false;
+
+	for (int i = 0; i < ndoors; i++) {
+		struct door *d = &doors[i];
+
+		if ((d->chip != c) || (d->sim_target < 0))
+			continue;
+		if (!armed || (ms_between(&its.it_value, &d->sim_arrival) < 0))
+			its.it_value = d->sim_arrival;
+		armed = true;
 	}
+
+	if (timerfd_settime(c->sim_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		fprintf(stderr, "timerfd_settime: %s\n", strerror(errno));
 }
 
-static void get_state()
+/* an actuator pulse sets a simulated door in motion */
+static void sim_drive(struct door *d, int line)
 {
-	get_sensor_data();
+	struct chip *c = d->chip;
+
+	// it leaves the end position right away
+	c->sim_values[d->in_closed] = 0;
+	c->sim_values[d->in_open] = 0;
+	d->sim_target = (line == d->out_open) ? d->in_open : d->in_closed;
+	clock_gettime(CLOCK_MONOTONIC, &d->sim_arrival);
+	add_ms(&d->sim_arrival, d->conf.travel);
+	sim_arm(c);
+}
 
-	if ((sensor_closed == 1) && (sensor_open == 1)) {
-		fprintf(stderr, "Invalid sensor data: both open and closed.\n");
-		state = 4;
-	} else if (state == 5) {
+static void sim_move(struct chip *c)
+{
+	struct timespec now;
+	uint64_t expired;
+
+	if (read(c->sim_fd, &expired, sizeof(expired)) < 0 && errno != EAGAIN)
+		fprintf(stderr, "timerfd read: %s\n", strerror(errno));
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (int i = 0; i < ndoors; i++) {
+		struct door *d = &doors[i];
+
+		if ((d->chip != c) || (d->sim_target < 0))
+			continue;
+		if (ms_between(&now, &d->sim_arrival) > 0)
+			continue;
+		c->sim_values[d->sim_target] = 1;
+		d->sim_target = -1;
+	}
+
+	sim_arm(c);
+}
+#endif
+
+/* consume the pending edge events, the values are read in bulk after */
+static void drain_events(void)
+{
+	struct epoll_event ev[16];
+	struct gpiod_line_event event;
+	int n;
+
+	while ((n = epoll_wait(events_fd, ev, 16, 0)) > 0) {
+		for (int i = 0; i < n; i++) {
+#ifdef ENABLE_SIM
+			struct chip *sim = NULL;
+
+			for (int j = 0; j < nchips; j++)
+				if (chips[j].sim_fd == ev[i].data.fd)
+					sim = &chips[j];
+			if (sim) {
+				sim_move(sim);
+				continue;
+			}
+#endif
+			gpiod_line_event_read_fd(ev[i].data.fd, &event);
+		}
+	}
+}
+
+static void get_sensor_data(void)
+{
+	for (int n = 0; n < nchips; n++) {
+		struct chip *c = &chips[n];
+		int ret = 0;
+
+#ifdef ENABLE_SIM
+		if (c->sim_fd >= 0)
+			memcpy(c->values, c->sim_values, sizeof(c->values));
+		else
+#endif
+			ret = gpiod_line_get_value_bulk(&c->inputs, c->values);
+
+		for (int i = 0; i < ndoors; i++) {
+			struct door *d = &doors[i];
+
+			if (d->chip != c)
+				continue;
+			if (ret < 0) {
+				fprintf(stderr, "gpiod sensor read on chip %s: %d\n", c->name, ret);
+				d->state = 4;
+				continue;
+			}
+			d->sensor_closed = c->values[d->in_closed];
+			d->sensor_open = c->values[d->in_open];
+		}
+	}
+}
+
+static void get_state(struct door *d)
+{
+	if ((d->sensor_closed == 1) && (d->sensor_open == 1)) {
+		fprintf(stderr, "%s: Invalid sensor data: both open and closed.\n", d->conf.topic);
+		d->state = 4;
+	} else if (d->state == 5) {
 		// initializing
-		if ((sensor_closed == 1) && (sensor_open == 0)) {
-			state = 0;
-		} else if ((sensor_closed == 0) && (sensor_open == 1)) {
-			state = 2;
+		if ((d->sensor_closed == 1) && (d->sensor_open == 0)) {
+			d->state = 0;
+		} else if ((d->sensor_closed == 0) && (d->sensor_open == 1)) {
+			d->state = 2;
 		}
-	} else if (state == 0) {
+	} else if (d->state == 0) {
 		// closed
-		if ((sensor_closed == 1) && (sensor_open == 0)) {
+		if ((d->sensor_closed == 1) && (d->sensor_open == 0)) {
 			return;
-		} else if (sensor_closed == 0) {
-			fprintf(stderr, "Door no longer is closed\n");
-			if (sensor_open == 0) {
-				state = 1;
-			} else if (sensor_open == 1) {
-				state = 2;
+		} else if (d->sensor_closed == 0) {
+			fprintf(stderr, "%s: Door no longer is closed\n", d->conf.topic);
+			if (d->sensor_open == 0) {
+				d->state = 1;
+			} else if (d->sensor_open == 1) {
+				d->state = 2;
 			}
 		}
-	} else if (state == 2) {
+	} else if (d->state == 2) {
 		// open
-		if ((sensor_closed == 0) && (sensor_open == 1)) {
+		if ((d->sensor_closed == 0) && (d->sensor_open == 1)) {
 			return;
-		} else if (sensor_open == 0) {
-			fprintf(stderr, "Door no longer is open\n");
-			if (sensor_closed == 0) {
-				state = 3;
-			} else if (sensor_closed == 1) {
-				state = 0;
+		} else if (d->sensor_open == 0) {
+			fprintf(stderr, "%s: Door no longer is open\n", d->conf.topic);
+			if (d->sensor_closed == 0) {
+				d->state = 3;
+			} else if (d->sensor_closed == 1) {
+				d->state = 0;
 			}
 		}
 	} else {
-		if (state == 1) { // opening
-			if ((sensor_closed == 0) && (sensor_open == 1)) {
-				state = 2;
-				command = false;
+		if (d->state == 1) { // opening
+			if ((d->sensor_closed == 0) && (d->sensor_open == 1)) {
+				d->state = 2;
+				d->command = false;
 			}
-		} else if (state == 3) { // closing
-			if ((sensor_closed == 1) && (sensor_open == 0)) {
-				state = 0;
-				command = false;
+		} else if (d->state == 3) { // closing
+			if ((d->sensor_closed == 1) && (d->sensor_open == 0)) {
+				d->state = 0;
+				d->command = false;
 			}
 		}
 
-		if (command && ((state == 1) || (state == 3))) {
-			time_t t = time(NULL) - command_time;
-			if (t > CHECK_INTERVAL) {
+		if (d->command && ((d->state == 1) || (d->state == 3))) {
+			time_t t = time(NULL) - d->command_time;
+			if (t > d->conf.timeout) {
 				// command should have finished, check it
-				fprintf(stderr, "Command %d did not finish within time.\n", state);
-				state = 4;
-				command = false;
+				fprintf(stderr, "%s: Command %d did not finish within time.\n", d->conf.topic, d->state);
+				d->state = 4;
+				d->command = false;
 			}
 		}
 
 	}
 }
 
-static void publish_state(struct mosquitto *mosq)
+static void publish_state(struct door *d)
 {
-	char *msg = NULL;
+	const char *msg = door_states[d->state];
 
-	if (published_state == state)
+	if (d->published_state == d->state)
 		return;
 
-	// craft msg
-	if (asprintf(&msg, "%s", door_states[state]) < 0)
-		exit(EXIT_FAILURE);
-
 	// send it
-	if (mosquitto_publish(mosq, NULL, topic_state, strlen(msg), msg, 0, true) != 0)
-		exit(EXIT_FAILURE);
+	mqtt_publish(d->state_topic, msg, strlen(msg));
 
-	free(msg);
+	fprintf(stderr, "%s: published state info: %d (%s)\n", d->conf.topic, d->state, msg);
+	d->published_state = d->state;
+}
 
-	fprintf(stderr, "published state info: %d (%s)\n", state, door_states[state]);
-	published_state = state;
+static void set_actuator(struct door *d, int line, int value)
+{
+	struct chip *c = d->chip;
+
+	// the bulk sets every line, the shadow keeps the others as they are
+	c->shadow[line] = value;
+#ifdef ENABLE_SIM
+	if (c->sim_fd >= 0) {
+		if (value)
+			sim_drive(d, line);
+		return;
+	}
+#endif
+	if (gpiod_line_set_value_bulk(&c->outputs, c->shadow) < 0)
+		fprintf(stderr, "%s: gpiod actuator write: %s\n", d->conf.topic, strerror(errno));
 }
 
-static void usl(void *data __attribute__ ((unused)))
+/* arm the timer for the first pulse or pause to end */
+static void arm_timer(void)
 {
-	usleep(25000);
+	struct itimerspec its = { 0 };
+	bool armed = false;
+
+	for (int i = 0; i < ndoors; i++) {
+		struct door *d = &doors[i];
+
+		if ((d->pulse_line < 0) && !d->pulse_pause)
+			continue;
+		if (!armed || (d->pulse_deadline.tv_sec < its.it_value.tv_sec) ||
+		    ((d->pulse_deadline.tv_sec == its.it_value.tv_sec) &&
+		     (d->pulse_deadline.tv_nsec < its.it_value.tv_nsec)))
+			its.it_value = d->pulse_deadline;
+		armed = true;
+	}
+
+	// an all zero value disarms it
+	if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		fprintf(stderr, "timerfd_settime: %s\n", strerror(errno));
+}
+
+/*
+ * Drive an actuator for pulse_width ms without blocking, the timer ends
+ * it. A pulse requested during another one or its pause follows after.
+ */
+static void pulse(struct door *d, int line)
+{
+	if ((d->pulse_line >= 0) || d->pulse_pause) {
+		d->pulse_next = line;
+		return;
+	}
+
+	set_actuator(d, line, 1);
+	clock_gettime(CLOCK_MONOTONIC, &d->pulse_start);
+	d->pulse_line = line;
+	d->pulse_deadline = d->pulse_start;
+	add_ms(&d->pulse_deadline, d->conf.pulse_width);
+	arm_timer();
+}
+
+static void end_pulse(struct door *d)
+{
+	struct timespec now;
+
+	set_actuator(d, d->pulse_line, 0);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	fprintf(stderr, "%s: %s pulse of %.2f ms (%d ms wanted)\n", d->conf.topic,
+		(d->pulse_line == d->out_open) ? "open" : "close",
+		ms_between(&d->pulse_start, &now), d->conf.pulse_width);
+
+	d->pulse_line = -1;
+	d->pulse_pause = true;
+	d->pulse_deadline = now;
+	add_ms(&d->pulse_deadline, d->conf.pulse_width);
+}
+
+static void handle_timer(void)
+{
+	struct timespec now;
+	uint64_t expired;
+
+	if (read(timer_fd, &expired, sizeof(expired)) < 0 && errno != EAGAIN)
+		fprintf(stderr, "timerfd read: %s\n", strerror(errno));
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (int i = 0; i < ndoors; i++) {
+		struct door *d = &doors[i];
+
+		if ((d->pulse_line < 0) && !d->pulse_pause)
+			continue;
+		if (ms_between(&now, &d->pulse_deadline) > 0)
+			continue;
+
+		if (d->pulse_line >= 0) {
+			end_pulse(d);
+		} else {
+			d->pulse_pause = false;
+			if (d->pulse_next >= 0) {
+				int line = d->pulse_next;
+
+				d->pulse_next = -1;
+				pulse(d, line);
+			}
+		}
+	}
+
+	arm_timer();
 }
 
-static void message_callback(
-		struct mosquitto *mosq,
-		void *obj __attribute__ ((unused)),
-		const struct mosquitto_message *message)
+/* never leave an actuator driven when the lines go away */
+static void stop_pulses(void)
 {
+	for (int i = 0; i < ndoors; i++) {
+		struct door *d = &doors[i];
+
+		if (d->pulse_line >= 0)
+			end_pulse(d);
+		d->pulse_pause = false;
+		d->pulse_next = -1;
+	}
+	arm_timer();
+}
+
+static void message_callback(const struct mosquitto_message *message)
+{
+	struct door *d = NULL;
+
+	for (int i = 0; i < ndoors; i++)
+		if (strcmp(message->topic, doors[i].topic_control) == 0)
+			d = &doors[i];
+	if (!d)
+		return;
+
 	if (message->payloadlen != 1) {
 		fprintf(stderr, "Invalid payloadlen: %d\n", message->payloadlen);
+		mqtt_ack("invalid");
 		return;
 	}
 
 	if (((char *)message->payload)[0] == '0') {
 		// close
-		if ((state == 0) || (state == 3)) {
+		if ((d->state == 0) || (d->state == 3)) {
 			// already closing or closed
+			mqtt_ack(door_states[d->state]);
 			return;
 		}
 
-		fprintf(stderr, "Closing door\n");
+		fprintf(stderr, "%s: Closing door\n", d->conf.topic);
 
-		command = true;
-		command_time = time(NULL);
-		state = 3;
-		publish_state(mosq);
+		d->command = true;
+		d->command_time = time(NULL);
+		d->state = 3;
+		publish_state(d);
 		// perform the change
-		gpiod_ctxless_set_value("3", 24, 1, true, GPIOD_CONSUMER, usl, NULL);
-		gpiod_ctxless_set_value("3", 24, 0, true, GPIOD_CONSUMER, usl, NULL);
+		pulse(d, d->out_close);
+		mqtt_ack(door_states[d->state]);
 	} else if (((char *)message->payload)[0] == '1') {
 		// open
-		if ((state == 2) || (state == 1)) {
+		if ((d->state == 2) || (d->state == 1)) {
 			// already opening or open
+			mqtt_ack(door_states[d->state]);
 			return;
 		}
 
-		fprintf(stderr, "Opening door\n");
+		fprintf(stderr, "%s: Opening door\n", d->conf.topic);
 
-		command = true;
-		command_time = time(NULL);
-		state = 1;
-		publish_state(mosq);
+		d->command = true;
+		d->command_time = time(NULL);
+		d->state = 1;
+		publish_state(d);
 		// perform the change
-		gpiod_ctxless_set_value("3", 18, 1, true, GPIOD_CONSUMER, usl, NULL);
-		gpiod_ctxless_set_value("3", 18, 0, true, GPIOD_CONSUMER, usl, NULL);
+		pulse(d, d->out_open);
+		mqtt_ack(door_states[d->state]);
 	} else if (((char *)message->payload)[0] == 'q') {
 		// cancel commands, reset errors, read state
-		if (command) {
-			fprintf(stderr, "Cancelling command and error state\n");
-			command = false;
+		if (d->command) {
+			fprintf(stderr, "%s: Cancelling command and error state\n", d->conf.topic);
+			d->command = false;
 		}
-		state = 5;
-		publish_state(mosq);
+		d->state = 5;
+		publish_state(d);
+		mqtt_ack(door_states[d->state]);
 	} else {
 		fprintf(stderr, "Invalid command received: %c\n", ((char *)message->payload)[0]);
+		mqtt_ack("invalid");
 	}
 }
 
-int main(void)
+static int door_config(const config_setting_t *s, const char *topic, struct door_conf *conf)
 {
-	struct mosquitto *mosq = NULL;
-	int ret;
-	config_t cfg;
-	const char *conf_server;
-	int conf_port;
-	int sl = 1;
+	conf->sensor_closed = conf_setting_int(s, "sensor_closed", 22);
+	conf->sensor_open = conf_setting_int(s, "sensor_open", 15);
+	conf->actuator_close = conf_setting_int(s, "actuator_close", 24);
+	conf->actuator_open = conf_setting_int(s, "actuator_open", 18);
+	conf->timeout = conf_setting_int(s, "timeout", 150);
+	conf->pulse_width = conf_setting_int(s, "pulse_width", 25);
+
+	if ((conf->pulse_width <= 0) || (conf->pulse_width > 10000)) {
+		fprintf(stderr, "Invalid door pulse_width in " CONFIG_PATH "\n");
+		return -1;
+	}
 
-	// parse configs
-	config_init(&cfg);
-	if (!config_read_file(&cfg, CONFIG_PATH)) {
-		fprintf(stderr, "%s:%d - %s\n", config_error_file(&cfg), config_error_line(&cfg), config_error_text(&cfg));
-		exit(EXIT_FAILURE);
+#ifdef ENABLE_SIM
+	conf->travel = conf_setting_int(s, "travel", 2000);
+	if ((conf->travel <= 0) || (conf->travel > 600000)) {
+		fprintf(stderr, "Invalid door travel in " CONFIG_PATH "\n");
+		return -1;
 	}
+#endif
 
-	if (!config_lookup_string(&cfg, "server", &conf_server)) {
-		fprintf(stderr, "No server defined in " CONFIG_PATH "\n");
+	if ((conf->sensor_closed < 0) || (conf->sensor_open < 0) ||
+	    (conf->actuator_close < 0) || (conf->actuator_open < 0)) {
+		fprintf(stderr, "Invalid door GPIO line in " CONFIG_PATH "\n");
+		return -1;
+	}
+
+	conf->chip = strdup(conf_setting_string(s, "chip", "3"));
+	conf->topic = strdup(conf_setting_string(s, "topic", topic));
+	if (!conf->chip || !conf->topic)
 		exit(EXIT_FAILURE);
+
+	return 0;
+}
+
+static void door_config_free(struct door_conf *conf)
+{
+	free(conf->chip);
+	free(conf->topic);
+}
+
+static bool uses_line(const struct door_conf *c, int line)
+{
+	return (c->sensor_closed == line) || (c->sensor_open == line) ||
+		(c->actuator_close == line) || (c->actuator_open == line);
+}
+
+/*
+ * Either a "doors" list, or the single "door" group of old. Returns the
+ * number of doors or -1.
+ */
+static int doors_config(const config_t *cfg, struct door_conf *conf)
+{
+	config_setting_t *list = config_lookup(cfg, "doors");
+	int n = 1;
+
+	if (!list) {
+		if (door_config(config_lookup(cfg, "door"), "door", &conf[0]) < 0)
+			return -1;
+	} else {
+		n = config_setting_length(list);
+		if ((n < 1) || (n > DOORS_MAX)) {
+			fprintf(stderr, "Need 1 to %d doors in " CONFIG_PATH "\n", DOORS_MAX);
+			return -1;
+		}
+		for (int i = 0; i < n; i++) {
+			char topic[16];
+
+			snprintf(topic, sizeof(topic), "door%d", i + 1);
+			if (door_config(config_setting_get_elem(list, i), topic, &conf[i]) < 0) {
+				while (i--)
+					door_config_free(&conf[i]);
+				return -1;
+			}
+		}
 	}
-	if (!config_lookup_int(&cfg, "port", &conf_port)) {
-		fprintf(stderr, "No port defined in " CONFIG_PATH "\n");
+
+	for (int i = 0; i < n; i++) {
+		const struct door_conf *c = &conf[i];
+		int lines[] = { c->sensor_closed, c->sensor_open, c->actuator_close, c->actuator_open };
+		bool bad = false;
+
+		for (int a = 0; a < 4; a++)
+			for (int b = a + 1; b < 4; b++)
+				if (lines[a] == lines[b])
+					bad = true;
+
+		for (int j = 0; j < i; j++) {
+			const struct door_conf *o = &conf[j];
+
+			if (strcmp(c->topic, o->topic) == 0)
+				bad = true;
+			if (strcmp(c->chip, o->chip) != 0)
+				continue;
+			for (int a = 0; a < 4; a++)
+				if (uses_line(o, lines[a]))
+					bad = true;
+		}
+
+		if (bad) {
+			fprintf(stderr, "Door %d reuses a GPIO line or topic in " CONFIG_PATH "\n", i + 1);
+			for (int j = 0; j < n; j++)
+				door_config_free(&conf[j]);
+			return -1;
+		}
+	}
+
+	return n;
+}
+
+static bool same_lines(const struct door_conf *a, const struct door_conf *b)
+{
+	return (strcmp(a->chip, b->chip) == 0) &&
+		(a->sensor_closed == b->sensor_closed) && (a->sensor_open == b->sensor_open) &&
+		(a->actuator_close == b->actuator_close) && (a->actuator_open == b->actuator_open);
+}
+
+static void setup_topics(struct door *d)
+{
+	free(d->topic_state);
+	free(d->topic_control);
+
+	if (asprintf(&d->topic_state, "/%s/%s/state", hostname, d->conf.topic) < 0)
+		exit(EXIT_FAILURE);
+	if (asprintf(&d->topic_control, "/%s/%s/control", hostname, d->conf.topic) < 0)
 		exit(EXIT_FAILURE);
+
+	d->state_topic = mqtt_topic_rename(d->state_topic, d->topic_state, MQTT_OVERWRITE, true, 0);
+
+	fprintf(stderr, "state topic = %s, control topic = %s\n",
+		d->topic_state, d->topic_control);
+}
+
+static const char **control_topics(void)
+{
+	static const char *list[DOORS_MAX + 1];
+
+	for (int i = 0; i < ndoors; i++)
+		list[i] = doors[i].topic_control;
+	list[ndoors] = NULL;
+
+	return list;
+}
+
+/* start over with a new set of doors, state is detected again */
+static void doors_init(struct door_conf *conf, int n)
+{
+	struct mqtt_topic *old[DOORS_MAX];
+
+	for (int i = 0; i < ndoors; i++) {
+		door_config_free(&doors[i].conf);
+		free(doors[i].topic_state);
+		free(doors[i].topic_control);
+	}
+
+	// topics are renamed rather than registered anew
+	for (int i = 0; i < DOORS_MAX; i++)
+		old[i] = doors[i].state_topic;
+
+	memset(doors, 0, sizeof(doors));
+	ndoors = n;
+	for (int i = 0; i < n; i++) {
+		doors[i].conf = conf[i];
+		doors[i].state_topic = old[i];
+		doors[i].state = 5;
+		doors[i].published_state = -1;
+		doors[i].pulse_line = -1;
+		doors[i].pulse_next = -1;
+#ifdef ENABLE_SIM
+		doors[i].sim_target = -1;
+#endif
+		setup_topics(&doors[i]);
 	}
 
-	fprintf(stderr, "MQTT server: %s:%d\n", conf_server, conf_port);
+	// park the topics no door uses now, for doors added later
+	for (int i = 0, k = n; (i < DOORS_MAX) && (k < DOORS_MAX); i++) {
+		bool used = !old[i];
+
+		for (int j = 0; j < k; j++)
+			if (doors[j].state_topic == old[i])
+				used = true;
+		if (!used)
+			doors[k++].state_topic = old[i];
+	}
+}
+
+static void reload_config(void)
+{
+	struct door_conf nconf[DOORS_MAX];
+	struct door_conf oconf[DOORS_MAX];
+	bool lines_changed = false;
+	config_t cfg;
+	int n;
+
+	if (conf_load(&cfg) < 0)
+		return;
+	n = doors_config(&cfg, nconf);
+	config_destroy(&cfg);
+	if (n < 0)
+		return;
+
+	fprintf(stderr, "Reloading " CONFIG_PATH "\n");
+
+	if (n != ndoors)
+		lines_changed = true;
+	for (int i = 0; i < n && !lines_changed; i++)
+		if (!same_lines(&doors[i].conf, &nconf[i]))
+			lines_changed = true;
+
+	if (!lines_changed) {
+		// same hardware, keep the lines and what we know about the doors
+		for (int i = 0; i < n; i++) {
+			struct door *d = &doors[i];
+			bool topic_changed = (strcmp(d->conf.topic, nconf[i].topic) != 0);
+
+			door_config_free(&d->conf);
+			d->conf = nconf[i];
+			if (topic_changed) {
+				setup_topics(d);
+				// the new topic has not seen our state yet
+				d->published_state = -1;
+			}
+		}
+		mqtt_subscribe(control_topics());
+		return;
+	}
+
+	// keep the old config to fall back to
+	for (int i = 0; i < ndoors; i++) {
+		oconf[i] = doors[i].conf;
+		memset(&doors[i].conf, 0, sizeof(doors[i].conf));
+	}
+	int on = ndoors;
+
+	stop_pulses();
+	doors_close();
+	doors_init(nconf, n);
+	if (doors_open() < 0) {
+		fprintf(stderr, "Keeping the previous doors\n");
+		doors_init(oconf, on);
+		if (doors_open() < 0)
+			exit(EXIT_FAILURE);
+	} else {
+		for (int i = 0; i < on; i++)
+			door_config_free(&oconf[i]);
+	}
+
+	mqtt_subscribe(control_topics());
+}
+
+int main(void)
+{
+	config_t cfg;
+	struct mqtt_conf conf;
+	struct door_conf dconf[DOORS_MAX];
+	struct pollfd fds[3];
+	int n;
+
+	// parse configs
+	conf_read(&cfg);
+	mqtt_config(&cfg, &conf);
+	n = doors_config(&cfg, dconf);
+	if (n < 0)
+		exit(EXIT_FAILURE);
+
+	fds[0].fd = conf_watch();
+	fds[0].events = POLLIN;
+
+	events_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (events_fd < 0)
+		exit(EXIT_FAILURE);
+	fds[1].fd = events_fd;
+	fds[1].events = POLLIN;
+
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd < 0)
+		exit(EXIT_FAILURE);
+	fds[2].fd = timer_fd;
+	fds[2].events = POLLIN;
 
 	// what to do if terminated
 	signal(SIGINT, sigfunc);
 	signal(SIGTERM, sigfunc);
 
 	// use system hostname here
-	char hostname[HOST_NAME_MAX+1];
 	hostname[HOST_NAME_MAX] = 0;
 	if (gethostname(hostname, HOST_NAME_MAX) != 0)
 		exit(EXIT_FAILURE);
 
-	// setup topics
-	if (!asprintf(&topic_state, "/%s/door/state", hostname))
-		exit(EXIT_FAILURE);
-	if (!asprintf(&topic_control, "/%s/door/control", hostname))
+	doors_init(dconf, n);
+	if (doors_open() < 0)
 		exit(EXIT_FAILURE);
 
 	/* setup mqtt */
-	mosquitto_lib_init();
-	mosq = mosquitto_new(NULL, true, NULL);
-	if (!mosq)
-		exit(EXIT_FAILURE);
+	mqtt_connect(&conf, control_topics(), message_callback);
 
-	mosquitto_message_callback_set(mosq, message_callback);
+	for (;;) {
+		// sensor edges wake us right away, the timeout catches stuck commands
+		mqtt_loop(5000, fds, 3);
 
-	while (mosquitto_connect(mosq, conf_server, conf_port, 15) != 0) {
-		if (sl == 1)
-			fprintf(stderr, "Waiting for connection to server\n");
-		if (sl < 32)
-			sl <<= 1;
-		sleep(sl);
-	}
+		if (fds[2].revents & POLLIN)
+			handle_timer();
 
-	ret = mosquitto_subscribe(mosq, NULL, topic_control, 0);
-	if (ret != 0)
-		fprintf(stderr, "mosquitto_subscribe: %d: %s\n", ret, strerror(errno));
+		if ((fds[0].revents & POLLIN) && conf_changed(fds[0].fd))
+			reload_config();
 
-	fprintf(stderr, "connected, state topic = %s, control topic = %s\n",
-		topic_state, topic_control);
+		if (fds[1].revents & POLLIN)
+			drain_events();
 
-	for (;;) {
-		ret = mosquitto_loop(mosq, 5000, 1);
-		if ((ret == MOSQ_ERR_CONN_LOST) || (ret == MOSQ_ERR_NO_CONN)) {
-			sleep(5);
-			mosquitto_reconnect(mosq);
-		} else if (ret != MOSQ_ERR_SUCCESS) {
-			fprintf(stderr, "mosquitto_loop(): %d, %s\n", ret, strerror(errno));
-			exit(EXIT_FAILURE);
+		get_sensor_data();
+		for (int i = 0; i < ndoors; i++) {
+			get_state(&doors[i]);
+			publish_state(&doors[i]);
 		}
-		
-		get_state();
-		publish_state(mosq);
 
 		if (stop == 1)
 			break;
 	}
 
-	mosquitto_disconnect(mosq);
-	mosquitto_loop_stop(mosq, false);
-	mosquitto_destroy(mosq);
-	mosquitto_lib_cleanup();
+	mqtt_close();
+
+	stop_pulses();
+	doors_close();
+	doors_init(NULL, 0);
+	close(events_fd);
+	close(timer_fd);
 
 	config_destroy(&cfg);
 }
-
@@ -28,93 +28,236 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
 
 #include <modbus.h>
 
+#include "bus.h"
+#include "renogy.h"
+#include "snapshot.h"
 
-int main(void) {
-	modbus_t *ctx;
-	int ret;
+static volatile sig_atomic_t stop = 0;
 
-	ctx = modbus_new_rtu("/dev/ttyS1", 9600, 'N', 8, 1);
-	if (!ctx) {
-		perror("Unable to create the libmodbus context\n");
-		exit(EXIT_FAILURE);
+static void sigfunc(int s __attribute__ ((unused)))
+{
+	stop = 1;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: panel-dump\n"
+		"       panel-dump -a <file> [-i <seconds>]  append snapshots\n"
+		"       panel-dump -d <file>                 registers changed between snapshots\n"
+		"       panel-dump -r <file>                 decode recorded snapshots\n");
+	exit(EXIT_FAILURE);
+}
+
+static void print_time(FILE *f, int64_t time_ns)
+{
+	time_t t = time_ns / 1000000000;
+	struct tm tm;
+	char buf[32];
+
+	localtime_r(&t, &tm);
+	strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+	fprintf(f, "%s.%03d", buf, (int)(time_ns / 1000000 % 1000));
+}
+
+static void print_snapshot(const struct snapshot *s)
+{
+	const uint16_t *regs = s->ident;
+	char model[17];
+
+	if (s->valid & SNAPSHOT_IDENT) {
+		/* identify the charge controller */
+		memcpy(model, regs, 16);
+		model[16] = 0;
+		fprintf(stderr, "Model: \"%s\"\n", model);
+
+		/* software/hardware version */
+		fprintf(stderr, "Software version: V%02d.%02d.%02d\n",
+			MODBUS_GET_LOW_BYTE(regs[8]),
+			MODBUS_GET_HIGH_BYTE(regs[9]),
+			MODBUS_GET_LOW_BYTE(regs[9]));
+		fprintf(stderr, "Hardware version: V%02d.%02d.%02d\n",
+			MODBUS_GET_LOW_BYTE(regs[10]),
+			MODBUS_GET_HIGH_BYTE(regs[11]),
+			MODBUS_GET_LOW_BYTE(regs[11]));
+
+		/* serial nr */
+		fprintf(stderr, "Serial number: %08x\n", regs[12] * 65536 + regs[13]);
 	}
 
-	modbus_set_slave(ctx, 1);
+	/* various levels */
+	for (int i = 0; i < SNAPSHOT_LIVE_COUNT; i++) {
+		fprintf(stderr, "Reg %04x: %04x\n", i + SNAPSHOT_LIVE_BASE, s->live[i]);
+	}
 
-	if (modbus_connect(ctx) == -1) {
-		fprintf(stderr, "Connection failed: %s\n", modbus_strerror(errno));
-		modbus_free(ctx);
-		exit(EXIT_FAILURE);
+	/* EEPROM */
+	if (s->valid & SNAPSHOT_EEPROM) {
+		fprintf(stderr, "\n\nEEPROM:\n");
+		for (int i = 0; i < SNAPSHOT_EEPROM_COUNT; i++) {
+			fprintf(stderr, "Reg %04x: %04x\n", i + SNAPSHOT_EEPROM_BASE, s->eeprom[i]);
+		}
 	}
+}
 
-	/* identify the charge controller */
-	uint16_t regs[64];
-	memset(regs, 0, sizeof(regs));
-	ret = modbus_read_registers(ctx, 0x0c, 0x08, regs);
-	if (ret < 0) {
-		fprintf(stderr, "Failed to read registers: %s\n", modbus_strerror(errno));
-		modbus_free(ctx);
-		exit(EXIT_FAILURE);
+static void diff_block(const struct snapshot *a, const struct snapshot *b, int base, int count)
+{
+	for (int addr = base; addr < base + count; addr++) {
+		int old = snapshot_reg(a, addr);
+		int new = snapshot_reg(b, addr);
+
+		// a block missing from either side is no change
+		if ((old < 0) || (new < 0) || (old == new))
+			continue;
+
+		print_time(stdout, b->time_ns);
+		printf(" %04x: %04x -> %04x\n", addr, old, new);
 	}
+}
 
-	fprintf(stderr, "Model: \"%s\"\n", (char *)regs);
+static int diff(const char *path)
+{
+	const struct snapshot *s;
+	size_t count;
 
-	/* software/hardware version */
-	memset(regs, 0, sizeof(regs));
-	ret = modbus_read_registers(ctx, 0x14, 0x02, regs);
-	if (ret < 0) {
-		fprintf(stderr, "Failed to read registers: %s\n", modbus_strerror(errno));
-		modbus_free(ctx);
-		exit(EXIT_FAILURE);
+	s = snapshot_map(path, &count);
+	if (!s)
+		return -1;
+
+	for (size_t i = 1; i < count; i++) {
+		diff_block(&s[i - 1], &s[i], SNAPSHOT_IDENT_BASE, SNAPSHOT_IDENT_COUNT);
+		diff_block(&s[i - 1], &s[i], SNAPSHOT_LIVE_BASE, SNAPSHOT_LIVE_COUNT);
+		diff_block(&s[i - 1], &s[i], SNAPSHOT_EEPROM_BASE, SNAPSHOT_EEPROM_COUNT);
 	}
 
-	fprintf(stderr, "Software version: V%02d.%02d.%02d\n",
-		MODBUS_GET_LOW_BYTE(regs[0]),
-		MODBUS_GET_HIGH_BYTE(regs[1]),
-		MODBUS_GET_LOW_BYTE(regs[1]));
-	fprintf(stderr, "Hardware version: V%02d.%02d.%02d\n",
-		MODBUS_GET_LOW_BYTE(regs[2]),
-		MODBUS_GET_HIGH_BYTE(regs[3]),
-		MODBUS_GET_LOW_BYTE(regs[3]));
-
-	/* serial nr */
-	ret = modbus_read_registers(ctx, 0x18, 0x02, regs);
-	if (ret < 0) {
-		fprintf(stderr, "Failed to read registers: %s\n", modbus_strerror(errno));
-		modbus_free(ctx);
-		exit(EXIT_FAILURE);
+	snapshot_unmap(s, count);
+	return 0;
+}
+
+/* feed the recorded live blocks through the same decoder panel-pub uses */
+static int replay(const char *path)
+{
+	const struct snapshot *s;
+	struct renogy_sample sample;
+	size_t count;
+
+	s = snapshot_map(path, &count);
+	if (!s)
+		return -1;
+
+	for (size_t i = 0; i < count; i++) {
+		char *msg;
+
+		if (!(s[i].valid & SNAPSHOT_LIVE))
+			continue;
+
+		renogy_decode(s[i].live, &sample);
+		msg = renogy_json(&sample);
+		print_time(stdout, s[i].time_ns);
+		printf(" %s\n", msg);
+		free(msg);
 	}
 
-	fprintf(stderr, "Serial number: %08x\n", regs[0] * 65536 + regs[1]);
+	snapshot_unmap(s, count);
+	return 0;
+}
+
+static modbus_t *open_bus(void)
+{
+	struct bus_conf conf;
+	modbus_t *ctx;
 
-	/* various levels */
-	memset(regs, 0, sizeof(regs));
-	ret = modbus_read_registers(ctx, 0x100, 0x22, regs);
-	if (ret < 0) {
-		fprintf(stderr, "Failed to read registers: %s\n", modbus_strerror(errno));
-		modbus_free(ctx);
+	bus_config_load(&conf);
+	ctx = bus_open(&conf);
+	if (!ctx)
 		exit(EXIT_FAILURE);
+	bus_config_free(&conf);
+
+	return ctx;
+}
+
+static int record(const char *path, int interval)
+{
+	modbus_t *ctx = open_bus();
+	struct snapshot s;
+	int ret = 0;
+
+	signal(SIGINT, sigfunc);
+	signal(SIGTERM, sigfunc);
+
+	while (!stop) {
+		ret = snapshot_read(ctx, &s);
+		if (ret == 0) {
+			ret = snapshot_append(path, &s);
+			if (ret < 0)
+				break;
+		} else if (interval > 0) {
+			// a noisy line loses a read now and then, keep recording
+			fprintf(stderr, "Skipping a record, the live block could not be read\n");
+			ret = 0;
+		}
+		if (interval == 0)
+			break;
+		sleep(interval);
 	}
 
-	for (int i = 0; i <= 0x22; i++) {
-		fprintf(stderr, "Reg %04x: %04x\n", i + 0x100, regs[i]);
+	modbus_close(ctx);
+	modbus_free(ctx);
+
+	return ret;
+}
+
+int main(int argc, char *argv[]) {
+	const char *append = NULL;
+	const char *diff_file = NULL;
+	const char *replay_file = NULL;
+	int interval = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "a:i:d:r:")) != -1) {
+		switch (opt) {
+		case 'a':
+			append = optarg;
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			if (interval <= 0)
+				usage();
+			break;
+		case 'd':
+			diff_file = optarg;
+			break;
+		case 'r':
+			replay_file = optarg;
+			break;
+		default:
+			usage();
+		}
 	}
+	if ((optind != argc) || (!!append + !!diff_file + !!replay_file > 1) ||
+			(interval && !append))
+		usage();
 
-	/* EEPROM */
-	memset(regs, 0, sizeof(regs));
-	ret = modbus_read_registers(ctx, 0xe001, 0x21, regs);
-	if (ret != 0x21)
-		fprintf(stderr, "Read error %d, %s\n", ret, strerror(errno));
-
-	fprintf(stderr, "\n\nEEPROM:\n");
-	for (int i = 0; i <= 0x21; i++) {
-		fprintf(stderr, "Reg %04x: %04x\n", i + 0xe001, regs[i]);
+	if (diff_file)
+		exit(diff(diff_file) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+	if (replay_file)
+		exit(replay(replay_file) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+	if (append)
+		exit(record(append, interval) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+
+	modbus_t *ctx = open_bus();
+	struct snapshot s;
+
+	if (snapshot_read(ctx, &s) < 0) {
+		modbus_free(ctx);
+		exit(EXIT_FAILURE);
 	}
+	print_snapshot(&s);
 
 	modbus_close(ctx);
 	modbus_free(ctx);
 }
-
@@ -0,0 +1,283 @@
+
+/**
+
+Copyright 2019 - Auke Kok <sofar@foo-projects.org
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject
+to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "energy.h"
+#include "cbor.h"
+#include "schema.h"
+
+#define CHECKPOINT_VERSION 1
+
+static time_t bucket_start(enum energy_kind kind, time_t t)
+{
+	struct tm tm;
+
+	localtime_r(&t, &tm);
+
+	// mktime() can't tell the two 1:00s apart when the clocks go back
+	if (kind == ENERGY_HOUR)
+		return t - (t + tm.tm_gmtoff) % 3600;
+
+	tm.tm_sec = 0;
+	tm.tm_min = 0;
+	tm.tm_hour = 0;
+	tm.tm_isdst = -1;
+
+	return mktime(&tm);
+}
+
+static time_t bucket_end(enum energy_kind kind, time_t start)
+{
+	struct tm tm;
+
+	if (kind == ENERGY_HOUR)
+		return start + 3600;
+
+	// days are not always 24h long
+	localtime_r(&start, &tm);
+	tm.tm_mday++;
+	tm.tm_isdst = -1;
+
+	return mktime(&tm);
+}
+
+static void bucket_reset(struct energy_bucket *b, time_t start)
+{
+	memset(b, 0, sizeof(*b));
+	b->start = start;
+}
+
+void energy_init(struct energy *e, int max_gap)
+{
+	memset(e, 0, sizeof(*e));
+	e->max_gap = max_gap;
+}
+
+/* close buckets that end at or before 't' and start the ones holding 't' */
+static void roll(struct energy *e, double t, energy_cb cb)
+{
+	for (int k = 0; k < ENERGY_KINDS; k++) {
+		struct energy_bucket *b = &e->bucket[k];
+
+		if (b->start == 0) {
+			bucket_reset(b, bucket_start(k, t));
+			continue;
+		}
+
+		if (t < (double)bucket_end(k, b->start))
+			continue;
+
+		if (cb)
+			cb(k, b);
+		bucket_reset(b, bucket_start(k, t));
+	}
+}
+
+static void integrate(struct energy *e, double t0, const double *p0, double t1, const double *p1)
+{
+	double dt = t1 - t0;
+
+	for (int k = 0; k < ENERGY_KINDS; k++)
+		e->bucket[k].covered += dt;
+
+	for (int c = 0; c < ENERGY_CHANNELS; c++) {
+		double wh = (p0[c] + p1[c]) / 2. * dt / 3600.;
+
+		for (int k = 0; k < ENERGY_KINDS; k++)
+			e->bucket[k].wh[c] += wh;
+		e->total_wh[c] += wh;
+	}
+}
+
+void energy_add(struct energy *e, double t, const double power[ENERGY_CHANNELS], energy_cb cb)
+{
+	double t0 = e->last_time;
+	double p0[ENERGY_CHANNELS];
+
+	memcpy(p0, e->last_power, sizeof(p0));
+
+	if ((t0 == 0.) || (t <= t0) || (t - t0 > e->max_gap)) {
+		// nothing to integrate, either the first sample or a gap
+		roll(e, t, cb);
+	} else {
+		// split the interval at every bucket boundary inside it
+		while (t0 < t) {
+			double end = t;
+
+			roll(e, t0, cb);
+			for (int k = 0; k < ENERGY_KINDS; k++) {
+				double b = bucket_end(k, e->bucket[k].start);
+				if (b < end)
+					end = b;
+			}
+
+			double p[ENERGY_CHANNELS];
+			for (int c = 0; c < ENERGY_CHANNELS; c++)
+				p[c] = p0[c] + (power[c] - p0[c]) * (end - t0) / (t - t0);
+
+			integrate(e, t0, p0, end, p);
+
+			t0 = end;
+			memcpy(p0, p, sizeof(p0));
+		}
+		roll(e, t, cb);
+	}
+
+	e->last_time = t;
+	memcpy(e->last_power, power, sizeof(e->last_power));
+}
+
+int energy_load(struct energy *e, const char *path)
+{
+	FILE *f = fopen(path, "r");
+	struct energy n;
+	int version;
+	long long start[ENERGY_KINDS];
+	int ret = 0;
+
+	if (!f)
+		return -1;
+
+	energy_init(&n, e->max_gap);
+	if (fscanf(f, "%d %lf", &version, &n.last_time) != 2 || version != CHECKPOINT_VERSION)
+		ret = -1;
+	for (int c = 0; (ret == 0) && (c < ENERGY_CHANNELS); c++)
+		if (fscanf(f, "%lf %lf", &n.last_power[c], &n.total_wh[c]) != 2)
+			ret = -1;
+	for (int k = 0; (ret == 0) && (k < ENERGY_KINDS); k++) {
+		struct energy_bucket *b = &n.bucket[k];
+
+		if (fscanf(f, "%lld %lf", &start[k], &b->covered) != 2)
+			ret = -1;
+		b->start = start[k];
+		for (int c = 0; (ret == 0) && (c < ENERGY_CHANNELS); c++)
+			if (fscanf(f, "%lf", &b->wh[c]) != 1)
+				ret = -1;
+	}
+	fclose(f);
+
+	if (ret == 0)
+		*e = n;
+	else
+		fprintf(stderr, "Ignoring malformed energy checkpoint %s\n", path);
+
+	return ret;
+}
+
+int energy_save(const struct energy *e, const char *path)
+{
+	char *tmp = NULL;
+	FILE *f;
+
+	if (asprintf(&tmp, "%s.tmp", path) < 0)
+		exit(EXIT_FAILURE);
+
+	f = fopen(tmp, "w");
+	if (!f) {
+		fprintf(stderr, "Unable to write %s: %s\n", tmp, strerror(errno));
+		free(tmp);
+		return -1;
+	}
+
+	fprintf(f, "%d %.3f\n", CHECKPOINT_VERSION, e->last_time);
+	for (int c = 0; c < ENERGY_CHANNELS; c++)
+		fprintf(f, "%.3f %.6f\n", e->last_power[c], e->total_wh[c]);
+	for (int k = 0; k < ENERGY_KINDS; k++) {
+		const struct energy_bucket *b = &e->bucket[k];
+
+		fprintf(f, "%lld %.3f", (long long)b->start, b->covered);
+		for (int c = 0; c < ENERGY_CHANNELS; c++)
+			fprintf(f, " %.6f", b->wh[c]);
+		fprintf(f, "\n");
+	}
+
+	// replace atomically so a crash never leaves half a checkpoint
+	if ((fclose(f) != 0) || (rename(tmp, path) != 0)) {
+		fprintf(stderr, "Unable to write %s: %s\n", path, strerror(errno));
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+
+	free(tmp);
+	return 0;
+}
+
+char *energy_json(enum energy_kind kind, const struct energy_bucket *b)
+{
+	char *msg = NULL;
+
+	if (asprintf(&msg,
+			"{"
+			"\"start\":\"%lld\","
+			"\"period\":\"%s\","
+			"\"covered\":\"%.0f\","
+			"\"panel_wh\":\"%.3f\","
+			"\"load_wh\":\"%.3f\","
+			"\"battery_wh\":\"%.3f\""
+			"}",
+			(long long)b->start,
+			(kind == ENERGY_HOUR) ? "hour" : "day",
+			b->covered,
+			b->wh[ENERGY_PANEL], b->wh[ENERGY_LOAD], b->wh[ENERGY_BATTERY]) < 0)
+		exit(EXIT_FAILURE);
+
+	return msg;
+}
+
+size_t energy_cbor(enum energy_kind kind, const struct energy_bucket *b, uint8_t *buf, size_t size)
+{
+	struct cbor c;
+
+	cbor_init(&c, buf, size);
+	cbor_map(&c, ENERGY_KEY_MAX);
+
+	cbor_uint(&c, SCHEMA_KEY);
+	cbor_uint(&c, SCHEMA_ENERGY);
+	cbor_uint(&c, ENERGY_START);
+	cbor_int(&c, b->start);
+	cbor_uint(&c, ENERGY_PERIOD);
+	cbor_uint(&c, kind);
+	cbor_uint(&c, ENERGY_COVERED);
+	cbor_uint(&c, (uint64_t)b->covered);
+	cbor_uint(&c, ENERGY_PANEL_WH);
+	cbor_float(&c, b->wh[ENERGY_PANEL]);
+	cbor_uint(&c, ENERGY_LOAD_WH);
+	cbor_float(&c, b->wh[ENERGY_LOAD]);
+	cbor_uint(&c, ENERGY_BATTERY_WH);
+	cbor_float(&c, b->wh[ENERGY_BATTERY]);
+
+	if (!cbor_ok(&c))
+		return 0;
+	return c.len;
+}
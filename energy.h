@@ -0,0 +1,86 @@
+
+/**
+
+Copyright 2019 - Auke Kok <sofar@foo-projects.org
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject
+to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**/
+
+#ifndef ENERGY_H
+#define ENERGY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Streaming energy integrator. Power samples are integrated with the
+ * trapezoidal rule into hourly and daily buckets (local time). A sample
+ * interval that straddles a bucket boundary is split at the boundary.
+ * Intervals longer than the maximum gap are not integrated at all, the
+ * 'covered' seconds of a bucket tell how much of it was actually seen.
+ */
+
+enum energy_channel {
+	ENERGY_PANEL,
+	ENERGY_LOAD,
+	ENERGY_BATTERY,
+	ENERGY_CHANNELS
+};
+
+enum energy_kind {
+	ENERGY_HOUR,
+	ENERGY_DAY,
+	ENERGY_KINDS
+};
+
+struct energy_bucket {
+	time_t start;
+	double covered;                // seconds integrated
+	double wh[ENERGY_CHANNELS];
+};
+
+struct energy {
+	double last_time;              // 0 until the first sample
+	double last_power[ENERGY_CHANNELS];
+	struct energy_bucket bucket[ENERGY_KINDS];
+	double total_wh[ENERGY_CHANNELS];
+	int max_gap;
+};
+
+/* called for every completed bucket */
+typedef void (*energy_cb)(enum energy_kind kind, const struct energy_bucket *b);
+
+void energy_init(struct energy *e, int max_gap);
+
+/* add a sample taken at wall clock time 't' (seconds) */
+void energy_add(struct energy *e, double t, const double power[ENERGY_CHANNELS], energy_cb cb);
+
+/* checkpoint file, returns -1 on failure */
+int energy_load(struct energy *e, const char *path);
+int energy_save(const struct energy *e, const char *path);
+
+/* JSON / CBOR message for a completed bucket */
+char *energy_json(enum energy_kind kind, const struct energy_bucket *b);
+size_t energy_cbor(enum energy_kind kind, const struct energy_bucket *b, uint8_t *buf, size_t size);
+
+#endif
@@ -0,0 +1,116 @@
+
+/**
+
+Copyright 2019 - Auke Kok <sofar@foo-projects.org
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject
+to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**/
+
+/*
+ * Checks of the energy integrator across daylight saving changes: every
+ * hour bucket starts on a local hour and holds one hour, and the days
+ * the clocks change are 23 and 25 hours long.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+
+#include "energy.h"
+
+#define PANEL_W 100.
+#define STEP 60
+
+static const char *name;
+static bool failed = false;
+static time_t last_hour = 0;
+static int hours = 0;
+static int days = 0;
+static double day_covered[2];
+
+static void fail(const char *what, time_t start)
+{
+	fprintf(stderr, "%s: %s, bucket at %lld\n", name, what, (long long)start);
+	failed = true;
+}
+
+static void bucket(enum energy_kind kind, const struct energy_bucket *b)
+{
+	struct tm tm;
+
+	if (fabs(b->wh[ENERGY_PANEL] - PANEL_W * b->covered / 3600.) > 1e-6)
+		fail("energy does not match the covered time", b->start);
+
+	if (kind == ENERGY_DAY) {
+		if (days < 2)
+			day_covered[days] = b->covered;
+		days++;
+		return;
+	}
+
+	localtime_r(&b->start, &tm);
+	if ((tm.tm_min != 0) || (tm.tm_sec != 0))
+		fail("hour does not start on the hour", b->start);
+	if (b->covered != 3600.)
+		fail("hour does not hold 3600 s", b->start);
+	if (last_hour && (b->start != last_hour + 3600))
+		fail("hours are not consecutive", b->start);
+	last_hour = b->start;
+	hours++;
+}
+
+/* two days from local midnight 'from', the second one has 'len' hours */
+static void run(const char *what, time_t from, int len)
+{
+	double power[ENERGY_CHANNELS] = { PANEL_W, 0., 0. };
+	struct energy e;
+
+	name = what;
+	last_hour = 0;
+	hours = 0;
+	days = 0;
+
+	energy_init(&e, 2 * STEP);
+	for (time_t t = from; t <= from + (24 + len) * 3600; t += STEP)
+		energy_add(&e, t, power, bucket);
+
+	if (hours != 24 + len)
+		fail("wrong number of hours", from);
+	if ((days != 2) || (day_covered[0] != 24 * 3600.) || (day_covered[1] != len * 3600.))
+		fail("wrong day length", from);
+}
+
+int main(void)
+{
+	// no zoneinfo needed, the US rules as a POSIX TZ
+	setenv("TZ", "EST5EDT,M3.2.0,M11.1.0", 1);
+	tzset();
+
+	run("spring forward", 1772859600, 23); // 2026-03-07 00:00 EST
+	run("fall back", 1793419200, 25);      // 2026-10-31 00:00 EDT
+
+	if (failed)
+		exit(EXIT_FAILURE);
+	printf("energy buckets OK\n");
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,338 @@
+
+/**
+
+Copyright 2019 - Auke Kok <sofar@foo-projects.org
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject
+to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "events.h"
+#include "conf.h"
+#include "cbor.h"
+#include "schema.h"
+
+// sample values a threshold rule can watch
+static const struct {
+	const char *name;
+	size_t offset;
+	bool is_float;
+} fields[] = {
+	{ "battery_capacity", offsetof(struct renogy_sample, battery_capacity), false },
+	{ "battery_voltage", offsetof(struct renogy_sample, battery_voltage), true },
+	{ "battery_current", offsetof(struct renogy_sample, battery_current), true },
+	{ "controller_temperature", offsetof(struct renogy_sample, controller_temperature), false },
+	{ "load_voltage", offsetof(struct renogy_sample, load_voltage), true },
+	{ "load_current", offsetof(struct renogy_sample, load_current), true },
+	{ "load_power", offsetof(struct renogy_sample, load_power), false },
+	{ "panel_voltage", offsetof(struct renogy_sample, panel_voltage), true },
+	{ "panel_current", offsetof(struct renogy_sample, panel_current), true },
+	{ "panel_power", offsetof(struct renogy_sample, panel_power), false },
+};
+
+#define FIELDS (int)(sizeof(fields) / sizeof(fields[0]))
+
+static const char *rule_types[] = {
+	[RULE_FAULT] = "fault",
+	[RULE_STATE] = "state",
+	[RULE_ABOVE] = "above",
+	[RULE_BELOW] = "below",
+};
+
+static double field_value(int field, const struct renogy_sample *s)
+{
+	const char *p = (const char *)s + fields[field].offset;
+
+	if (fields[field].is_float)
+		return *(const float *)p;
+	return *(const int *)p;
+}
+
+static int rule_config(const config_setting_t *s, int index, struct event_rule *r)
+{
+	const char *type = conf_setting_string(s, "type", "");
+	const char *field = conf_setting_string(s, "field", "");
+	int t;
+
+	memset(r, 0, sizeof(*r));
+
+	for (t = 0; t <= RULE_BELOW; t++)
+		if (strcmp(type, rule_types[t]) == 0)
+			break;
+	if (t > RULE_BELOW) {
+		fprintf(stderr, "Unknown type \"%s\" of event %d in " CONFIG_PATH "\n", type, index);
+		return -1;
+	}
+	r->type = t;
+
+	r->field = -1;
+	if ((r->type == RULE_ABOVE) || (r->type == RULE_BELOW)) {
+		for (int f = 0; f < FIELDS; f++)
+			if (strcmp(field, fields[f].name) == 0)
+				r->field = f;
+		if (r->field < 0) {
+			fprintf(stderr, "Unknown field \"%s\" of event %d in " CONFIG_PATH "\n", field, index);
+			return -1;
+		}
+	}
+
+	r->mask = conf_setting_int(s, "mask", (1 << RENOGY_FAULT_BITS) - 1);
+	r->threshold = conf_setting_float(s, "threshold", 0);
+	r->hysteresis = conf_setting_float(s, "hysteresis", 0);
+	r->alpha = conf_setting_float(s, "alpha", 1);
+	r->holdoff = conf_setting_int(s, "holdoff", 60);
+	if ((r->hysteresis < 0) || (r->alpha <= 0) || (r->alpha > 1) || (r->holdoff < 0)) {
+		fprintf(stderr, "Invalid hysteresis, alpha or holdoff of event %d in " CONFIG_PATH "\n", index);
+		return -1;
+	}
+
+	r->name = strdup(conf_setting_string(s, "name", (r->field >= 0) ? fields[r->field].name : type));
+	if (!r->name)
+		exit(EXIT_FAILURE);
+
+	return 0;
+}
+
+int events_config(const config_t *cfg, struct events *ev)
+{
+	config_setting_t *list = config_lookup(cfg, "panel.events");
+
+	ev->rules = NULL;
+	ev->count = 0;
+
+	if (!list) {
+		// report faults and state changes unless told otherwise
+		ev->rules = calloc(2, sizeof(*ev->rules));
+		if (!ev->rules)
+			exit(EXIT_FAILURE);
+		ev->rules[0].name = strdup("fault");
+		ev->rules[0].type = RULE_FAULT;
+		ev->rules[0].mask = (1 << RENOGY_FAULT_BITS) - 1;
+		ev->rules[1].name = strdup("state");
+		ev->rules[1].type = RULE_STATE;
+		if (!ev->rules[0].name || !ev->rules[1].name)
+			exit(EXIT_FAILURE);
+		for (int i = 0; i < 2; i++) {
+			ev->rules[i].alpha = 1;
+			ev->rules[i].holdoff = 60;
+		}
+		ev->count = 2;
+		return 0;
+	}
+
+	int n = config_setting_length(list);
+
+	if (n == 0)
+		return 0;
+
+	ev->rules = calloc(n, sizeof(*ev->rules));
+	if (!ev->rules)
+		exit(EXIT_FAILURE);
+
+	for (int i = 0; i < n; i++) {
+		if (rule_config(config_setting_get_elem(list, i), i, &ev->rules[i]) < 0) {
+			events_free(ev);
+			return -1;
+		}
+		ev->count++;
+	}
+
+	return 0;
+}
+
+void events_free(struct events *ev)
+{
+	for (int i = 0; i < ev->count; i++)
+		free(ev->rules[i].name);
+	free(ev->rules);
+	ev->rules = NULL;
+	ev->count = 0;
+}
+
+void events_keep(struct events *ev, const struct events *old)
+{
+	for (int i = 0; i < ev->count; i++) {
+		struct event_rule *r = &ev->rules[i];
+
+		for (int j = 0; j < old->count; j++) {
+			const struct event_rule *o = &old->rules[j];
+
+			if ((strcmp(r->name, o->name) != 0) || (r->type != o->type))
+				continue;
+			r->primed = o->primed;
+			r->ewma = o->ewma;
+			r->current = o->current;
+			r->reported = o->reported;
+			r->active = o->active;
+			r->reported_active = o->reported_active;
+			r->last_event = o->last_event;
+		}
+	}
+}
+
+static void describe(const struct event_rule *r, struct event *e)
+{
+	size_t len = 0;
+
+	e->detail[0] = 0;
+
+	switch (r->type) {
+	case RULE_FAULT:
+		for (int b = 0; b < RENOGY_FAULT_BITS; b++) {
+			if (!((int)r->current & (1 << b)))
+				continue;
+			len += snprintf(e->detail + len, sizeof(e->detail) - len, "%s%s",
+				len ? ", " : "", renogy_fault(b));
+			if (len >= sizeof(e->detail))
+				break;
+		}
+		if (len == 0)
+			snprintf(e->detail, sizeof(e->detail), "none");
+		break;
+	case RULE_STATE:
+		snprintf(e->detail, sizeof(e->detail), "%s", renogy_charging_state(r->current));
+		break;
+	case RULE_ABOVE:
+	case RULE_BELOW:
+		snprintf(e->detail, sizeof(e->detail), "%s %s %g", fields[r->field].name,
+			rule_types[r->type], r->threshold);
+		break;
+	}
+}
+
+void events_check(struct events *ev, double t, const struct renogy_sample *s, event_cb cb)
+{
+	for (int i = 0; i < ev->count; i++) {
+		struct event_rule *r = &ev->rules[i];
+		bool changed;
+
+		switch (r->type) {
+		case RULE_FAULT:
+			r->current = s->errors & r->mask;
+			r->active = (r->current != 0);
+			break;
+		case RULE_STATE:
+			r->current = s->charging_state;
+			r->active = true;
+			// the first state seen is no transition
+			if (!r->primed) {
+				r->reported = r->current;
+				r->reported_active = true;
+			}
+			break;
+		case RULE_ABOVE:
+		case RULE_BELOW: {
+			double x = field_value(r->field, s);
+
+			r->ewma = r->primed ? r->alpha * x + (1 - r->alpha) * r->ewma : x;
+			r->current = r->ewma;
+			// it has to get back past the hysteresis band to clear
+			if (r->type == RULE_ABOVE)
+				r->active = r->active ? (r->ewma > r->threshold - r->hysteresis) : (r->ewma > r->threshold);
+			else
+				r->active = r->active ? (r->ewma < r->threshold + r->hysteresis) : (r->ewma < r->threshold);
+			break;
+		}
+		}
+		r->primed = true;
+
+		if ((r->type == RULE_FAULT) || (r->type == RULE_STATE))
+			changed = (r->current != r->reported);
+		else
+			changed = (r->active != r->reported_active);
+
+		// held back changes get another chance with the next sample
+		if (!changed || (r->last_event && (t - r->last_event < r->holdoff)))
+			continue;
+
+		struct event e = {
+			.rule = r->name,
+			.time = t,
+			.active = r->active,
+			.value = r->current,
+			.previous = r->reported,
+		};
+		describe(r, &e);
+
+		r->reported = r->current;
+		r->reported_active = r->active;
+		r->last_event = t;
+
+		cb(&e);
+	}
+}
+
+char *events_json(const struct event *e)
+{
+	char *msg = NULL;
+
+	if (asprintf(&msg,
+			"{"
+			"\"rule\":\"%s\","
+			"\"time\":\"%.0f\","
+			"\"active\":\"%s\","
+			"\"value\":\"%g\","
+			"\"previous\":\"%g\","
+			"\"detail\":\"%s\""
+			"}",
+			e->rule,
+			e->time,
+			e->active ? "true" : "false",
+			e->value,
+			e->previous,
+			e->detail) < 0)
+		exit(EXIT_FAILURE);
+
+	return msg;
+}
+
+size_t events_cbor(const struct event *e, uint8_t *buf, size_t size)
+{
+	struct cbor c;
+
+	cbor_init(&c, buf, size);
+	cbor_map(&c, EVENT_KEY_MAX);
+
+	cbor_uint(&c, SCHEMA_KEY);
+	cbor_uint(&c, SCHEMA_EVENT);
+	cbor_uint(&c, EVENT_RULE);
+	cbor_text(&c, e->rule);
+	cbor_uint(&c, EVENT_TIME);
+	cbor_int(&c, (int64_t)e->time);
+	cbor_uint(&c, EVENT_ACTIVE);
+	cbor_bool(&c, e->active);
+	cbor_uint(&c, EVENT_VALUE);
+	cbor_float(&c, e->value);
+	cbor_uint(&c, EVENT_PREVIOUS);
+	cbor_float(&c, e->previous);
+	cbor_uint(&c, EVENT_DETAIL);
+	cbor_text(&c, e->detail);
+
+	if (!cbor_ok(&c))
+		return 0;
+	return c.len;
+}
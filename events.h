@@ -0,0 +1,108 @@
+
+/**
+
+Copyright 2019 - Auke Kok <sofar@foo-projects.org
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject
+to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**/
+
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <libconfig.h>
+
+#include "renogy.h"
+
+/*
+ * Rules checked against every sample, so that a fault or a low battery
+ * is reported right away instead of with the next state message. A rule
+ * watches the fault bits, the charging state, or an exponentially
+ * smoothed value against a threshold. Threshold rules only clear again
+ * once the value is back past the threshold by 'hysteresis', and every
+ * rule sends at most one event per 'holdoff' seconds: changes within
+ * that time are held back and sent as one event when it is over, or not
+ * at all if the value went back to what was last reported.
+ */
+
+enum rule_type {
+	RULE_FAULT,  // fault bits set or cleared
+	RULE_STATE,  // charging state changed
+	RULE_ABOVE,  // smoothed value above the threshold
+	RULE_BELOW,  // smoothed value below the threshold
+};
+
+struct event_rule {
+	char *name;
+	enum rule_type type;
+	int field;         // sample value for threshold rules
+	int mask;          // fault bits to watch
+	double threshold;
+	double hysteresis;
+	double alpha;      // EWMA weight of a new sample, 1 for none
+	int holdoff;       // seconds between events
+
+	bool primed;       // seen a sample
+	double ewma;
+	double current;    // what the rule sees now
+	double reported;   // what the last event said
+	bool active;
+	bool reported_active;
+	double last_event; // time of the last event
+};
+
+struct events {
+	struct event_rule *rules;
+	int count;
+};
+
+struct event {
+	const char *rule;
+	double time;
+	bool active;       // fault present, threshold crossed
+	double value;
+	double previous;
+	char detail[256];  // fault names or the charging state
+};
+
+typedef void (*event_cb)(const struct event *e);
+
+/*
+ * Parse the "panel.events" list, returns -1 after printing the error.
+ * Without one there is a rule for faults and one for the charging state.
+ */
+int events_config(const config_t *cfg, struct events *ev);
+void events_free(struct events *ev);
+
+/* carry the state of rules with the same name and type over from 'old' */
+void events_keep(struct events *ev, const struct events *old);
+
+/* check all rules against a sample taken at wall clock time 't' */
+void events_check(struct events *ev, double t, const struct renogy_sample *s, event_cb cb);
+
+/* message encoders, like the energy ones */
+char *events_json(const struct event *e);
+size_t events_cbor(const struct event *e, uint8_t *buf, size_t size);
+
+#endif
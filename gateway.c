@@ -0,0 +1,349 @@
+
+/**
+
+Copyright 2019 - Auke Kok <sofar@foo-projects.org
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject
+to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <modbus.h>
+#include <libconfig.h>
+
+#include "bus.h"
+#include "conf.h"
+
+/*
+ * Owns the serial port and serves it to local clients on a Unix socket
+ * using Modbus TCP framing (MBAP header + PDU). Requests are carried
+ * out one at a time, writes before reads, so a bulk dump can not hold
+ * up a control command for long.
+ */
+
+#define CLIENTS_MAX 16
+#define PENDING_MAX 64
+
+#define MBAP_HEADER 7 // transaction, protocol, length, unit
+
+enum priority {
+	PRIO_WRITE,
+	PRIO_READ,
+};
+
+struct client {
+	int fd;
+	uint8_t buf[2 * MODBUS_TCP_MAX_ADU_LENGTH];
+	size_t len;
+};
+
+struct request {
+	struct client *client;
+	enum priority prio;
+	unsigned long seq;
+	uint8_t adu[MODBUS_TCP_MAX_ADU_LENGTH];
+	int len;
+};
+
+static struct client clients[CLIENTS_MAX];
+static struct request pending[PENDING_MAX];
+static int npending = 0;
+static unsigned long seq = 0;
+
+static modbus_t *ctx;
+
+static int stop = 0;
+
+static void sigfunc(int s __attribute__ ((unused)))
+{
+	stop = 1;
+}
+
+static int gateway_listen(const char *path)
+{
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		fprintf(stderr, "Gateway socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(sa.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		fprintf(stderr, "socket(): %s\n", strerror(errno));
+		return -1;
+	}
+
+	// a socket left over from an earlier run
+	unlink(path);
+
+	if ((bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) ||
+	    (chmod(path, 0660) < 0) ||
+	    (listen(fd, CLIENTS_MAX) < 0)) {
+		fprintf(stderr, "Unable to listen on %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void drop_client(struct client *c)
+{
+	// forget what it still had queued
+	for (int i = 0; i < npending; ) {
+		if (pending[i].client == c)
+			pending[i] = pending[--npending];
+		else
+			i++;
+	}
+
+	close(c->fd);
+	c->fd = -1;
+	c->len = 0;
+}
+
+static void accept_client(int lfd)
+{
+	int fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+	if (fd < 0)
+		return;
+
+	for (int i = 0; i < CLIENTS_MAX; i++) {
+		if (clients[i].fd < 0) {
+			clients[i].fd = fd;
+			clients[i].len = 0;
+			return;
+		}
+	}
+
+	fprintf(stderr, "Too many clients\n");
+	close(fd);
+}
+
+static enum priority classify(uint8_t function)
+{
+	switch (function) {
+	case MODBUS_FC_WRITE_SINGLE_COIL:
+	case MODBUS_FC_WRITE_SINGLE_REGISTER:
+	case MODBUS_FC_WRITE_MULTIPLE_COILS:
+	case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+	case MODBUS_FC_MASK_WRITE_REGISTER:
+	case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+		return PRIO_WRITE;
+	default:
+		return PRIO_READ;
+	}
+}
+
+/* split the received bytes into requests, returns -1 on a framing error */
+static int read_client(struct client *c)
+{
+	ssize_t n = read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len);
+
+	if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+		return -1;
+	if (n > 0)
+		c->len += n;
+
+	while (c->len >= MBAP_HEADER) {
+		int protocol = (c->buf[2] << 8) | c->buf[3];
+		int length = (c->buf[4] << 8) | c->buf[5];
+		int size = 6 + length;
+		struct request *r;
+
+		// the length covers the unit id and a PDU of at least a function code
+		if ((protocol != 0) || (length < 2) || (size > MODBUS_TCP_MAX_ADU_LENGTH))
+			return -1;
+		if (c->len < (size_t)size)
+			break;
+
+		if (npending == PENDING_MAX) {
+			fprintf(stderr, "Request queue full\n");
+			return -1;
+		}
+
+		r = &pending[npending++];
+		r->client = c;
+		r->prio = classify(c->buf[MBAP_HEADER]);
+		r->seq = seq++;
+		memcpy(r->adu, c->buf, size);
+		r->len = size;
+
+		c->len -= size;
+		memmove(c->buf, c->buf + size, c->len);
+	}
+
+	return 0;
+}
+
+/* writes first, otherwise in order of arrival */
+static struct request *next_request(void)
+{
+	struct request *best = NULL;
+
+	for (int i = 0; i < npending; i++) {
+		struct request *r = &pending[i];
+
+		if (!best || (r->prio < best->prio) ||
+		    ((r->prio == best->prio) && (r->seq < best->seq)))
+			best = r;
+	}
+
+	return best;
+}
+
+/* run one request on the serial bus and answer it */
+static void execute(struct request *r)
+{
+	uint8_t rsp[MODBUS_TCP_MAX_ADU_LENGTH];
+	uint8_t reply[MODBUS_TCP_MAX_ADU_LENGTH];
+	struct client *c = r->client;
+	int pdu_len;
+	int len;
+
+	// unit id and PDU go out as they are, libmodbus adds the CRC
+	len = modbus_send_raw_request(ctx, r->adu + 6, r->len - 6);
+	if (len >= 0)
+		len = modbus_receive_confirmation(ctx, rsp);
+
+	memcpy(reply, r->adu, MBAP_HEADER);
+	if (len >= 4) {
+		// strip the slave address and CRC of the RTU frame
+		pdu_len = len - 3;
+		memcpy(reply + MBAP_HEADER, rsp + 1, pdu_len);
+	} else {
+		// exception replies from the device come back as errors too
+		int code = MODBUS_EXCEPTION_GATEWAY_TARGET;
+
+		if ((errno > MODBUS_ENOBASE) && (errno < MODBUS_ENOBASE + MODBUS_EXCEPTION_MAX))
+			code = errno - MODBUS_ENOBASE;
+		else
+			fprintf(stderr, "Request %02x to unit %d failed: %s\n",
+				r->adu[MBAP_HEADER], r->adu[6], modbus_strerror(errno));
+
+		// a late reply must not be taken for the answer to the next request
+		modbus_flush(ctx);
+
+		reply[MBAP_HEADER] = r->adu[MBAP_HEADER] | 0x80;
+		reply[MBAP_HEADER + 1] = code;
+		pdu_len = 2;
+	}
+	reply[4] = (pdu_len + 1) >> 8;
+	reply[5] = (pdu_len + 1) & 0xff;
+
+	*r = pending[--npending];
+
+	if (write(c->fd, reply, MBAP_HEADER + pdu_len) != MBAP_HEADER + pdu_len) {
+		fprintf(stderr, "Dropping client: %s\n", strerror(errno));
+		drop_client(c);
+	}
+}
+
+int main(void)
+{
+	struct pollfd fds[1 + CLIENTS_MAX];
+	struct bus_conf conf;
+	config_t cfg;
+	int lfd;
+
+	conf_read(&cfg);
+	bus_config(&cfg, &conf);
+	config_destroy(&cfg);
+
+	if (!conf.gateway) {
+		fprintf(stderr, "No modbus.gateway socket defined in " CONFIG_PATH "\n");
+		exit(EXIT_FAILURE);
+	}
+
+	signal(SIGINT, sigfunc);
+	signal(SIGTERM, sigfunc);
+	signal(SIGPIPE, SIG_IGN);
+
+	ctx = bus_open_device(&conf);
+	if (!ctx)
+		exit(EXIT_FAILURE);
+
+	lfd = gateway_listen(conf.gateway);
+	if (lfd < 0)
+		exit(EXIT_FAILURE);
+
+	for (int i = 0; i < CLIENTS_MAX; i++)
+		clients[i].fd = -1;
+
+	fprintf(stderr, "Serving %s on %s\n", conf.device, conf.gateway);
+
+	while (!stop) {
+		fds[0].fd = lfd;
+		fds[0].events = POLLIN;
+		for (int i = 0; i < CLIENTS_MAX; i++) {
+			fds[1 + i].fd = clients[i].fd;
+			fds[1 + i].events = POLLIN;
+		}
+
+		// between transactions, pick up what arrived meanwhile
+		if (poll(fds, 1 + CLIENTS_MAX, npending ? 0 : -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "poll(): %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+		if (fds[0].revents & POLLIN)
+			accept_client(lfd);
+
+		for (int i = 0; i < CLIENTS_MAX; i++) {
+			if ((clients[i].fd < 0) || !fds[1 + i].revents)
+				continue;
+			if (read_client(&clients[i]) < 0)
+				drop_client(&clients[i]);
+		}
+
+		struct request *r = next_request();
+		if (r)
+			execute(r);
+	}
+
+	for (int i = 0; i < CLIENTS_MAX; i++)
+		if (clients[i].fd >= 0)
+			close(clients[i].fd);
+	close(lfd);
+	unlink(conf.gateway);
+
+	modbus_close(ctx);
+	modbus_free(ctx);
+	bus_config_free(&conf);
+}
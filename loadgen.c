@@ -0,0 +1,502 @@
+
+/**
+
+Copyright 2019 - Auke Kok <sofar@foo-projects.org
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject
+to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <sys/timerfd.h>
+
+#include "mqtt.h"
+
+/*
+ * Fire commands at the control topics of running daemons and time how
+ * long it takes until their state topic shows the result. A command is
+ * answered by the first live state message after it that contains (or,
+ * for "==" steps, is) what its pattern step expects, and dropped if none
+ * comes within the timeout. Run the daemons with the "sim" modbus device
+ * or gpio chip (--enable-sim) to do this on a box without the hardware.
+ */
+
+// each target takes a topic, the mqtt module holds 16 in total
+#define TARGETS_MAX 8
+#define STEPS_MAX 32
+
+// ms for the subscriptions to be in place before the first command
+#define WARMUP 1000
+
+struct step {
+	char *payload;
+	char *expect;  // in the state message that answers it, NULL for any
+	bool exact;    // the whole state message is 'expect'
+};
+
+struct target {
+	char *control;
+	char *state;
+	struct mqtt_topic *topic;
+	int next;      // step of the next command
+	int oldest;    // first command that may still be pending
+	int sent;
+	int answered;
+	int dropped;
+	int unsent;    // the local queue was full
+};
+
+enum command_state {
+	PENDING,
+	ANSWERED,
+	DROPPED,
+};
+
+struct command {
+	int target;
+	int step;
+	enum command_state state;
+	struct timespec sent;
+	double latency; // ms
+};
+
+static struct step steps[STEPS_MAX];
+static int nsteps = 0;
+
+static struct target targets[TARGETS_MAX];
+static int ntargets = 0;
+
+static struct command *commands;
+static int ncommands = 0;
+
+static int timeout = 5000;
+static struct timespec first_sent;
+static struct timespec last_answer;
+
+static int stop = 0;
+
+static void sigfunc(int s __attribute__ ((unused)))
+{
+	stop = 1;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: mqtt-loadgen [-b <host[:port]>] [-5] [-H <hostname>] [-k door|panel]\n"
+		"                    [-p <payload[=expect|==state],...>] [-n <commands>] [-r <rate>]\n"
+		"                    [-B <burst>] [-t <timeout ms>] <topic>...\n");
+	exit(EXIT_FAILURE);
+}
+
+static double ms_between(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1e3 + (b->tv_nsec - a->tv_nsec) / 1e6;
+}
+
+/* "payload=expect,..." or "payload==state,..." for an exact match */
+static void parse_pattern(const char *pattern)
+{
+	char *copy = strdup(pattern);
+	char *save = NULL;
+
+	if (!copy)
+		exit(EXIT_FAILURE);
+
+	nsteps = 0;
+	for (char *s = strtok_r(copy, ",", &save); s; s = strtok_r(NULL, ",", &save)) {
+		char *eq = strchr(s, '=');
+
+		if (nsteps == STEPS_MAX)
+			usage();
+		steps[nsteps].exact = false;
+		if (eq) {
+			*eq++ = 0;
+			if (*eq == '=') {
+				steps[nsteps].exact = true;
+				eq++;
+			}
+		}
+		steps[nsteps].payload = strdup(s);
+		steps[nsteps].expect = eq ? strdup(eq) : NULL;
+		if (!steps[nsteps].payload || (eq && !steps[nsteps].expect))
+			exit(EXIT_FAILURE);
+		nsteps++;
+	}
+	free(copy);
+
+	if (nsteps == 0)
+		usage();
+}
+
+/* patterns that change the state with every command */
+static const char *preset(const char *kind)
+{
+	if (strcmp(kind, "door") == 0)
+		return "1==open,0==closed";
+	if (strcmp(kind, "panel") == 0)
+		return "25=\"load_brightness\":\"25\",75=\"load_brightness\":\"75\","
+			"0=\"load_brightness\":\"0\",100=\"load_brightness\":\"100\","
+			"50=\"load_brightness\":\"50\"";
+	usage();
+	return NULL;
+}
+
+static void send_command(struct target *t)
+{
+	struct command *c = &commands[ncommands];
+	const struct step *s = &steps[t->next];
+
+	c->target = t - targets;
+	c->step = t->next;
+	t->next = (t->next + 1) % nsteps;
+
+	clock_gettime(CLOCK_MONOTONIC, &c->sent);
+	if (ncommands == 0)
+		first_sent = c->sent;
+	ncommands++;
+	t->sent++;
+
+	if (mqtt_publish(t->topic, s->payload, strlen(s->payload)) < 0) {
+		c->state = DROPPED;
+		t->unsent++;
+		return;
+	}
+	c->state = PENDING;
+}
+
+static void skip_done(struct target *t)
+{
+	int n = t - targets;
+
+	while ((t->oldest < ncommands) &&
+	       ((commands[t->oldest].target != n) || (commands[t->oldest].state != PENDING)))
+		t->oldest++;
+}
+
+static bool answers(const struct mosquitto_message *message, const struct step *s)
+{
+	size_t len;
+
+	if (!s->expect)
+		return true;
+	len = strlen(s->expect);
+	if (s->exact)
+		return ((size_t)message->payloadlen == len) && (memcmp(message->payload, s->expect, len) == 0);
+	return memmem(message->payload, message->payloadlen, s->expect, len) != NULL;
+}
+
+static void state_message(const struct mosquitto_message *message)
+{
+	struct timespec now;
+	struct target *t = NULL;
+	int n;
+
+	// retained messages are from before our commands
+	if (message->retain)
+		return;
+
+	for (n = 0; n < ntargets; n++)
+		if (strcmp(message->topic, targets[n].state) == 0)
+			t = &targets[n];
+	if (!t)
+		return;
+	n = t - targets;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	// the oldest pending command this message is what it waits for
+	for (int i = t->oldest; i < ncommands; i++) {
+		struct command *c = &commands[i];
+		const struct step *s = &steps[c->step];
+
+		if ((c->target != n) || (c->state != PENDING))
+			continue;
+		if (!answers(message, s))
+			continue;
+
+		c->state = ANSWERED;
+		c->latency = ms_between(&c->sent, &now);
+		t->answered++;
+		last_answer = now;
+		break;
+	}
+
+	skip_done(t);
+}
+
+/* commands are sent in order, so the expired ones are all at the start */
+static void check_timeouts(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (int n = 0; n < ntargets; n++) {
+		struct target *t = &targets[n];
+
+		for (int i = t->oldest; i < ncommands; i++) {
+			struct command *c = &commands[i];
+
+			if ((c->target != n) || (c->state != PENDING))
+				continue;
+			if (ms_between(&c->sent, &now) < timeout)
+				break;
+			c->state = DROPPED;
+			t->dropped++;
+		}
+		skip_done(t);
+	}
+}
+
+static bool pending(void)
+{
+	for (int n = 0; n < ntargets; n++)
+		if (targets[n].oldest < ncommands)
+			return true;
+	return false;
+}
+
+static int double_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* nearest rank */
+static double percentile(const double *sorted, int n, double p)
+{
+	int rank = (int)ceil(p / 100. * n);
+
+	return sorted[(rank > 0) ? rank - 1 : 0];
+}
+
+static void report(void)
+{
+	double *lat = calloc(ncommands + 1, sizeof(*lat));
+	int sent = 0, answered = 0, dropped = 0, unsent = 0;
+	int n = 0;
+	double elapsed;
+
+	if (!lat)
+		exit(EXIT_FAILURE);
+
+	for (int i = 0; i < ntargets; i++) {
+		struct target *t = &targets[i];
+
+		printf("%-32s %6d sent %6d answered %6d dropped %6d unsent\n",
+			t->control, t->sent, t->answered, t->dropped, t->unsent);
+		sent += t->sent;
+		answered += t->answered;
+		dropped += t->dropped;
+		unsent += t->unsent;
+	}
+	printf("%-32s %6d sent %6d answered %6d dropped %6d unsent\n",
+		"total", sent, answered, dropped, unsent);
+
+	for (int i = 0; i < ncommands; i++)
+		if (commands[i].state == ANSWERED)
+			lat[n++] = commands[i].latency;
+
+	if (n == 0) {
+		printf("no commands answered\n");
+		free(lat);
+		return;
+	}
+
+	qsort(lat, n, sizeof(*lat), double_cmp);
+	printf("latency ms: p50 %.2f  p90 %.2f  p99 %.2f  max %.2f\n",
+		percentile(lat, n, 50), percentile(lat, n, 90), percentile(lat, n, 99), lat[n - 1]);
+
+	elapsed = ms_between(&first_sent, &last_answer) / 1e3;
+	if (elapsed > 0)
+		printf("throughput: %.1f commands/s answered over %.2f s\n", answered / elapsed, elapsed);
+
+	free(lat);
+}
+
+int main(int argc, char *argv[])
+{
+	struct mqtt_conf conf = { .server = "localhost", .port = 1883, .protocol = MQTT_PROTOCOL_V311 };
+	char hostname[HOST_NAME_MAX + 1];
+	const char *host = NULL;
+	const char *pattern = NULL;
+	const char *subscribe[TARGETS_MAX + 1];
+	char *broker = NULL;
+	int count = 100;
+	double rate = 10;
+	int burst = 1;
+	struct itimerspec its = { 0 };
+	struct pollfd fds[1];
+	int remaining;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:5H:k:p:n:r:B:t:")) != -1) {
+		switch (opt) {
+		case 'b':
+			broker = strdup(optarg);
+			if (!broker)
+				exit(EXIT_FAILURE);
+			break;
+		case '5':
+			conf.protocol = MQTT_PROTOCOL_V5;
+			break;
+		case 'H':
+			host = optarg;
+			break;
+		case 'k':
+			pattern = preset(optarg);
+			break;
+		case 'p':
+			pattern = optarg;
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'r':
+			rate = atof(optarg);
+			break;
+		case 'B':
+			burst = atoi(optarg);
+			break;
+		case 't':
+			timeout = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if ((optind == argc) || (argc - optind > TARGETS_MAX) ||
+	    (count <= 0) || (rate <= 0) || (burst <= 0) || (timeout <= 0))
+		usage();
+
+	parse_pattern(pattern ? pattern : preset("door"));
+
+	if (broker) {
+		char *p = strchr(broker, ':');
+
+		if (p) {
+			*p++ = 0;
+			conf.port = atoi(p);
+		}
+		conf.server = broker;
+	}
+
+	// the daemons use the system hostname in their topics
+	hostname[HOST_NAME_MAX] = 0;
+	if (!host) {
+		if (gethostname(hostname, HOST_NAME_MAX) != 0)
+			exit(EXIT_FAILURE);
+		host = hostname;
+	}
+
+	for (int i = optind; i < argc; i++) {
+		struct target *t = &targets[ntargets];
+
+		if ((asprintf(&t->control, "/%s/%s/control", host, argv[i]) < 0) ||
+		    (asprintf(&t->state, "/%s/%s/state", host, argv[i]) < 0))
+			exit(EXIT_FAILURE);
+		t->topic = mqtt_topic(t->control, MQTT_QUEUE, false, 0);
+		subscribe[ntargets++] = t->state;
+	}
+	subscribe[ntargets] = NULL;
+
+	commands = calloc((size_t)count * ntargets, sizeof(*commands));
+	if (!commands)
+		exit(EXIT_FAILURE);
+
+	signal(SIGINT, sigfunc);
+	signal(SIGTERM, sigfunc);
+
+	printf("%d commands each to %d topics on %s:%d, %.1f/s in bursts of %d, %d ms timeout\n",
+		count, ntargets, conf.server, conf.port, rate, burst, timeout);
+
+	mqtt_connect(&conf, subscribe, state_message);
+
+	for (int waited = 0; (waited < WARMUP) && !stop; waited += 100)
+		mqtt_loop(100, NULL, 0);
+
+	// a burst for every target per tick
+	fds[0].fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fds[0].fd < 0)
+		exit(EXIT_FAILURE);
+	fds[0].events = POLLIN;
+	its.it_interval.tv_sec = (time_t)(burst / rate);
+	its.it_interval.tv_nsec = (long)(fmod(burst / rate, 1.) * 1e9);
+	if ((its.it_interval.tv_sec == 0) && (its.it_interval.tv_nsec == 0))
+		usage();
+	its.it_value.tv_nsec = 1;
+	if (timerfd_settime(fds[0].fd, 0, &its, NULL) < 0)
+		exit(EXIT_FAILURE);
+
+	remaining = count;
+	while (!stop && ((remaining > 0) || pending())) {
+		mqtt_loop(10, fds, 1);
+
+		if (fds[0].revents & POLLIN) {
+			uint64_t ticks = 0;
+
+			if (read(fds[0].fd, &ticks, sizeof(ticks)) < 0 && errno != EAGAIN)
+				fprintf(stderr, "timerfd read: %s\n", strerror(errno));
+
+			// catch up on ticks we were too busy for
+			for (uint64_t k = 0; (k < ticks) && (remaining > 0); k++) {
+				for (int b = 0; (b < burst) && (remaining > 0); b++, remaining--)
+					for (int i = 0; i < ntargets; i++)
+						send_command(&targets[i]);
+			}
+		}
+
+		check_timeouts();
+	}
+
+	report();
+
+	mqtt_close();
+	close(fds[0].fd);
+
+	for (int i = 0; i < ntargets; i++) {
+		free(targets[i].control);
+		free(targets[i].state);
+	}
+	for (int i = 0; i < nsteps; i++) {
+		free(steps[i].payload);
+		free(steps[i].expect);
+	}
+	free(commands);
+	free(broker);
+
+	// for scripts: did every command get through
+	for (int i = 0; i < ntargets; i++)
+		if (targets[i].answered != count)
+			exit(EXIT_FAILURE);
+	exit(EXIT_SUCCESS);
+}
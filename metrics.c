@@ -0,0 +1,285 @@
+
+/**
+
+Copyright 2019 - Auke Kok <sofar@foo-projects.org
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject
+to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "metrics.h"
+
+#define HEADER_SPACE 128
+#define BODY_SPACE 8192
+
+// the header is put in front of the body, so rendering never copies it
+static char buf[HEADER_SPACE + BODY_SPACE];
+static size_t body_len = 0;
+static bool overflow = false;
+
+static const char *response = NULL;
+static size_t response_len = 0;
+
+// scrapes waiting for their request line
+static struct client {
+	int fd;
+	size_t len;
+	char req[512];
+	struct timespec deadline;
+} clients[METRICS_CLIENTS] = {
+	[0 ... METRICS_CLIENTS - 1] = { .fd = -1 },
+};
+
+static const char not_found[] =
+	"HTTP/1.0 404 Not Found\r\n"
+	"Content-Length: 0\r\n"
+	"\r\n";
+
+static const char unavailable[] =
+	"HTTP/1.0 503 Service Unavailable\r\n"
+	"Content-Length: 0\r\n"
+	"\r\n";
+
+int metrics_listen(int port)
+{
+	struct sockaddr_in addr;
+	int one = 1;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		fprintf(stderr, "metrics socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) || (listen(fd, 8) < 0)) {
+		fprintf(stderr, "metrics on port %d: %s\n", port, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void append(const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (overflow)
+		return;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf + HEADER_SPACE + body_len, BODY_SPACE - body_len, fmt, ap);
+	va_end(ap);
+
+	if ((n < 0) || ((size_t)n >= BODY_SPACE - body_len))
+		overflow = true;
+	else
+		body_len += n;
+}
+
+void metrics_begin(void)
+{
+	body_len = 0;
+	overflow = false;
+}
+
+void metrics_gauge(const char *name, const char *help, double value)
+{
+	append("# TYPE %s gauge\n# HELP %s %s\n%s %.17g\n", name, name, help, name, value);
+}
+
+void metrics_counter(const char *name, const char *help, double value)
+{
+	append("# TYPE %s counter\n# HELP %s %s\n%s_total %.17g\n", name, name, help, name, value);
+}
+
+void metrics_end(void)
+{
+	char header[HEADER_SPACE];
+	int n;
+
+	append("# EOF\n");
+	if (overflow) {
+		fprintf(stderr, "metrics do not fit in %d bytes\n", BODY_SPACE);
+		response = NULL;
+		return;
+	}
+
+	n = snprintf(header, sizeof(header),
+		"HTTP/1.0 200 OK\r\n"
+		"Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+		"Content-Length: %zu\r\n"
+		"\r\n", body_len);
+	if ((n < 0) || (n >= HEADER_SPACE))
+		exit(EXIT_FAILURE);
+
+	memcpy(buf + HEADER_SPACE - n, header, n);
+	response = buf + HEADER_SPACE - n;
+	response_len = n + body_len;
+}
+
+static void reply(int fd, const char *data, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, data, len);
+		if (n <= 0)
+			return;
+		data += n;
+		len -= n;
+	}
+}
+
+static void drop(struct client *cl)
+{
+	close(cl->fd);
+	cl->fd = -1;
+}
+
+// read what the client sent so far and answer once the request line is in
+static void receive(struct client *cl)
+{
+	ssize_t n = read(cl->fd, cl->req + cl->len, sizeof(cl->req) - 1 - cl->len);
+
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n <= 0) {
+		drop(cl);
+		return;
+	}
+
+	cl->len += n;
+	cl->req[cl->len] = 0;
+	if (!strchr(cl->req, '\n')) {
+		if (cl->len == sizeof(cl->req) - 1)
+			drop(cl);
+		return;
+	}
+
+	if ((strncmp(cl->req, "GET /metrics ", 13) != 0) && (strncmp(cl->req, "GET / ", 6) != 0))
+		reply(cl->fd, not_found, sizeof(not_found) - 1);
+	else if (!response)
+		reply(cl->fd, unavailable, sizeof(unavailable) - 1);
+	else
+		reply(cl->fd, response, response_len);
+	drop(cl);
+}
+
+static long ms_left(const struct timespec *deadline, const struct timespec *now)
+{
+	return (deadline->tv_sec - now->tv_sec) * 1000 + (deadline->tv_nsec - now->tv_nsec) / 1000000;
+}
+
+int metrics_poll(int fd, struct pollfd *fds, int *timeout)
+{
+	struct timespec now;
+	int n = 0;
+
+	if (fd >= 0) {
+		fds[n].fd = fd;
+		fds[n].events = POLLIN;
+		n++;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (int i = 0; i < METRICS_CLIENTS; i++) {
+		if (clients[i].fd < 0)
+			continue;
+
+		long left = ms_left(&clients[i].deadline, &now);
+		if (left < 0)
+			left = 0;
+		if ((*timeout < 0) || (left < *timeout))
+			*timeout = left;
+
+		fds[n].fd = clients[i].fd;
+		fds[n].events = POLLIN;
+		n++;
+	}
+
+	return n;
+}
+
+void metrics_serve(int fd, const struct pollfd *fds, int nfds)
+{
+	struct timespec now;
+	bool pending = false;
+	int c;
+
+	for (int i = 0; i < nfds; i++) {
+		if (!fds[i].revents)
+			continue;
+		if (fds[i].fd == fd)
+			pending = true;
+		for (int j = 0; j < METRICS_CLIENTS; j++)
+			if (clients[j].fd == fds[i].fd)
+				receive(&clients[j]);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (int i = 0; i < METRICS_CLIENTS; i++)
+		if ((clients[i].fd >= 0) && (ms_left(&clients[i].deadline, &now) <= 0))
+			drop(&clients[i]);
+
+	if (!pending)
+		return;
+
+	// scrapes that haven't sent their request yet wait in the poll set
+	while ((c = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		struct client *cl = NULL;
+
+		for (int i = 0; (i < METRICS_CLIENTS) && !cl; i++)
+			if (clients[i].fd < 0)
+				cl = &clients[i];
+		if (!cl) {
+			close(c);
+			continue;
+		}
+
+		cl->fd = c;
+		cl->len = 0;
+		cl->deadline = now;
+		cl->deadline.tv_sec += METRICS_TIMEOUT;
+		receive(cl);
+	}
+}
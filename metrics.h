@@ -0,0 +1,65 @@
+
+/**
+
+Copyright 2019 - Auke Kok <sofar@foo-projects.org
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject
+to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <poll.h>
+
+/*
+ * Tiny OpenMetrics endpoint on localhost. The complete HTTP response is
+ * rendered into a static buffer whenever a new sample is taken, so a
+ * scrape never touches a device and never allocates: it is an accept(),
+ * a read(), a write() and a close(). Scrapes that connected but haven't
+ * sent their request yet stay in the daemon's poll set until they do, or
+ * until METRICS_TIMEOUT seconds have passed.
+ */
+
+#define METRICS_CLIENTS 4
+#define METRICS_FDS (1 + METRICS_CLIENTS)
+#define METRICS_TIMEOUT 2
+
+/* listen on 127.0.0.1:port, returns the socket or -1 */
+int metrics_listen(int port);
+
+/* render a new response: begin, any number of metrics, end */
+void metrics_begin(void);
+void metrics_gauge(const char *name, const char *help, double value);
+void metrics_counter(const char *name, const char *help, double value);
+void metrics_end(void);
+
+/*
+ * Fill in the poll entries for the listening socket 'fd' (-1 if there
+ * is none) and the scrapes still waiting for their request, at most
+ * METRICS_FDS. Returns the number used and lowers *timeout (ms, -1 for
+ * none) to the nearest scrape deadline.
+ */
+int metrics_poll(int fd, struct pollfd *fds, int *timeout);
+
+/* after poll(): accept, read and answer, and drop expired scrapes */
+void metrics_serve(int fd, const struct pollfd *fds, int nfds);
+
+#endif
@@ -0,0 +1,862 @@
+
+/**
+
+Copyright 2019 - Auke Kok <sofar@foo-projects.org
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject
+to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+#include "mqtt.h"
+#include "queue.h"
+
+#define TOPICS_MAX 16
+
+// extra descriptors mqtt_loop() can wait on
+#define MQTT_LOOP_FDS 8
+
+// connect retry delays in ms, doubled on every failed attempt
+#define CONNECT_DELAY_MIN 1000
+#define CONNECT_DELAY_MAX 60000
+
+// keepalive interval in seconds
+#define KEEPALIVE 15
+
+struct mqtt_msg {
+	struct mqtt_topic *topic;   // NULL for replies
+	char *reply_topic;
+	void *correlation;
+	uint16_t correlation_len;
+	int len;
+	char payload[];
+};
+
+struct mqtt_topic {
+	char *name;                 // as registered, daemon thread
+	char *wire_name;            // what the network thread publishes to
+	_Atomic(char *) new_name;   // a rename for the network thread to pick up
+	enum mqtt_policy policy;
+	bool retain;
+	_Atomic int expiry;
+	int alias;                  // 1-based index, used if within alias_max
+	bool alias_sent;            // the broker knows the alias on this connection
+	_Atomic(struct mqtt_msg *) latest; // MQTT_OVERWRITE mailbox
+	unsigned int dropped;
+};
+
+struct mqtt_reply {
+	char *topic;
+	void *correlation;
+	uint16_t correlation_len;
+};
+
+struct mqtt_inbound {
+	struct mosquitto_message message;
+	char *response_topic;
+	void *correlation;
+	uint16_t correlation_len;
+};
+
+static struct mqtt_topic topics[TOPICS_MAX];
+static _Atomic int topic_count = 0;
+
+static struct mosquitto *mosq = NULL;
+static char *server = NULL;
+static int port;
+static int protocol = MQTT_PROTOCOL_V311;
+static char **subscription = NULL; // owned by the network thread
+static _Atomic(char **) new_subscription = NULL;
+static mqtt_message_cb message_cb = NULL;
+
+static pthread_t net_thread;
+static int net_event = -1;  // wakes the network thread
+static int loop_event = -1; // wakes the daemon thread
+static atomic_bool stopping = false;
+
+// only touched by the network thread
+static bool connected = false;
+static bool accepted = false; // the broker sent a CONNACK on this connection
+static int alias_max = 0;
+static int connect_delay = 0; // ms to wait before the next attempt
+static unsigned int seed;
+static bool was_connected = false;
+static bool published = false;
+static _Atomic unsigned long sent_count = 0;
+
+// for the startup timing in the log
+static struct timespec start_time;
+
+static struct queue outbound; // MQTT_QUEUE messages and replies
+static struct queue inbound;  // control messages
+
+// control message currently being handled by the daemon thread
+static struct mqtt_inbound *current = NULL;
+
+static void wake(int fd)
+{
+	uint64_t one = 1;
+
+	if (write(fd, &one, sizeof(one)) != sizeof(one))
+		fprintf(stderr, "eventfd write: %s\n", strerror(errno));
+}
+
+static double since_start(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start_time.tv_sec) + (now.tv_nsec - start_time.tv_nsec) / 1e9;
+}
+
+static void drain_event(int fd)
+{
+	uint64_t val;
+
+	if (read(fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		fprintf(stderr, "eventfd read: %s\n", strerror(errno));
+}
+
+static char **topics_dup(const char *const *list)
+{
+	char **copy;
+	int n = 0;
+
+	while (list[n])
+		n++;
+
+	copy = calloc(n + 1, sizeof(*copy));
+	if (!copy)
+		exit(EXIT_FAILURE);
+	for (int i = 0; i < n; i++) {
+		copy[i] = strdup(list[i]);
+		if (!copy[i])
+			exit(EXIT_FAILURE);
+	}
+
+	return copy;
+}
+
+static void topics_free(char **list)
+{
+	if (!list)
+		return;
+	for (int i = 0; list[i]; i++)
+		free(list[i]);
+	free(list);
+}
+
+static bool topics_has(char **list, const char *topic)
+{
+	for (int i = 0; list[i]; i++)
+		if (strcmp(list[i], topic) == 0)
+			return true;
+	return false;
+}
+
+static void subscribe(struct mosquitto *m, const char *topic)
+{
+	int ret = mosquitto_subscribe(m, NULL, topic, 0);
+
+	if (ret != 0)
+		fprintf(stderr, "mosquitto_subscribe: %d: %s\n", ret, strerror(errno));
+}
+
+void mqtt_config(config_t *cfg, struct mqtt_conf *conf)
+{
+	const char *conf_protocol;
+
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+	if (!config_lookup_string(cfg, "server", &conf->server)) {
+		fprintf(stderr, "No server defined in " CONFIG_PATH "\n");
+		exit(EXIT_FAILURE);
+	}
+	if (!config_lookup_int(cfg, "port", &conf->port)) {
+		fprintf(stderr, "No port defined in " CONFIG_PATH "\n");
+		exit(EXIT_FAILURE);
+	}
+
+	conf->protocol = MQTT_PROTOCOL_V311;
+	if (config_lookup_string(cfg, "protocol", &conf_protocol)) {
+		if (strcmp(conf_protocol, "mqttv5") == 0) {
+			conf->protocol = MQTT_PROTOCOL_V5;
+		} else if (strcmp(conf_protocol, "mqttv311") != 0) {
+			fprintf(stderr, "Unknown protocol \"%s\" in " CONFIG_PATH "\n", conf_protocol);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	fprintf(stderr, "MQTT server: %s:%d (%s)\n", conf->server, conf->port,
+		(conf->protocol == MQTT_PROTOCOL_V5) ? "v5" : "v3.1.1");
+}
+
+static void connect_callback(
+		struct mosquitto *m,
+		void *obj __attribute__ ((unused)),
+		int rc,
+		int flags __attribute__ ((unused)),
+		const mosquitto_property *props)
+{
+	uint16_t max = 0;
+
+	// dropping the connection makes net_loop() back off
+	if (rc != 0) {
+		fprintf(stderr, "%s:%d refused the connection: %d\n", server, port, rc);
+		return;
+	}
+
+	// aliases only live as long as the network connection
+	for (int i = 0; i < atomic_load(&topic_count); i++)
+		topics[i].alias_sent = false;
+
+	if (props)
+		mosquitto_property_read_int16(props, MQTT_PROP_TOPIC_ALIAS_MAXIMUM, &max, false);
+	alias_max = max;
+
+	for (int i = 0; subscription[i]; i++)
+		subscribe(m, subscription[i]);
+
+	if (!was_connected)
+		fprintf(stderr, "Connected to %s:%d %.3f s after start\n", server, port, since_start());
+	else
+		fprintf(stderr, "Reconnected to %s:%d\n", server, port);
+	was_connected = true;
+
+	connected = true;
+	accepted = true;
+	connect_delay = 0;
+}
+
+static void disconnect_callback(
+		struct mosquitto *m __attribute__ ((unused)),
+		void *obj __attribute__ ((unused)),
+		int rc __attribute__ ((unused)),
+		const mosquitto_property *props __attribute__ ((unused)))
+{
+	connected = false;
+}
+
+static void message_callback(
+		struct mosquitto *m __attribute__ ((unused)),
+		void *obj __attribute__ ((unused)),
+		const struct mosquitto_message *message,
+		const mosquitto_property *props)
+{
+	struct mqtt_inbound *in = calloc(1, sizeof(*in) + message->payloadlen + 1);
+	char *payload;
+
+	if (!in)
+		exit(EXIT_FAILURE);
+	payload = (char *)(in + 1);
+
+	in->message = *message;
+	in->message.topic = strdup(message->topic);
+	memcpy(payload, message->payload, message->payloadlen);
+	in->message.payload = payload;
+
+	if (props) {
+		mosquitto_property_read_string(props, MQTT_PROP_RESPONSE_TOPIC, &in->response_topic, false);
+		mosquitto_property_read_binary(props, MQTT_PROP_CORRELATION_DATA, &in->correlation, &in->correlation_len, false);
+	}
+
+	if (!queue_push(&inbound, in)) {
+		fprintf(stderr, "Control queue full, dropping message\n");
+		free(in->message.topic);
+		free(in->response_topic);
+		free(in->correlation);
+		free(in);
+		return;
+	}
+
+	wake(loop_event);
+}
+
+static void free_msg(struct mqtt_msg *m)
+{
+	free(m->reply_topic);
+	free(m->correlation);
+	free(m);
+}
+
+/* a renamed topic has to be introduced to the broker again */
+static void rename_pending(struct mqtt_topic *t)
+{
+	char *name = atomic_exchange(&t->new_name, NULL);
+
+	if (!name)
+		return;
+	free(t->wire_name);
+	t->wire_name = name;
+	t->alias_sent = false;
+}
+
+static int send_msg(struct mqtt_msg *m)
+{
+	mosquitto_property *props = NULL;
+	struct mqtt_topic *t = m->topic;
+	const char *name;
+	int ret;
+
+	if (t)
+		rename_pending(t);
+
+	if (!t) {
+		// reply to a v5 request
+		if (m->correlation)
+			mosquitto_property_add_binary(&props, MQTT_PROP_CORRELATION_DATA, m->correlation, m->correlation_len);
+		ret = mosquitto_publish_v5(mosq, NULL, m->reply_topic, m->len, m->payload, 0, false, props);
+		mosquitto_property_free_all(&props);
+		return ret;
+	}
+
+	if (protocol != MQTT_PROTOCOL_V5)
+		return mosquitto_publish(mosq, NULL, t->wire_name, m->len, m->payload, 0, t->retain);
+
+	name = t->wire_name;
+	if (t->expiry > 0)
+		mosquitto_property_add_int32(&props, MQTT_PROP_MESSAGE_EXPIRY_INTERVAL, t->expiry);
+	if (t->alias <= alias_max) {
+		mosquitto_property_add_int16(&props, MQTT_PROP_TOPIC_ALIAS, t->alias);
+		// once the broker has seen the full topic, the alias alone will do
+		if (t->alias_sent)
+			name = NULL;
+	}
+
+	ret = mosquitto_publish_v5(mosq, NULL, name, m->len, m->payload, 0, t->retain, props);
+	if ((ret == 0) && (t->alias <= alias_max))
+		t->alias_sent = true;
+
+	mosquitto_property_free_all(&props);
+
+	return ret;
+}
+
+static void sent(void)
+{
+	atomic_fetch_add(&sent_count, 1);
+	if (published)
+		return;
+	published = true;
+	fprintf(stderr, "First message published %.3f s after start\n", since_start());
+}
+
+static void send_queued(void)
+{
+	struct mqtt_msg *m;
+
+	for (int i = 0; i < atomic_load(&topic_count); i++) {
+		struct mqtt_topic *t = &topics[i];
+
+		if (t->policy != MQTT_OVERWRITE)
+			continue;
+
+		m = atomic_exchange(&t->latest, NULL);
+		if (!m)
+			continue;
+
+		if (send_msg(m) != 0) {
+			// keep it for the next connection unless a newer one arrived
+			struct mqtt_msg *expected = NULL;
+			if (atomic_compare_exchange_strong(&t->latest, &expected, m))
+				continue;
+		} else {
+			sent();
+		}
+		free_msg(m);
+	}
+
+	while ((m = queue_pop(&outbound))) {
+		if (send_msg(m) != 0)
+			fprintf(stderr, "Failed to publish to %s\n", m->topic ? m->topic->wire_name : m->reply_topic);
+		else
+			sent();
+		free_msg(m);
+	}
+}
+
+static void resubscribe(void)
+{
+	char **list = atomic_exchange(&new_subscription, NULL);
+
+	if (!list)
+		return;
+
+	// only touch what changed, so messages in flight are not lost
+	for (int i = 0; subscription[i]; i++)
+		if (!topics_has(list, subscription[i]))
+			mosquitto_unsubscribe(mosq, NULL, subscription[i]);
+	for (int i = 0; list[i]; i++)
+		if (!topics_has(subscription, list[i]))
+			subscribe(mosq, list[i]);
+
+	topics_free(subscription);
+	subscription = list;
+}
+
+static void wait_event(int timeout)
+{
+	struct pollfd pfd = { .fd = net_event, .events = POLLIN };
+	struct timespec start, now;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (!atomic_load(&stopping)) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		int left = timeout - ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000);
+		if (left <= 0)
+			break;
+		if (poll(&pfd, 1, left) > 0)
+			drain_event(net_event);
+	}
+}
+
+static void backoff(void)
+{
+	connect_delay = (connect_delay == 0) ? CONNECT_DELAY_MIN : connect_delay * 2;
+	if (connect_delay > CONNECT_DELAY_MAX)
+		connect_delay = CONNECT_DELAY_MAX;
+}
+
+/*
+ * Exponential backoff with jitter, so a broker coming back up is not hit
+ * by every client at the same moment.
+ */
+static void try_connect(void)
+{
+	if (connect_delay > 0) {
+		wait_event(connect_delay / 2 + rand_r(&seed) % (connect_delay / 2 + 1));
+		if (atomic_load(&stopping))
+			return;
+	}
+
+	// the backoff is only reset once the CONNACK says we are in
+	if (mosquitto_connect(mosq, server, port, KEEPALIVE) == 0)
+		return;
+
+	if (connect_delay == 0)
+		fprintf(stderr, "Waiting for connection to %s:%d\n", server, port);
+	backoff();
+}
+
+/*
+ * Whatever went wrong, start over with a new connection. One that ends
+ * before the broker accepted it, like a refused CONNACK, counts as a
+ * failed attempt.
+ */
+static void drop_connection(void)
+{
+	if (!accepted)
+		backoff();
+	accepted = false;
+	connected = false;
+	if (mosquitto_socket(mosq) >= 0)
+		mosquitto_disconnect(mosq);
+}
+
+static void *net_loop(void *arg __attribute__ ((unused)))
+{
+	sigset_t set;
+
+	// leave signal handling to the daemon thread
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	while (!atomic_load(&stopping)) {
+		int sock = mosquitto_socket(mosq);
+		int ret = MOSQ_ERR_SUCCESS;
+
+		if (sock < 0) {
+			try_connect();
+			continue;
+		}
+
+		struct pollfd fds[2] = {
+			{ .fd = sock, .events = POLLIN | (mosquitto_want_write(mosq) ? POLLOUT : 0) },
+			{ .fd = net_event, .events = POLLIN },
+		};
+
+		if (poll(fds, 2, 1000) < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "poll(): %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+		if (fds[1].revents & POLLIN)
+			drain_event(net_event);
+
+		if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+			ret = mosquitto_loop_read(mosq, 1);
+		if ((ret == MOSQ_ERR_SUCCESS) && (fds[0].revents & POLLOUT))
+			ret = mosquitto_loop_write(mosq, 1);
+		if (ret == MOSQ_ERR_SUCCESS)
+			ret = mosquitto_loop_misc(mosq);
+
+		if (ret != MOSQ_ERR_SUCCESS) {
+			if ((ret != MOSQ_ERR_CONN_LOST) && (ret != MOSQ_ERR_NO_CONN))
+				fprintf(stderr, "mosquitto_loop(): %d, %s\n", ret, mosquitto_strerror(ret));
+			drop_connection();
+			continue;
+		}
+
+		if (connected) {
+			resubscribe();
+			send_queued();
+		}
+	}
+
+	// flush whatever the daemon published last before going away
+	if (connected) {
+		send_queued();
+		for (int i = 0; i < 10 && mosquitto_want_write(mosq); i++)
+			mosquitto_loop_write(mosq, 1);
+	}
+	mosquitto_disconnect(mosq);
+
+	return NULL;
+}
+
+void mqtt_connect(const struct mqtt_conf *conf, const char *const *topics,
+		mqtt_message_cb cb)
+{
+	server = strdup(conf->server);
+	if (!server)
+		exit(EXIT_FAILURE);
+	port = conf->port;
+	protocol = conf->protocol;
+	seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+	subscription = topics_dup(topics);
+	message_cb = cb;
+
+	// for callers that don't read the config file through mqtt_config()
+	if (start_time.tv_sec == 0 && start_time.tv_nsec == 0)
+		clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+	queue_init(&outbound);
+	queue_init(&inbound);
+
+	net_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	loop_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if ((net_event < 0) || (loop_event < 0))
+		exit(EXIT_FAILURE);
+
+	mosquitto_lib_init();
+	mosq = mosquitto_new(NULL, true, NULL);
+	if (!mosq)
+		exit(EXIT_FAILURE);
+
+	if (mosquitto_int_option(mosq, MOSQ_OPT_PROTOCOL_VERSION, protocol) != 0)
+		exit(EXIT_FAILURE);
+
+	mosquitto_connect_v5_callback_set(mosq, connect_callback);
+	mosquitto_disconnect_v5_callback_set(mosq, disconnect_callback);
+	mosquitto_message_v5_callback_set(mosq, message_callback);
+
+	// the network thread connects, so the daemon can start working now
+	if (pthread_create(&net_thread, NULL, net_loop, NULL) != 0)
+		exit(EXIT_FAILURE);
+}
+
+void mqtt_subscribe(const char *const *topics)
+{
+	char **old = atomic_exchange(&new_subscription, topics_dup(topics));
+
+	topics_free(old);
+	wake(net_event);
+}
+
+struct mqtt_topic *mqtt_topic(const char *name, enum mqtt_policy policy,
+		bool retain, int expiry)
+{
+	int n = atomic_load(&topic_count);
+	struct mqtt_topic *t;
+
+	for (int i = 0; i < n; i++) {
+		if (strcmp(topics[i].name, name) == 0) {
+			atomic_store(&topics[i].expiry, expiry);
+			return &topics[i];
+		}
+	}
+
+	if (n == TOPICS_MAX) {
+		fprintf(stderr, "Too many topics\n");
+		exit(EXIT_FAILURE);
+	}
+
+	t = &topics[n];
+	t->name = strdup(name);
+	t->wire_name = strdup(name);
+	if (!t->name || !t->wire_name)
+		exit(EXIT_FAILURE);
+	atomic_init(&t->new_name, NULL);
+	t->policy = policy;
+	t->retain = retain;
+	atomic_init(&t->expiry, expiry);
+	t->alias = n + 1;
+	t->alias_sent = false;
+	t->dropped = 0;
+	atomic_init(&t->latest, NULL);
+
+	// make the entry visible to the network thread only once complete
+	atomic_store(&topic_count, n + 1);
+
+	return t;
+}
+
+struct mqtt_topic *mqtt_topic_rename(struct mqtt_topic *old, const char *name,
+		enum mqtt_policy policy, bool retain, int expiry)
+{
+	int n = atomic_load(&topic_count);
+	char *copy;
+
+	if (!old)
+		return mqtt_topic(name, policy, retain, expiry);
+
+	// renaming into another one's name, as when two doors swap topics
+	for (int i = 0; i < n; i++) {
+		if (strcmp(topics[i].name, name) == 0) {
+			atomic_store(&topics[i].expiry, expiry);
+			return &topics[i];
+		}
+	}
+
+	copy = strdup(name);
+	free(old->name);
+	old->name = strdup(name);
+	if (!copy || !old->name)
+		exit(EXIT_FAILURE);
+	atomic_store(&old->expiry, expiry);
+
+	// the network thread may be using the old name right now
+	free(atomic_exchange(&old->new_name, copy));
+	if (net_event >= 0)
+		wake(net_event);
+
+	return old;
+}
+
+static struct mqtt_msg *new_msg(const void *payload, int len)
+{
+	struct mqtt_msg *m = calloc(1, sizeof(*m) + len);
+
+	if (!m)
+		exit(EXIT_FAILURE);
+	m->len = len;
+	memcpy(m->payload, payload, len);
+
+	return m;
+}
+
+static int push(struct mqtt_msg *m, const char *name, unsigned int *dropped)
+{
+	if (!queue_push(&outbound, m)) {
+		// rate limit the complaints, a full queue means no network
+		if ((*dropped)++ % 100 == 0)
+			fprintf(stderr, "Publish queue full, dropped %u messages to %s\n", *dropped, name);
+		free_msg(m);
+		return -1;
+	}
+
+	wake(net_event);
+	return 0;
+}
+
+int mqtt_publish(struct mqtt_topic *topic, const void *payload, int len)
+{
+	struct mqtt_msg *m = new_msg(payload, len);
+
+	m->topic = topic;
+
+	if (topic->policy == MQTT_OVERWRITE) {
+		struct mqtt_msg *old = atomic_exchange(&topic->latest, m);
+		if (old)
+			free_msg(old);
+		wake(net_event);
+		return 0;
+	}
+
+	return push(m, topic->name, &topic->dropped);
+}
+
+unsigned long mqtt_sent(void)
+{
+	return atomic_load(&sent_count);
+}
+
+struct mqtt_reply *mqtt_reply_to(const char *fallback)
+{
+	struct mqtt_reply *r;
+	const char *topic;
+
+	if (!current)
+		return NULL;
+
+	topic = current->response_topic ? current->response_topic : fallback;
+	if (!topic)
+		return NULL;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		exit(EXIT_FAILURE);
+	r->topic = strdup(topic);
+	if (!r->topic)
+		exit(EXIT_FAILURE);
+
+	// the correlation data belongs to the response topic it came with
+	if (current->response_topic && current->correlation) {
+		r->correlation = malloc(current->correlation_len);
+		if (!r->correlation)
+			exit(EXIT_FAILURE);
+		memcpy(r->correlation, current->correlation, current->correlation_len);
+		r->correlation_len = current->correlation_len;
+	}
+
+	return r;
+}
+
+struct mqtt_reply *mqtt_reply_dup(const struct mqtt_reply *r)
+{
+	struct mqtt_reply *d = calloc(1, sizeof(*d));
+
+	if (!d)
+		exit(EXIT_FAILURE);
+	d->topic = strdup(r->topic);
+	if (!d->topic)
+		exit(EXIT_FAILURE);
+
+	if (r->correlation) {
+		d->correlation = malloc(r->correlation_len);
+		if (!d->correlation)
+			exit(EXIT_FAILURE);
+		memcpy(d->correlation, r->correlation, r->correlation_len);
+		d->correlation_len = r->correlation_len;
+	}
+
+	return d;
+}
+
+void mqtt_reply(struct mqtt_reply *r, const void *payload, int len)
+{
+	static unsigned int dropped = 0;
+	struct mqtt_msg *m = new_msg(payload, len);
+
+	// the message takes over the reply address
+	m->reply_topic = r->topic;
+	m->correlation = r->correlation;
+	m->correlation_len = r->correlation_len;
+	free(r);
+
+	push(m, m->reply_topic, &dropped);
+}
+
+void mqtt_ack(const char *status)
+{
+	struct mqtt_reply *r = mqtt_reply_to(NULL);
+
+	if (r)
+		mqtt_reply(r, status, strlen(status));
+}
+
+int mqtt_loop(int timeout, struct pollfd *fds, int nfds)
+{
+	struct pollfd pfd[1 + MQTT_LOOP_FDS];
+	struct mqtt_inbound *in;
+	int ret;
+
+	if (nfds > MQTT_LOOP_FDS) {
+		fprintf(stderr, "Too many descriptors to poll\n");
+		exit(EXIT_FAILURE);
+	}
+
+	pfd[0].fd = loop_event;
+	pfd[0].events = POLLIN;
+	pfd[0].revents = 0;
+	for (int i = 0; i < nfds; i++) {
+		pfd[1 + i] = fds[i];
+		pfd[1 + i].revents = 0;
+	}
+
+	ret = poll(pfd, 1 + nfds, timeout);
+	if (ret < 0 && errno != EINTR) {
+		fprintf(stderr, "poll(): %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	ret = 0;
+	for (int i = 0; i < nfds; i++) {
+		fds[i].revents = pfd[1 + i].revents;
+		if (fds[i].revents)
+			ret++;
+	}
+
+	if (pfd[0].revents & POLLIN)
+		drain_event(loop_event);
+
+	while ((in = queue_pop(&inbound))) {
+		current = in;
+		message_cb(&in->message);
+		current = NULL;
+
+		free(in->message.topic);
+		free(in->response_topic);
+		free(in->correlation);
+		free(in);
+	}
+
+	return ret;
+}
+
+void mqtt_close(void)
+{
+	atomic_store(&stopping, true);
+	wake(net_event);
+	pthread_join(net_thread, NULL);
+
+	mosquitto_destroy(mosq);
+	mosquitto_lib_cleanup();
+
+	for (int i = 0; i < atomic_load(&topic_count); i++) {
+		struct mqtt_msg *m = atomic_exchange(&topics[i].latest, NULL);
+		if (m)
+			free_msg(m);
+		free(topics[i].name);
+		free(topics[i].wire_name);
+		free(atomic_exchange(&topics[i].new_name, NULL));
+	}
+
+	topics_free(subscription);
+	free(server);
+	topics_free(atomic_exchange(&new_subscription, NULL));
+
+	close(net_event);
+	close(loop_event);
+}
@@ -0,0 +1,134 @@
+
+/**
+
+Copyright 2019 - Auke Kok <sofar@foo-projects.org
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject
+to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**/
+
+#ifndef MQTT_H
+#define MQTT_H
+
+#include <stdbool.h>
+
+#include <poll.h>
+
+#include <mosquitto.h>
+#include <libconfig.h>
+
+#include "conf.h"
+
+/*
+ * All network I/O happens on a dedicated thread that owns the mosquitto
+ * client. The daemon thread hands it outgoing messages through lock-free
+ * queues and never waits for the network. Incoming control messages are
+ * passed back and handled on the daemon thread from mqtt_loop().
+ */
+
+typedef void (*mqtt_message_cb)(const struct mosquitto_message *);
+
+struct mqtt_conf {
+	const char *server;
+	int port;
+	int protocol; // MQTT_PROTOCOL_V311 or MQTT_PROTOCOL_V5
+};
+
+enum mqtt_policy {
+	MQTT_OVERWRITE, // only the latest unsent message is kept (state)
+	MQTT_QUEUE,     // all messages are sent in order, new ones dropped when full
+};
+
+struct mqtt_topic;
+struct mqtt_reply;
+
+/* read the broker settings from an already parsed config */
+void mqtt_config(config_t *cfg, struct mqtt_conf *conf);
+
+/*
+ * Start the network thread, which connects to the broker in the
+ * background and subscribes to the NULL terminated list of 'topics'.
+ * Returns right away, messages published before the connection is up
+ * are held like they are while offline. Connecting is retried with
+ * jittered exponential backoff and the subscriptions are renewed on
+ * every reconnect.
+ */
+void mqtt_connect(const struct mqtt_conf *conf, const char *const *topics,
+		mqtt_message_cb cb);
+
+/* replace the subscriptions with another NULL terminated list */
+void mqtt_subscribe(const char *const *topics);
+
+/*
+ * Register a topic to publish to. Registering the same name again
+ * returns the existing topic. With MQTT v5 the topic is sent as a
+ * topic alias after its first use and 'expiry' (seconds, 0 for none) is
+ * set as message expiry interval so the broker drops stale telemetry.
+ */
+struct mqtt_topic *mqtt_topic(const char *name, enum mqtt_policy policy,
+		bool retain, int expiry);
+
+/*
+ * The same for a topic that was registered before under another name,
+ * for config reloads. 'old' (NULL if there is none yet) is renamed
+ * instead of a new topic being added, so reloads never run out of
+ * topics. Messages still queued for it go out under the new name.
+ */
+struct mqtt_topic *mqtt_topic_rename(struct mqtt_topic *old, const char *name,
+		enum mqtt_policy policy, bool retain, int expiry);
+
+/* queue a message, never blocks. Returns -1 if the message was dropped */
+int mqtt_publish(struct mqtt_topic *topic, const void *payload, int len);
+
+/* messages handed to the broker connection so far */
+unsigned long mqtt_sent(void);
+
+/*
+ * Acknowledge the control message currently being handled. Only does
+ * something for MQTT v5 messages that carry a response topic, in which
+ * case 'status' is sent there along with the correlation data.
+ */
+void mqtt_ack(const char *status);
+
+/*
+ * Keep the reply address of the control message currently being
+ * handled, so it can be answered later. That is its MQTT v5 response
+ * topic and correlation data, or 'fallback' if it has none. Returns
+ * NULL if there is nowhere to reply to.
+ */
+struct mqtt_reply *mqtt_reply_to(const char *fallback);
+
+/* send a reply and free 'r', never blocks */
+void mqtt_reply(struct mqtt_reply *r, const void *payload, int len);
+
+/* copy a reply address, to send more than one reply to it */
+struct mqtt_reply *mqtt_reply_dup(const struct mqtt_reply *r);
+
+/*
+ * Wait up to 'timeout' ms for control messages or activity on any of the
+ * 'nfds' extra descriptors, handle the control messages and return the
+ * number of extra descriptors with events in their revents.
+ */
+int mqtt_loop(int timeout, struct pollfd *fds, int nfds);
+
+/* send what is still queued, disconnect and stop the network thread */
+void mqtt_close(void);
+
+#endif
@@ -33,51 +33,111 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <unistd.h>
 #include <signal.h>
 #include <time.h>
+#include <arpa/inet.h>
 
 #include <modbus.h>
-#include <mosquitto.h>
 #include <libconfig.h>
+#include <zlib.h>
+
+#include "mqtt.h"
+#include "conf.h"
+#include "bus.h"
+#include "renogy.h"
+#include "energy.h"
+#include "metrics.h"
+#include "rra.h"
+#include "events.h"
+#include "cbor.h"
+#include "schema.h"
+
+// how often the energy integrator checkpoints its state
+#define CHECKPOINT_INTERVAL 300
+
+// read requests answered per bus read
+#define PENDING_MAX 16
+
+// rows per history reply message
+#define HISTORY_CHUNK_ROWS 1024
+
+struct panel_conf {
+	struct bus_conf bus;
+	int interval;        // seconds between publishes
+	int sample_interval; // seconds between samples for energy integration
+	int max_gap;         // longer sample gaps are not integrated
+	char *topic;         // topics are /<hostname>/<topic>/{state,control}
+	char *energy_state;  // energy checkpoint file
+	char *history;       // history archive, "" to disable
+	int metrics_port;    // OpenMetrics on localhost, 0 to disable
+	struct events events;
+	bool cbor;
+};
 
-#define CONFIG_PATH "/etc/mqtt.conf"
+static struct panel_conf pconf;
 
-#define PUBLISH_INTERVAL 600
+static struct bus *bus;
 
-static const char* charging_states[] = {
-	"charging deactivated",
-	"charging activated",
-	"mptt charging",
-	"equalizing charging",
-	"boost charging",
-	"floating charging",
-	"current limiting"
+static char hostname[HOST_NAME_MAX+1];
+static char *topic_control = NULL;
+static char *topic_state = NULL;
+static char *topic_request = NULL;
+static char *topic_history = NULL;
+static struct mqtt_topic *state_topic = NULL;
+static struct mqtt_topic *energy_topic[ENERGY_KINDS];
+static struct mqtt_topic *event_topic = NULL;
+static struct mqtt_topic *bus_topic = NULL;
+
+static struct renogy_sample sample;
+static struct timespec sample_mono; // when 'sample' was read
+static double sample_wall;
+static bool have_sample = false;
+
+// read requests waiting for the next sample
+struct request {
+	double max_age;
+	struct mqtt_reply *reply;
 };
 
-#define FAULT_BITS_MAX 15
-static const char* fault_bits[FAULT_BITS_MAX] = {
-	"battery over-discharge",
-	"battery over-voltage",
-	"battery under-voltage",
-	"load short circuit",
-	"load overpower or load over-current",
-	"controller temperature too high",
-	"ambient temperature too high",
-	"photovoltaic input overpower",
-	"photovoltaic input side short circuit",
-	"photovoltaic input side over-voltage",
-	"solar panel counter-current",
-	"solar panel working point over-voltage",
-	"solar panel reversely connected",
-	"anti-reverse MOS short",
-	"circuit, charge MOS short circuit"
+static struct request pending[PENDING_MAX];
+static int npending = 0;
+
+static struct energy energy;
+static time_t checkpoint_time = 0;
+
+static int metrics_fd = -1;
+
+// 1 hour of samples, a week of minutes and a year of hours
+static const struct rra_def history_defs[] = {
+	{ 10, 360, RRA_AVERAGE },
+	{ 60, 7 * 24 * 60, RRA_AVERAGE },
+	{ 60, 7 * 24 * 60, RRA_MIN },
+	{ 60, 7 * 24 * 60, RRA_MAX },
+	{ 3600, 365 * 24, RRA_AVERAGE },
+	{ 3600, 365 * 24, RRA_MIN },
+	{ 3600, 365 * 24, RRA_MAX },
 };
 
-static modbus_t *ctx;
+// the columns of the history, by their CBOR key
+static const int history_keys[] = {
+	PANEL_BATTERY_CAPACITY,
+	PANEL_BATTERY_VOLTAGE,
+	PANEL_BATTERY_CURRENT,
+	PANEL_CONTROLLER_TEMPERATURE,
+	PANEL_LOAD_VOLTAGE,
+	PANEL_LOAD_CURRENT,
+	PANEL_LOAD_POWER,
+	PANEL_PANEL_VOLTAGE,
+	PANEL_PANEL_CURRENT,
+	PANEL_PANEL_POWER,
+};
 
-static char *topic_control = NULL;
-static char *topic_state = NULL;
+#define HISTORY_CHANNELS (int)(sizeof(history_keys) / sizeof(history_keys[0]))
+
+static struct rra *history = NULL;
 
 static int load = -1;
 
+static struct timespec start_time;
+
 static int stop = 0;
 
 static void sigfunc(int s __attribute__ ((unused)))
@@ -85,130 +145,482 @@ static void sigfunc(int s __attribute__ ((unused)))
 	stop = 1;
 }
 
-static void publish_state(struct mosquitto *mosq)
+static void publish_energy(enum energy_kind kind, const struct energy_bucket *b)
+{
+	if (pconf.cbor) {
+		uint8_t buf[64];
+		size_t len = energy_cbor(kind, b, buf, sizeof(buf));
+
+		if (len == 0)
+			exit(EXIT_FAILURE);
+		mqtt_publish(energy_topic[kind], buf, len);
+	} else {
+		char *msg = energy_json(kind, b);
+
+		mqtt_publish(energy_topic[kind], msg, strlen(msg));
+		free(msg);
+	}
+}
+
+static void publish_event(const struct event *e)
+{
+	fprintf(stderr, "Event %s: %s\n", e->rule, e->detail);
+
+	if (pconf.cbor) {
+		uint8_t buf[512];
+		size_t len = events_cbor(e, buf, sizeof(buf));
+
+		if (len == 0)
+			exit(EXIT_FAILURE);
+		mqtt_publish(event_topic, buf, len);
+	} else {
+		char *msg = events_json(e);
+
+		mqtt_publish(event_topic, msg, strlen(msg));
+		free(msg);
+	}
+}
+
+static void render_metrics(double t)
+{
+	const struct bus_stats *st = bus_stats(bus);
+
+	metrics_begin();
+	metrics_gauge("renogy_sample_timestamp_seconds", "Time of the last sample", t);
+	metrics_gauge("renogy_battery_capacity_percent", "Battery state of charge", sample.battery_capacity);
+	metrics_gauge("renogy_battery_voltage_volts", "Battery voltage", sample.battery_voltage);
+	metrics_gauge("renogy_battery_current_amperes", "Battery charging current", sample.battery_current);
+	metrics_gauge("renogy_controller_temperature_celsius", "Controller temperature", sample.controller_temperature);
+	metrics_gauge("renogy_load_voltage_volts", "Load voltage", sample.load_voltage);
+	metrics_gauge("renogy_load_current_amperes", "Load current", sample.load_current);
+	metrics_gauge("renogy_load_power_watts", "Load power", sample.load_power);
+	metrics_gauge("renogy_panel_voltage_volts", "Panel voltage", sample.panel_voltage);
+	metrics_gauge("renogy_panel_current_amperes", "Panel current", sample.panel_current);
+	metrics_gauge("renogy_panel_power_watts", "Panel power", sample.panel_power);
+	metrics_gauge("renogy_charging_state", "Charging state index", sample.charging_state);
+	metrics_gauge("renogy_error_state", "Fault bitmask", sample.errors);
+	metrics_gauge("renogy_load_enable", "Load switched on", sample.load_enable);
+	metrics_gauge("renogy_load_brightness_percent", "Load dimmer setting", sample.load_brightness);
+	metrics_counter("renogy_panel_energy_wh", "Integrated panel energy", energy.total_wh[ENERGY_PANEL]);
+	metrics_counter("renogy_load_energy_wh", "Integrated load energy", energy.total_wh[ENERGY_LOAD]);
+	metrics_counter("renogy_battery_energy_wh", "Integrated battery charge energy", energy.total_wh[ENERGY_BATTERY]);
+	metrics_counter("renogy_bus_requests", "Bus transactions", st->requests);
+	metrics_counter("renogy_bus_failures", "Bus transactions that failed", st->failures);
+	metrics_counter("renogy_bus_errors", "Failed bus attempts, retried or not", st->errors);
+	metrics_counter("renogy_bus_retries", "Bus retries", st->retries);
+	metrics_counter("renogy_bus_reconnects", "Bus reconnects", st->reconnects);
+	metrics_counter("renogy_bus_rejected", "Bus transactions skipped while backing off", st->rejected);
+	metrics_counter("renogy_bus_trips", "Times the bus circuit breaker opened", st->trips);
+	metrics_counter("renogy_bus_recoveries", "Times the bus circuit breaker closed", st->recoveries);
+	metrics_gauge("renogy_bus_tripped", "Bus circuit breaker open", bus_tripped(bus));
+	metrics_end();
+}
+
+static void publish_bus(void)
+{
+	const struct bus_stats *st = bus_stats(bus);
+
+	if (pconf.cbor) {
+		uint8_t buf[128];
+		struct cbor c;
+
+		cbor_init(&c, buf, sizeof(buf));
+		cbor_map(&c, BUS_KEY_MAX);
+		cbor_uint(&c, SCHEMA_KEY);
+		cbor_uint(&c, SCHEMA_BUS);
+		cbor_uint(&c, BUS_REQUESTS);
+		cbor_uint(&c, st->requests);
+		cbor_uint(&c, BUS_FAILURES);
+		cbor_uint(&c, st->failures);
+		cbor_uint(&c, BUS_ERRORS);
+		cbor_uint(&c, st->errors);
+		cbor_uint(&c, BUS_RETRIES);
+		cbor_uint(&c, st->retries);
+		cbor_uint(&c, BUS_RECONNECTS);
+		cbor_uint(&c, st->reconnects);
+		cbor_uint(&c, BUS_REJECTED);
+		cbor_uint(&c, st->rejected);
+		cbor_uint(&c, BUS_TRIPS);
+		cbor_uint(&c, st->trips);
+		cbor_uint(&c, BUS_RECOVERIES);
+		cbor_uint(&c, st->recoveries);
+		cbor_uint(&c, BUS_TRIPPED);
+		cbor_bool(&c, bus_tripped(bus));
+		if (!cbor_ok(&c))
+			exit(EXIT_FAILURE);
+		mqtt_publish(bus_topic, buf, c.len);
+	} else {
+		char *msg = NULL;
+
+		if (asprintf(&msg,
+				"{"
+				"\"requests\":\"%lu\","
+				"\"failures\":\"%lu\","
+				"\"errors\":\"%lu\","
+				"\"retries\":\"%lu\","
+				"\"reconnects\":\"%lu\","
+				"\"rejected\":\"%lu\","
+				"\"trips\":\"%lu\","
+				"\"recoveries\":\"%lu\","
+				"\"tripped\":\"%s\""
+				"}",
+				st->requests, st->failures, st->errors, st->retries,
+				st->reconnects, st->rejected, st->trips, st->recoveries,
+				bus_tripped(bus) ? "true" : "false") < 0)
+			exit(EXIT_FAILURE);
+		mqtt_publish(bus_topic, msg, strlen(msg));
+		free(msg);
+	}
+}
+
+static void add_history(time_t t)
+{
+	float values[HISTORY_CHANNELS] = {
+		sample.battery_capacity,
+		sample.battery_voltage,
+		sample.battery_current,
+		sample.controller_temperature,
+		sample.load_voltage,
+		sample.load_current,
+		sample.load_power,
+		sample.panel_voltage,
+		sample.panel_current,
+		sample.panel_power,
+	};
+
+	rra_update(history, t, values);
+}
+
+static struct rra *open_history(const char *path)
+{
+	if (!*path)
+		return NULL;
+	return rra_open(path, HISTORY_CHANNELS, history_defs,
+			sizeof(history_defs) / sizeof(history_defs[0]));
+}
+
+/* tell right away when the circuit breaker opens or closes */
+static void check_bus(void)
+{
+	static bool tripped = false;
+
+	if (bus_tripped(bus) != tripped) {
+		tripped = bus_tripped(bus);
+		publish_bus();
+	}
+}
+
+/* returns -1 if the controller could not be read, 'sample' is kept */
+static int read_sample(void)
 {
 	uint16_t regs[64];
+	struct timespec ts;
+	double power[ENERGY_CHANNELS];
 	int ret;
 
 	/* read info block regs */
 	memset(regs, 0, sizeof(regs));
-	ret = modbus_read_registers(ctx, 0x100, 0x22, regs);
+	ret = bus_read_registers(bus, RENOGY_REG_BASE, RENOGY_REG_COUNT, regs);
+	check_bus();
 	if (ret < 0) {
-		fprintf(stderr, "Failed to read registers: %s\n", modbus_strerror(errno));
-		modbus_free(ctx);
-		exit(EXIT_FAILURE);
+		// the error counters still change
+		if (metrics_fd >= 0)
+			render_metrics(sample_wall);
+		return -1;
 	}
 
-	/* create mqtt publish stream */
-	int battery_capacity = regs[0];
-	float battery_voltage = regs[1] / 10.;
-	float battery_current = regs[2] / 100.;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	clock_gettime(CLOCK_MONOTONIC, &sample_mono);
+	sample_wall = ts.tv_sec + ts.tv_nsec / 1e9;
+	renogy_decode(regs, &sample);
+	if (!have_sample)
+		fprintf(stderr, "First sample %.3f s after start\n",
+			(sample_mono.tv_sec - start_time.tv_sec) + (sample_mono.tv_nsec - start_time.tv_nsec) / 1e9);
+	have_sample = true;
+
+	power[ENERGY_PANEL] = sample.panel_power;
+	power[ENERGY_LOAD] = sample.load_power;
+	power[ENERGY_BATTERY] = sample.battery_voltage * sample.battery_current;
+	energy_add(&energy, sample_wall, power, publish_energy);
 
-	int controller_temperature = (int8_t) MODBUS_GET_HIGH_BYTE(regs[3]);
+	// don't wait for the next state message with bad news
+	events_check(&pconf.events, sample_wall, &sample, publish_event);
 
-	float load_voltage = regs[4] / 10.;
-	float load_current = regs[5] / 100.;
-	int load_power = regs[6];
+	if (metrics_fd >= 0)
+		render_metrics(sample_wall);
 
-	float panel_voltage = regs[7] / 10.;
-	float panel_current = regs[8] / 100.;
-	int panel_power = regs[9];
+	if (history)
+		add_history(ts.tv_sec);
+
+	if (ts.tv_sec - checkpoint_time >= CHECKPOINT_INTERVAL) {
+		checkpoint_time = ts.tv_sec;
+		energy_save(&energy, pconf.energy_state);
+	}
+
+	return 0;
+}
+
+static void publish_state(void)
+{
+	// the bus counters go out with every state message, or instead of it
+	if (read_sample() < 0) {
+		publish_bus();
+		return;
+	}
 
-	float battery_voltage_min_day = regs[0xb] / 10.;
-	float battery_voltage_max_day = regs[0xc] / 10.;
+	char *msg = renogy_json(&sample);
 
-	float charge_current_max_day = regs[0xd] / 100.;
-	float discharge_current_max_day = regs[0xe] / 100.;
+	// dump to local file too, we'll use it for various states
+	FILE *f = fopen("/run/panel-state.json", "w");
+	fprintf(f, "%s", msg);
+	fclose(f);
 
-	float charge_power_max_day = regs[0xf] / 100.;
-	float discharge_power_max_day = regs[0x10] / 100.;
+	if (pconf.cbor) {
+		uint8_t buf[256];
+		size_t len = renogy_cbor(&sample, buf, sizeof(buf));
 
-	int charge_amp_hours_day = regs[0x11];
-	int discharge_amp_hours_day = regs[0x12];
+		if (len == 0)
+			exit(EXIT_FAILURE);
+		mqtt_publish(state_topic, buf, len);
+	} else {
+		mqtt_publish(state_topic, msg, strlen(msg));
+	}
+	free(msg);
 
-	float charge_generated_day = regs[0x13] / 10000.;
-	float charge_consumed_day = regs[0x14] / 10000.;
+	publish_bus();
+}
 
-	const char *state = charging_states[(int8_t) MODBUS_GET_LOW_BYTE(regs[0x20])];
+static void send_sample(struct mqtt_reply *reply)
+{
+	if (pconf.cbor) {
+		uint8_t buf[256];
+		size_t len = renogy_cbor(&sample, buf, sizeof(buf));
 
-	int load_enable = MODBUS_GET_HIGH_BYTE(regs[0x20]) >> 7;
-	int load_brightness = MODBUS_GET_HIGH_BYTE(regs[0x20]) & 0x7f;
+		if (len == 0)
+			exit(EXIT_FAILURE);
+		mqtt_reply(reply, buf, len);
+	} else {
+		char *msg = renogy_json(&sample);
 
-	int errors = regs[0x22];
-	char *error_strings = NULL;
-	for (int b = 0; b < 15; b++) {
-		if (errors & (2 >> b)) {
-			if (!error_strings) {
-				error_strings = strdup(fault_bits[b]);
-			} else {
-				char *olderr = strdup(error_strings);
-				free(error_strings);
-				if (!asprintf(&error_strings, "%s, %s", olderr, fault_bits[b]))
-					exit(EXIT_FAILURE);
-				free(olderr);
-			}
-		}
+		mqtt_reply(reply, msg, strlen(msg));
+		free(msg);
 	}
-	if (!error_strings) {
-		error_strings = strdup("none");
+}
+
+static double sample_age(void)
+{
+	struct timespec now;
+
+	if (!have_sample)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - sample_mono.tv_sec) + (now.tv_nsec - sample_mono.tv_nsec) / 1e9;
+}
+
+/*
+ * Answer all requests that came in with the last batch of messages. They
+ * share one bus read, and none at all if the current sample is recent
+ * enough for every one of them.
+ */
+static void serve_requests(void)
+{
+	double age = sample_age();
+	bool stale = (age < 0);
+
+	if (npending == 0)
+		return;
+
+	for (int i = 0; i < npending; i++)
+		if (age > pending[i].max_age)
+			stale = true;
+
+	bool failed = stale && (read_sample() < 0);
+
+	for (int i = 0; i < npending; i++) {
+		if (failed)
+			mqtt_reply(pending[i].reply, "error", strlen("error"));
+		else
+			send_sample(pending[i].reply);
 	}
+	npending = 0;
+}
+
+static void request_message(const struct mosquitto_message *message)
+{
+	struct mqtt_reply *reply;
+	char *tmp = NULL;
+	char *fallback = NULL;
+	char id[64] = "";
+	double max_age;
+	int n;
 
-	char *msg = NULL;
-	if (asprintf(&msg,
-			"{"
-			"\"battery_capacity\":\"%d\","
-			"\"battery_voltage\":\"%.1f\","
-			"\"battery_current\":\"%.2f\","
-			"\"controller_temperature\":\"%d\","
-			"\"load_voltage\":\"%.1f\","
-			"\"load_current\":\"%.2f\","
-			"\"load_power\":\"%d\","
-			"\"panel_voltage\":\"%.1f\","
-			"\"panel_current\":\"%.2f\","
-			"\"panel_power\":\"%d\","
-			"\"battery_voltage_min_day\":\"%.1f\","
-			"\"battery_voltage_max_day\":\"%.1f\","
-			"\"charge_current_max_day\":\"%.2f\","
-			"\"discharge_current_max_day\":\"%.2f\","
-			"\"charge_power_max_day\":\"%.2f\","
-			"\"discharge_power_max_day\":\"%.2f\","
-			"\"charge_amp_hours_day\":\"%d\","
-			"\"discharge_amp_hours_day\":\"%d\","
-			"\"charge_generated_day\":\"%.2f\","
-			"\"charge_consumed_day\":\"%.2f\","
-			"\"charging_state\":\"%s\","
-			"\"error_state\":\"%s\","
-			"\"load_enable\":\"%d\","
-			"\"load_brightness\":\"%d\""
-			"}",
-			battery_capacity, battery_voltage, battery_current,
-			controller_temperature,
-			load_voltage, load_current, load_power,
-			panel_voltage, panel_current, panel_power,
-			battery_voltage_min_day, battery_voltage_max_day,
-			charge_current_max_day, discharge_current_max_day,
-			charge_power_max_day, discharge_power_max_day,
-			charge_amp_hours_day, discharge_amp_hours_day,
-			charge_generated_day, charge_consumed_day,
-			state, error_strings, load_enable, load_brightness) < 0)
+	if (asprintf(&tmp, "%.*s", message->payloadlen, (char *)message->payload) < 0)
 		exit(EXIT_FAILURE);
+	n = sscanf(tmp, "%lf %63s", &max_age, id);
+	free(tmp);
 
-	// dump to local file too, we'll use it for various states
-	FILE *f = fopen("/run/panel-state.json", "w");
-	fprintf(f, "%s", msg);
-	fclose(f);
+	// the id ends up in a topic name
+	if (strpbrk(id, "/+#"))
+		n = 0;
 
-	if (mosquitto_publish(mosq, NULL, topic_state, strlen(msg), msg, 0, true) != 0)
+	if ((n == 2) && (asprintf(&fallback, "/%s/%s/reply/%s", hostname, pconf.topic, id) < 0))
 		exit(EXIT_FAILURE);
-	free(msg);
+	reply = mqtt_reply_to(fallback);
+	free(fallback);
+
+	if (!reply) {
+		fprintf(stderr, "Read request without response topic or id\n");
+		return;
+	}
+
+	if ((n < 1) || (max_age < 0)) {
+		mqtt_reply(reply, "invalid", strlen("invalid"));
+		return;
+	}
+
+	if (npending == PENDING_MAX) {
+		mqtt_reply(reply, "busy", strlen("busy"));
+		return;
+	}
+
+	pending[npending].max_age = max_age;
+	pending[npending].reply = reply;
+	npending++;
+}
+
+/*
+ * Send rows of the history as a series of CBOR messages, each with up to
+ * HISTORY_CHUNK_ROWS rows of floats compressed with zlib. The rows go
+ * out in network byte order so any client can read them.
+ */
+static void send_history(struct mqtt_reply *reply, int archive, time_t from, time_t to)
+{
+	static float rows[HISTORY_CHUNK_ROWS * HISTORY_CHANNELS];
+	static uint8_t packed[HISTORY_CHUNK_ROWS * HISTORY_CHANNELS * sizeof(float) + 1024];
+	static uint8_t buf[sizeof(packed) + 256];
+	int step = rra_step(history, archive);
+	const char *cf = rra_cf_name(history_defs[archive].cf);
+	time_t start;
+	size_t total = rra_fetch(history, archive, from, to, &start, NULL, 0);
+	size_t chunks = total ? (total + HISTORY_CHUNK_ROWS - 1) / HISTORY_CHUNK_ROWS : 1;
+
+	for (size_t seq = 0; seq < chunks; seq++) {
+		size_t n = rra_fetch(history, archive, from, to, &start, rows, HISTORY_CHUNK_ROWS);
+		uLongf packed_len = sizeof(packed);
+		struct cbor c;
+
+		for (size_t i = 0; i < n * HISTORY_CHANNELS; i++) {
+			uint32_t v;
+
+			memcpy(&v, &rows[i], sizeof(v));
+			v = htonl(v);
+			memcpy(&rows[i], &v, sizeof(v));
+		}
+
+		if (compress(packed, &packed_len, (const Bytef *)rows, n * HISTORY_CHANNELS * sizeof(float)) != Z_OK)
+			exit(EXIT_FAILURE);
+
+		cbor_init(&c, buf, sizeof(buf));
+		cbor_map(&c, 9);
+		cbor_uint(&c, SCHEMA_KEY);
+		cbor_uint(&c, SCHEMA_HISTORY);
+		cbor_uint(&c, HISTORY_SEQ);
+		cbor_uint(&c, seq);
+		cbor_uint(&c, HISTORY_CHUNKS);
+		cbor_uint(&c, chunks);
+		cbor_uint(&c, HISTORY_START);
+		cbor_int(&c, start);
+		cbor_uint(&c, HISTORY_STEP);
+		cbor_uint(&c, step);
+		cbor_uint(&c, HISTORY_CF);
+		cbor_text(&c, cf);
+		cbor_uint(&c, HISTORY_CHANNELS);
+		cbor_array(&c, HISTORY_CHANNELS);
+		for (int i = 0; i < HISTORY_CHANNELS; i++)
+			cbor_uint(&c, history_keys[i]);
+		cbor_uint(&c, HISTORY_ROWS);
+		cbor_uint(&c, n);
+		cbor_uint(&c, HISTORY_DATA);
+		cbor_bytes(&c, packed, packed_len);
+		if (!cbor_ok(&c))
+			exit(EXIT_FAILURE);
+
+		// every chunk but the last needs its own copy of the address
+		if (seq + 1 < chunks)
+			mqtt_reply(mqtt_reply_dup(reply), buf, c.len);
+		else
+			mqtt_reply(reply, buf, c.len);
+
+		from = start + (time_t)n * step;
+	}
 }
 
-static void message_callback(
-		struct mosquitto *mosq,
-		void *obj __attribute__ ((unused)),
-		const struct mosquitto_message *message)
+/*
+ * A history query is "<from> <to> <step> <cf> [id]". Times are unix
+ * seconds, or relative to now when not positive, so "-3600 0 60 max"
+ * asks for the last hour by the minute. The archive with the finest
+ * step of at least 'step' that still covers 'from' answers.
+ */
+static void history_message(const struct mosquitto_message *message)
 {
+	struct mqtt_reply *reply;
 	char *tmp = NULL;
+	char *fallback = NULL;
+	char cf_name[16] = "";
+	char id[64] = "";
+	long from, to;
+	int step;
+	int archive = -1;
+	int cf = -1;
+	int n;
+
+	if (asprintf(&tmp, "%.*s", message->payloadlen, (char *)message->payload) < 0)
+		exit(EXIT_FAILURE);
+	n = sscanf(tmp, "%ld %ld %d %15s %63s", &from, &to, &step, cf_name, id);
+	free(tmp);
+
+	// the id ends up in a topic name
+	if (strpbrk(id, "/+#"))
+		n = 0;
+
+	if ((n == 5) && (asprintf(&fallback, "/%s/%s/history/reply/%s", hostname, pconf.topic, id) < 0))
+		exit(EXIT_FAILURE);
+	reply = mqtt_reply_to(fallback);
+	free(fallback);
+
+	if (!reply) {
+		fprintf(stderr, "History request without response topic or id\n");
+		return;
+	}
+
+	if (!history) {
+		mqtt_reply(reply, "unavailable", strlen("unavailable"));
+		return;
+	}
+
+	if (n >= 4) {
+		if (from <= 0)
+			from += time(NULL);
+		if (to <= 0)
+			to += time(NULL);
+		cf = rra_cf_parse(cf_name);
+	}
+
+	if (cf >= 0)
+		archive = rra_select(history, cf, step, from);
+	if ((archive < 0) || (step < 0) || (from > to)) {
+		mqtt_reply(reply, "invalid", strlen("invalid"));
+		return;
+	}
+
+	send_history(reply, archive, from, to);
+}
+
+static void control_message(const struct mosquitto_message *message)
+{
+	char *tmp = NULL;
+	int err = 0;
 
 	// use strncmp() instead?
 	if (!asprintf(&tmp, "%.*s", message->payloadlen, (char *)message->payload))
@@ -218,152 +630,320 @@ static void message_callback(
 	
 	free(tmp);
 
-	if ((i < 0) || (i > 100))
+	if ((i < 0) || (i > 100)) {
+		mqtt_ack("invalid");
 		return;
+	}
 
-	if (i == load)
+	if (i == load) {
+		mqtt_ack("ok");
 		return;
+	}
 
 	if ((load <= 0) && (i > 0)) {
 		fprintf(stderr, "Load enabled, %d\n", i);
 		// set load delay to 0
-		if (modbus_write_register(ctx, 0xe01e, 0) < 0)
+		if (bus_write_register(bus, 0xe01e, 0) < 0) {
 			fprintf(stderr, "Error clearing delay value\n");
+			err++;
+		}
 		// enable load
-		if (modbus_write_register(ctx, 0x10a, 1) < 0)
+		if (bus_write_register(bus, 0x10a, 1) < 0) {
 			fprintf(stderr, "Error enabling load\n");
+			err++;
+		}
 		// set brightness value
-		if (modbus_write_register(ctx, 0xe001, i) < 0)
+		if (bus_write_register(bus, 0xe001, i) < 0) {
 			fprintf(stderr, "Error setting dimmer value\n");
+			err++;
+		}
 	} else if ((load > 0) && (i == 0)) {
 		fprintf(stderr, "Load disabled\n");
 		// disable load
-		if (modbus_write_register(ctx, 0x10a, 0) < 0)
+		if (bus_write_register(bus, 0x10a, 0) < 0) {
 			fprintf(stderr, "Error disabling load\n");
+			err++;
+		}
 		// zero brightness
-		if (modbus_write_register(ctx, 0xe001, 0) < 0)
+		if (bus_write_register(bus, 0xe001, 0) < 0) {
 			fprintf(stderr, "Error setting dimmer value\n");
+			err++;
+		}
 	} else {
 		fprintf(stderr, "Load changed, %d\n", i);
 		// change brightness
-		if (modbus_write_register(ctx, 0xe001, i) < 0)
+		if (bus_write_register(bus, 0xe001, i) < 0) {
 			fprintf(stderr, "Error setting dimmer value\n");
+			err++;
+		}
 	}
 
 	load = i;
 
 	usleep(250000);
 
-	publish_state(mosq);
+	publish_state();
+
+	mqtt_ack(err ? "error" : "ok");
+}
+
+static void message_callback(const struct mosquitto_message *message)
+{
+	if (strcmp(message->topic, topic_request) == 0)
+		request_message(message);
+	else if (strcmp(message->topic, topic_history) == 0)
+		history_message(message);
+	else
+		control_message(message);
+}
+
+static int panel_config(const config_t *cfg, struct panel_conf *conf)
+{
+	const char *encoding = conf_string(cfg, "encoding", "json");
+
+	if (strcmp(encoding, "cbor") == 0) {
+		conf->cbor = true;
+	} else if (strcmp(encoding, "json") == 0) {
+		conf->cbor = false;
+	} else {
+		fprintf(stderr, "Unknown encoding \"%s\" in " CONFIG_PATH "\n", encoding);
+		return -1;
+	}
+
+	conf->interval = conf_int(cfg, "panel.interval", 600);
+	if (conf->interval <= 0) {
+		fprintf(stderr, "Invalid panel.interval in " CONFIG_PATH "\n");
+		return -1;
+	}
+
+	conf->sample_interval = conf_int(cfg, "panel.sample_interval", 10);
+	if ((conf->sample_interval <= 0) || (conf->sample_interval > conf->interval)) {
+		fprintf(stderr, "Invalid panel.sample_interval in " CONFIG_PATH "\n");
+		return -1;
+	}
+	conf->max_gap = conf_int(cfg, "panel.max_gap", 6 * conf->sample_interval);
+	conf->metrics_port = conf_int(cfg, "panel.metrics_port", 0);
+
+	if (events_config(cfg, &conf->events) < 0)
+		return -1;
+
+	conf->topic = strdup(conf_string(cfg, "panel.topic", "renogy"));
+	conf->energy_state = strdup(conf_string(cfg, "panel.energy_state", "/var/lib/panel-pub/energy"));
+	conf->history = strdup(conf_string(cfg, "panel.history", "/var/lib/panel-pub/history"));
+	if (!conf->topic || !conf->energy_state || !conf->history)
+		exit(EXIT_FAILURE);
+
+	bus_config(cfg, &conf->bus);
+
+	return 0;
+}
+
+static void panel_config_free(struct panel_conf *conf)
+{
+	bus_config_free(&conf->bus);
+	free(conf->topic);
+	free(conf->energy_state);
+	free(conf->history);
+	events_free(&conf->events);
+}
+
+static void setup_topics(void)
+{
+	char *name = NULL;
+
+	free(topic_state);
+	free(topic_control);
+	free(topic_request);
+	free(topic_history);
+
+	if (asprintf(&topic_state, "/%s/%s/state", hostname, pconf.topic) < 0)
+		exit(EXIT_FAILURE);
+	if (asprintf(&topic_control, "/%s/%s/control", hostname, pconf.topic) < 0)
+		exit(EXIT_FAILURE);
+	if (asprintf(&topic_request, "/%s/%s/request", hostname, pconf.topic) < 0)
+		exit(EXIT_FAILURE);
+	if (asprintf(&topic_history, "/%s/%s/history/request", hostname, pconf.topic) < 0)
+		exit(EXIT_FAILURE);
+
+	// let the broker drop a retained sample once two more should have arrived
+	state_topic = mqtt_topic_rename(state_topic, topic_state, MQTT_OVERWRITE,
+			true, 2 * pconf.interval);
+
+	// the bus counters are state too
+	if (asprintf(&name, "/%s/%s/bus", hostname, pconf.topic) < 0)
+		exit(EXIT_FAILURE);
+	bus_topic = mqtt_topic_rename(bus_topic, name, MQTT_OVERWRITE,
+			true, 2 * pconf.interval);
+	free(name);
+
+	// completed periods must not overwrite each other while offline
+	for (int k = 0; k < ENERGY_KINDS; k++) {
+		if (asprintf(&name, "/%s/%s/energy/%s", hostname, pconf.topic,
+				(k == ENERGY_HOUR) ? "hour" : "day") < 0)
+			exit(EXIT_FAILURE);
+		energy_topic[k] = mqtt_topic_rename(energy_topic[k], name, MQTT_QUEUE, true, 0);
+		free(name);
+	}
+
+	// the same for events, but an old event is no news
+	if (asprintf(&name, "/%s/%s/event", hostname, pconf.topic) < 0)
+		exit(EXIT_FAILURE);
+	event_topic = mqtt_topic_rename(event_topic, name, MQTT_QUEUE, false, 0);
+	free(name);
+}
+
+static void reload_config(void)
+{
+	struct panel_conf nconf;
+	config_t cfg;
+
+	if (conf_load(&cfg) < 0)
+		return;
+	if (panel_config(&cfg, &nconf) < 0) {
+		config_destroy(&cfg);
+		return;
+	}
+	config_destroy(&cfg);
+
+	fprintf(stderr, "Reloading " CONFIG_PATH "\n");
+
+	if (!bus_config_equal(&pconf.bus, &nconf.bus)) {
+		struct bus *nbus = bus_new(&nconf.bus);
+
+		if (!nbus) {
+			// keep talking to the old device rather than to none
+			fprintf(stderr, "Keeping %s\n", pconf.bus.device);
+			bus_config_free(&nconf.bus);
+			nconf.bus = pconf.bus;
+			memset(&pconf.bus, 0, sizeof(pconf.bus));
+		} else {
+			fprintf(stderr, "Switched to %s\n", nconf.bus.device);
+			bus_free(bus);
+			bus = nbus;
+		}
+	}
+
+	bool topics_changed = (strcmp(pconf.topic, nconf.topic) != 0) ||
+		(pconf.interval != nconf.interval);
+
+	if (pconf.metrics_port != nconf.metrics_port) {
+		if (metrics_fd >= 0)
+			close(metrics_fd);
+		metrics_fd = (nconf.metrics_port > 0) ? metrics_listen(nconf.metrics_port) : -1;
+	}
+
+	energy.max_gap = nconf.max_gap;
+	if (strcmp(pconf.energy_state, nconf.energy_state) != 0)
+		energy_save(&energy, nconf.energy_state);
+
+	if (strcmp(pconf.history, nconf.history) != 0) {
+		rra_close(history);
+		history = open_history(nconf.history);
+	}
+
+	events_keep(&nconf.events, &pconf.events);
+
+	panel_config_free(&pconf);
+	pconf = nconf;
+
+	if (topics_changed) {
+		setup_topics();
+		mqtt_subscribe((const char *[]){ topic_control, topic_request, topic_history, NULL });
+		fprintf(stderr, "state topic = %s, control topic = %s\n",
+			topic_state, topic_control);
+	}
 }
 
 int main(void) {
-	static struct mosquitto *mosq = NULL;
 	config_t cfg;
-	int ret;
-	const char *conf_server;
-	int conf_port;
-	time_t publish_time = time(NULL) - (time_t)PUBLISH_INTERVAL;
+	struct mqtt_conf conf;
+	struct pollfd fds[1 + METRICS_FDS];
+	time_t publish_time;
+	time_t sample_time;
+
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
 
 	// what to do if terminated
 	signal(SIGINT, sigfunc);
 	signal(SIGTERM, sigfunc);
 
 	// parse configs
-	config_init(&cfg);
-	if (!config_read_file(&cfg, CONFIG_PATH)) {
-		fprintf(stderr, "%s:%d - %s\n", config_error_file(&cfg), config_error_line(&cfg), config_error_text(&cfg));
+	conf_read(&cfg);
+	mqtt_config(&cfg, &conf);
+	if (panel_config(&cfg, &pconf) < 0)
 		exit(EXIT_FAILURE);
-	}
 
-	if (!config_lookup_string(&cfg, "server", &conf_server)) {
-		fprintf(stderr, "No server defined in " CONFIG_PATH "\n");
-		exit(EXIT_FAILURE);
-	}
-	if (!config_lookup_int(&cfg, "port", &conf_port)) {
-		fprintf(stderr, "No port defined in " CONFIG_PATH "\n");
-		exit(EXIT_FAILURE);
-	}
+	fds[0].fd = conf_watch();
+	fds[0].events = POLLIN;
 
-	fprintf(stderr, "MQTT server: %s:%d\n", conf_server, conf_port);
+	if (pconf.metrics_port > 0)
+		metrics_fd = metrics_listen(pconf.metrics_port);
 
-	// setup modbus
-	ctx = modbus_new_rtu("/dev/ttyS1", 9600, 'N', 8, 1);
-	if (!ctx) {
-		perror("Unable to create the libmodbus context\n");
-		exit(EXIT_FAILURE);
-	}
+	energy_init(&energy, pconf.max_gap);
+	if (energy_load(&energy, pconf.energy_state) == 0)
+		fprintf(stderr, "Restored energy totals from %s\n", pconf.energy_state);
 
-	modbus_set_slave(ctx, 1);
+	history = open_history(pconf.history);
 
-	if (modbus_connect(ctx) == -1) {
-		fprintf(stderr, "Connection failed: %s\n", modbus_strerror(errno));
-		modbus_free(ctx);
+	// setup modbus
+	bus = bus_new(&pconf.bus);
+	if (!bus)
 		exit(EXIT_FAILURE);
-	}
 
 	// use system hostname here
-	char hostname[HOST_NAME_MAX+1];
 	hostname[HOST_NAME_MAX] = 0;
 	if (gethostname(hostname, HOST_NAME_MAX) != 0)
 		exit(EXIT_FAILURE);
 
-	// setup topics
-	if (!asprintf(&topic_state, "/%s/renogy/state", hostname))
-		exit(EXIT_FAILURE);
-	if (!asprintf(&topic_control, "/%s/renogy/control", hostname))
-		exit(EXIT_FAILURE);
-
 	/* setup mqtt */
-	mosquitto_lib_init();
-	mosq = mosquitto_new(NULL, true, NULL);
-	if (!mosq)
-		exit(EXIT_FAILURE);
+	setup_topics();
+	mqtt_connect(&conf, (const char *[]){ topic_control, topic_request, topic_history, NULL }, message_callback);
 
-	mosquitto_message_callback_set(mosq, message_callback);
+	fprintf(stderr, "state topic = %s, control topic = %s\n",
+		topic_state, topic_control);
 
-	while (mosquitto_connect(mosq, conf_server, conf_port, 15) != 0) {
-		fprintf(stderr, "Waiting for connection to server\n");
-		sleep(300);
-	}
+	// the first sample goes out right away, not after a sample interval
+	publish_time = time(NULL);
+	sample_time = publish_time;
+	publish_state();
 
-	ret = mosquitto_subscribe(mosq, NULL, topic_control, 0);
-	if (ret != 0) {
-		fprintf(stderr, "mosquitto_subscribe: %d: %s\n", ret, strerror(errno));
-	}
+	for (;;) {
+		time_t wait = sample_time + pconf.sample_interval - time(NULL);
 
-	fprintf(stderr, "connected, state topic = %s, control topic = %s\n",
-		topic_state, topic_control);
+		int timeout = (wait > 0) ? ((wait < 10) ? wait * 1000 : 10000) : 0;
+		int nmetrics = metrics_poll(metrics_fd, fds + 1, &timeout);
 
-	for (;;) {
-		ret = mosquitto_loop(mosq, 10000, 1);
-		if ((ret == MOSQ_ERR_CONN_LOST) || (ret == MOSQ_ERR_NO_CONN)) {
-			sleep(5);
-			mosquitto_reconnect(mosq);
-		} else if (ret != MOSQ_ERR_SUCCESS) {
-			fprintf(stderr, "mosquitto_loop(): %d, %s\n", ret, strerror(errno));
-			exit(EXIT_FAILURE);
-		}
+		mqtt_loop(timeout, fds, 1 + nmetrics);
+		serve_requests();
+
+		if ((fds[0].revents & POLLIN) && conf_changed(fds[0].fd))
+			reload_config();
+
+		metrics_serve(metrics_fd, fds + 1, nmetrics);
 
 		if (stop == 1) {
-			publish_state(mosq);
+			publish_state();
 			break;
 		}
 
 		time_t now = time(NULL);
-		if (now - publish_time > (time_t)PUBLISH_INTERVAL) {
+		if (now - publish_time > (time_t)pconf.interval) {
 			publish_time = now;
-			publish_state(mosq);
+			sample_time = now;
+			publish_state();
+		} else if (now - sample_time >= (time_t)pconf.sample_interval) {
+			sample_time = now;
+			read_sample();
 		}
 	}
 
-	mosquitto_disconnect(mosq);
-	mosquitto_loop_stop(mosq, false);
-	mosquitto_destroy(mosq);
-	mosquitto_lib_cleanup();
+	mqtt_close();
+
+	energy_save(&energy, pconf.energy_state);
+	rra_close(history);
 
-	modbus_close(ctx);
-	modbus_free(ctx);
+	bus_free(bus);
 
+	panel_config_free(&pconf);
 	config_destroy(&cfg);
 }
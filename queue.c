@@ -0,0 +1,66 @@
+
+/**
+
+Copyright 2019 - Auke Kok <sofar@foo-projects.org
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject
+to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**/
+
+#include <stddef.h>
+
+#include "queue.h"
+
+void queue_init(struct queue *q)
+{
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+}
+
+bool queue_push(struct queue *q, void *item)
+{
+	unsigned int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+	if (head - tail == QUEUE_SIZE)
+		return false;
+
+	q->slot[head & (QUEUE_SIZE - 1)] = item;
+	// publish the slot contents before the consumer can see the new head
+	atomic_store_explicit(&q->head, head + 1, memory_order_release);
+
+	return true;
+}
+
+void *queue_pop(struct queue *q)
+{
+	unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&q->head, memory_order_acquire);
+	void *item;
+
+	if (tail == head)
+		return NULL;
+
+	item = q->slot[tail & (QUEUE_SIZE - 1)];
+	// hand the slot back to the producer only after reading it
+	atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+
+	return item;
+}
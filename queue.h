@@ -0,0 +1,55 @@
+
+/**
+
+Copyright 2019 - Auke Kok <sofar@foo-projects.org
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject
+to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**/
+
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+
+/*
+ * Bounded lock-free single producer, single consumer ring of pointers.
+ * One thread may push and one other thread may pop concurrently; neither
+ * ever blocks. QUEUE_SIZE must be a power of two.
+ */
+
+#define QUEUE_SIZE 64
+
+struct queue {
+	_Atomic unsigned int head; // written by the producer
+	_Atomic unsigned int tail; // written by the consumer
+	void *slot[QUEUE_SIZE];
+};
+
+void queue_init(struct queue *q);
+
+/* returns false if the queue is full, the item is then not queued */
+bool queue_push(struct queue *q, void *item);
+
+/* returns NULL if the queue is empty */
+void *queue_pop(struct queue *q);
+
+#endif
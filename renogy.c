@@ -0,0 +1,385 @@
+
+/**
+
+Copyright 2019 - Auke Kok <sofar@foo-projects.org
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject
+to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <modbus.h>
+
+#include "renogy.h"
+#include "cbor.h"
+#include "schema.h"
+
+#define CHARGING_STATES_MAX 7
+static const char* charging_states[CHARGING_STATES_MAX] = {
+	"charging deactivated",
+	"charging activated",
+	"mptt charging",
+	"equalizing charging",
+	"boost charging",
+	"floating charging",
+	"current limiting"
+};
+
+#define FAULT_BITS_MAX RENOGY_FAULT_BITS
+static const char* fault_bits[FAULT_BITS_MAX] = {
+	"battery over-discharge",
+	"battery over-voltage",
+	"battery under-voltage",
+	"load short circuit",
+	"load overpower or load over-current",
+	"controller temperature too high",
+	"ambient temperature too high",
+	"photovoltaic input overpower",
+	"photovoltaic input side short circuit",
+	"photovoltaic input side over-voltage",
+	"solar panel counter-current",
+	"solar panel working point over-voltage",
+	"solar panel reversely connected",
+	"anti-reverse MOS short",
+	"circuit, charge MOS short circuit"
+};
+
+const char *renogy_charging_state(int state)
+{
+	if ((state >= 0) && (state < CHARGING_STATES_MAX))
+		return charging_states[state];
+	return "unknown";
+}
+
+const char *renogy_fault(int bit)
+{
+	if ((bit >= 0) && (bit < FAULT_BITS_MAX))
+		return fault_bits[bit];
+	return "unknown";
+}
+
+void renogy_decode(const uint16_t *regs, struct renogy_sample *s)
+{
+	s->battery_capacity = regs[0];
+	s->battery_voltage = regs[1] / 10.;
+	s->battery_current = regs[2] / 100.;
+
+	s->controller_temperature = (int8_t) MODBUS_GET_HIGH_BYTE(regs[3]);
+
+	s->load_voltage = regs[4] / 10.;
+	s->load_current = regs[5] / 100.;
+	s->load_power = regs[6];
+
+	s->panel_voltage = regs[7] / 10.;
+	s->panel_current = regs[8] / 100.;
+	s->panel_power = regs[9];
+
+	s->battery_voltage_min_day = regs[0xb] / 10.;
+	s->battery_voltage_max_day = regs[0xc] / 10.;
+
+	s->charge_current_max_day = regs[0xd] / 100.;
+	s->discharge_current_max_day = regs[0xe] / 100.;
+
+	s->charge_power_max_day = regs[0xf] / 100.;
+	s->discharge_power_max_day = regs[0x10] / 100.;
+
+	s->charge_amp_hours_day = regs[0x11];
+	s->discharge_amp_hours_day = regs[0x12];
+
+	s->charge_generated_day = regs[0x13] / 10000.;
+	s->charge_consumed_day = regs[0x14] / 10000.;
+
+	s->charging_state = (int8_t) MODBUS_GET_LOW_BYTE(regs[0x20]);
+
+	s->load_enable = MODBUS_GET_HIGH_BYTE(regs[0x20]) >> 7;
+	s->load_brightness = MODBUS_GET_HIGH_BYTE(regs[0x20]) & 0x7f;
+
+	s->errors = regs[0x21];
+}
+
+// samples per pass, the register blocks are read once per column so
+// they should stay in L1 meanwhile
+#define BATCH_CHUNK 64
+
+struct renogy_batch *renogy_batch_new(size_t size)
+{
+	struct renogy_batch *b = calloc(1, sizeof(*b));
+	float **f[] = {
+		&b->battery_voltage, &b->battery_current, &b->load_voltage, &b->load_current,
+		&b->panel_voltage, &b->panel_current, &b->battery_voltage_min_day,
+		&b->battery_voltage_max_day, &b->charge_current_max_day,
+		&b->discharge_current_max_day, &b->charge_power_max_day,
+		&b->discharge_power_max_day, &b->charge_generated_day, &b->charge_consumed_day,
+	};
+	uint16_t **u[] = {
+		&b->battery_capacity, &b->load_power, &b->panel_power,
+		&b->charge_amp_hours_day, &b->discharge_amp_hours_day, &b->errors,
+	};
+	char *p;
+
+	if (!b)
+		return NULL;
+
+	// one allocation, columns ordered by alignment
+	p = malloc(size * (sizeof(float) * 14 + sizeof(uint16_t) * 6 + 4));
+	if (!p) {
+		free(b);
+		return NULL;
+	}
+
+	for (size_t i = 0; i < sizeof(f) / sizeof(f[0]); i++, p += size * sizeof(float))
+		*f[i] = (float *)p;
+	for (size_t i = 0; i < sizeof(u) / sizeof(u[0]); i++, p += size * sizeof(uint16_t))
+		*u[i] = (uint16_t *)p;
+	b->controller_temperature = (int8_t *)p;
+	b->charging_state = (int8_t *)(p + size);
+	b->load_enable = (uint8_t *)(p + 2 * size);
+	b->load_brightness = (uint8_t *)(p + 3 * size);
+
+	b->size = size;
+	return b;
+}
+
+void renogy_batch_free(struct renogy_batch *b)
+{
+	if (!b)
+		return;
+	free(b->battery_voltage);
+	free(b);
+}
+
+/*
+ * One loop per column, simple enough for the compiler to vectorize.
+ * For every 16 bit value a float division rounds the same as the
+ * double one in renogy_decode(), and it vectorizes twice as wide. A
+ * multiply by the reciprocal would not round the same.
+ */
+#define SCALE(col, reg, div) \
+	for (size_t i = 0; i < m; i++) \
+		b->col[base + i] = r[i * stride + (reg)] / (float)(div)
+#define COPY(col, reg) \
+	for (size_t i = 0; i < m; i++) \
+		b->col[base + i] = r[i * stride + (reg)]
+
+void renogy_decode_batch(const uint16_t *regs, size_t stride, size_t n,
+		struct renogy_batch *b)
+{
+	if (n > b->size)
+		n = b->size;
+	b->n = n;
+
+	for (size_t base = 0; base < n; base += BATCH_CHUNK) {
+		size_t m = (n - base < BATCH_CHUNK) ? n - base : BATCH_CHUNK;
+		const uint16_t *r = regs + base * stride;
+
+		SCALE(battery_voltage, 0x01, 10);
+		SCALE(battery_current, 0x02, 100);
+		SCALE(load_voltage, 0x04, 10);
+		SCALE(load_current, 0x05, 100);
+		SCALE(panel_voltage, 0x07, 10);
+		SCALE(panel_current, 0x08, 100);
+		SCALE(battery_voltage_min_day, 0x0b, 10);
+		SCALE(battery_voltage_max_day, 0x0c, 10);
+		SCALE(charge_current_max_day, 0x0d, 100);
+		SCALE(discharge_current_max_day, 0x0e, 100);
+		SCALE(charge_power_max_day, 0x0f, 100);
+		SCALE(discharge_power_max_day, 0x10, 100);
+		SCALE(charge_generated_day, 0x13, 10000);
+		SCALE(charge_consumed_day, 0x14, 10000);
+		COPY(battery_capacity, 0x00);
+		COPY(load_power, 0x06);
+		COPY(panel_power, 0x09);
+		COPY(charge_amp_hours_day, 0x11);
+		COPY(discharge_amp_hours_day, 0x12);
+		COPY(errors, 0x21);
+		for (size_t i = 0; i < m; i++) {
+			uint16_t t = r[i * stride + 0x03];
+			uint16_t st = r[i * stride + 0x20];
+
+			b->controller_temperature[base + i] = (int8_t)(t >> 8);
+			b->charging_state[base + i] = (int8_t)(st & 0xff);
+			b->load_enable[base + i] = st >> 15;
+			b->load_brightness[base + i] = (st >> 8) & 0x7f;
+		}
+	}
+}
+
+void renogy_batch_sample(const struct renogy_batch *b, size_t i, struct renogy_sample *s)
+{
+	s->battery_capacity = b->battery_capacity[i];
+	s->battery_voltage = b->battery_voltage[i];
+	s->battery_current = b->battery_current[i];
+	s->controller_temperature = b->controller_temperature[i];
+	s->load_voltage = b->load_voltage[i];
+	s->load_current = b->load_current[i];
+	s->load_power = b->load_power[i];
+	s->panel_voltage = b->panel_voltage[i];
+	s->panel_current = b->panel_current[i];
+	s->panel_power = b->panel_power[i];
+	s->battery_voltage_min_day = b->battery_voltage_min_day[i];
+	s->battery_voltage_max_day = b->battery_voltage_max_day[i];
+	s->charge_current_max_day = b->charge_current_max_day[i];
+	s->discharge_current_max_day = b->discharge_current_max_day[i];
+	s->charge_power_max_day = b->charge_power_max_day[i];
+	s->discharge_power_max_day = b->discharge_power_max_day[i];
+	s->charge_amp_hours_day = b->charge_amp_hours_day[i];
+	s->discharge_amp_hours_day = b->discharge_amp_hours_day[i];
+	s->charge_generated_day = b->charge_generated_day[i];
+	s->charge_consumed_day = b->charge_consumed_day[i];
+	s->charging_state = b->charging_state[i];
+	s->errors = b->errors[i];
+	s->load_enable = b->load_enable[i];
+	s->load_brightness = b->load_brightness[i];
+}
+
+char *renogy_json(const struct renogy_sample *s)
+{
+	const char *state = renogy_charging_state(s->charging_state);
+	char *error_strings = NULL;
+	char *msg = NULL;
+
+	for (int b = 0; b < FAULT_BITS_MAX; b++) {
+		if (s->errors & (1 << b)) {
+			if (!error_strings) {
+				error_strings = strdup(fault_bits[b]);
+			} else {
+				char *olderr = strdup(error_strings);
+				free(error_strings);
+				if (!asprintf(&error_strings, "%s, %s", olderr, fault_bits[b]))
+					exit(EXIT_FAILURE);
+				free(olderr);
+			}
+		}
+	}
+	if (!error_strings) {
+		error_strings = strdup("none");
+	}
+
+	if (asprintf(&msg,
+			"{"
+			"\"battery_capacity\":\"%d\","
+			"\"battery_voltage\":\"%.1f\","
+			"\"battery_current\":\"%.2f\","
+			"\"controller_temperature\":\"%d\","
+			"\"load_voltage\":\"%.1f\","
+			"\"load_current\":\"%.2f\","
+			"\"load_power\":\"%d\","
+			"\"panel_voltage\":\"%.1f\","
+			"\"panel_current\":\"%.2f\","
+			"\"panel_power\":\"%d\","
+			"\"battery_voltage_min_day\":\"%.1f\","
+			"\"battery_voltage_max_day\":\"%.1f\","
+			"\"charge_current_max_day\":\"%.2f\","
+			"\"discharge_current_max_day\":\"%.2f\","
+			"\"charge_power_max_day\":\"%.2f\","
+			"\"discharge_power_max_day\":\"%.2f\","
+			"\"charge_amp_hours_day\":\"%d\","
+			"\"discharge_amp_hours_day\":\"%d\","
+			"\"charge_generated_day\":\"%.2f\","
+			"\"charge_consumed_day\":\"%.2f\","
+			"\"charging_state\":\"%s\","
+			"\"error_state\":\"%s\","
+			"\"load_enable\":\"%d\","
+			"\"load_brightness\":\"%d\""
+			"}",
+			s->battery_capacity, s->battery_voltage, s->battery_current,
+			s->controller_temperature,
+			s->load_voltage, s->load_current, s->load_power,
+			s->panel_voltage, s->panel_current, s->panel_power,
+			s->battery_voltage_min_day, s->battery_voltage_max_day,
+			s->charge_current_max_day, s->discharge_current_max_day,
+			s->charge_power_max_day, s->discharge_power_max_day,
+			s->charge_amp_hours_day, s->discharge_amp_hours_day,
+			s->charge_generated_day, s->charge_consumed_day,
+			state, error_strings, s->load_enable, s->load_brightness) < 0)
+		exit(EXIT_FAILURE);
+
+	free(error_strings);
+	return msg;
+}
+
+size_t renogy_cbor(const struct renogy_sample *s, uint8_t *buf, size_t size)
+{
+	struct cbor c;
+
+	cbor_init(&c, buf, size);
+	cbor_map(&c, PANEL_KEY_MAX);
+
+	cbor_uint(&c, SCHEMA_KEY);
+	cbor_uint(&c, SCHEMA_PANEL);
+
+	cbor_uint(&c, PANEL_BATTERY_CAPACITY);
+	cbor_int(&c, s->battery_capacity);
+	cbor_uint(&c, PANEL_BATTERY_VOLTAGE);
+	cbor_float(&c, s->battery_voltage);
+	cbor_uint(&c, PANEL_BATTERY_CURRENT);
+	cbor_float(&c, s->battery_current);
+	cbor_uint(&c, PANEL_CONTROLLER_TEMPERATURE);
+	cbor_int(&c, s->controller_temperature);
+	cbor_uint(&c, PANEL_LOAD_VOLTAGE);
+	cbor_float(&c, s->load_voltage);
+	cbor_uint(&c, PANEL_LOAD_CURRENT);
+	cbor_float(&c, s->load_current);
+	cbor_uint(&c, PANEL_LOAD_POWER);
+	cbor_int(&c, s->load_power);
+	cbor_uint(&c, PANEL_PANEL_VOLTAGE);
+	cbor_float(&c, s->panel_voltage);
+	cbor_uint(&c, PANEL_PANEL_CURRENT);
+	cbor_float(&c, s->panel_current);
+	cbor_uint(&c, PANEL_PANEL_POWER);
+	cbor_int(&c, s->panel_power);
+	cbor_uint(&c, PANEL_BATTERY_VOLTAGE_MIN_DAY);
+	cbor_float(&c, s->battery_voltage_min_day);
+	cbor_uint(&c, PANEL_BATTERY_VOLTAGE_MAX_DAY);
+	cbor_float(&c, s->battery_voltage_max_day);
+	cbor_uint(&c, PANEL_CHARGE_CURRENT_MAX_DAY);
+	cbor_float(&c, s->charge_current_max_day);
+	cbor_uint(&c, PANEL_DISCHARGE_CURRENT_MAX_DAY);
+	cbor_float(&c, s->discharge_current_max_day);
+	cbor_uint(&c, PANEL_CHARGE_POWER_MAX_DAY);
+	cbor_float(&c, s->charge_power_max_day);
+	cbor_uint(&c, PANEL_DISCHARGE_POWER_MAX_DAY);
+	cbor_float(&c, s->discharge_power_max_day);
+	cbor_uint(&c, PANEL_CHARGE_AMP_HOURS_DAY);
+	cbor_int(&c, s->charge_amp_hours_day);
+	cbor_uint(&c, PANEL_DISCHARGE_AMP_HOURS_DAY);
+	cbor_int(&c, s->discharge_amp_hours_day);
+	cbor_uint(&c, PANEL_CHARGE_GENERATED_DAY);
+	cbor_float(&c, s->charge_generated_day);
+	cbor_uint(&c, PANEL_CHARGE_CONSUMED_DAY);
+	cbor_float(&c, s->charge_consumed_day);
+	cbor_uint(&c, PANEL_CHARGING_STATE);
+	cbor_int(&c, s->charging_state);
+	cbor_uint(&c, PANEL_ERROR_STATE);
+	cbor_int(&c, s->errors);
+	cbor_uint(&c, PANEL_LOAD_ENABLE);
+	cbor_int(&c, s->load_enable);
+	cbor_uint(&c, PANEL_LOAD_BRIGHTNESS);
+	cbor_int(&c, s->load_brightness);
+
+	if (!cbor_ok(&c))
+		return 0;
+	return c.len;
+}
@@ -0,0 +1,131 @@
+
+/**
+
+Copyright 2019 - Auke Kok <sofar@foo-projects.org
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject
+to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**/
+
+#ifndef RENOGY_H
+#define RENOGY_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* live data block of the charge controller */
+#define RENOGY_REG_BASE 0x100
+#define RENOGY_REG_COUNT 0x22
+
+/* fault bits in the high word of the fault register, 0x121 */
+#define RENOGY_FAULT_BITS 15
+
+struct renogy_sample {
+	int battery_capacity;
+	float battery_voltage;
+	float battery_current;
+	int controller_temperature;
+	float load_voltage;
+	float load_current;
+	int load_power;
+	float panel_voltage;
+	float panel_current;
+	int panel_power;
+	float battery_voltage_min_day;
+	float battery_voltage_max_day;
+	float charge_current_max_day;
+	float discharge_current_max_day;
+	float charge_power_max_day;
+	float discharge_power_max_day;
+	int charge_amp_hours_day;
+	int discharge_amp_hours_day;
+	float charge_generated_day;
+	float charge_consumed_day;
+	int charging_state;
+	int errors;
+	int load_enable;
+	int load_brightness;
+};
+
+/* decode the register block read from RENOGY_REG_BASE */
+void renogy_decode(const uint16_t *regs, struct renogy_sample *s);
+
+/* descriptions of a charging state and a fault bit */
+const char *renogy_charging_state(int state);
+const char *renogy_fault(int bit);
+
+/*
+ * Structure of arrays for decoding many register blocks at once, e.g.
+ * when replaying logs of a whole site. Each column holds 'size' values,
+ * the first 'n' of them decoded. The fields mean the same as in struct
+ * renogy_sample.
+ */
+struct renogy_batch {
+	size_t n;
+	size_t size;
+	float *battery_voltage;
+	float *battery_current;
+	float *load_voltage;
+	float *load_current;
+	float *panel_voltage;
+	float *panel_current;
+	float *battery_voltage_min_day;
+	float *battery_voltage_max_day;
+	float *charge_current_max_day;
+	float *discharge_current_max_day;
+	float *charge_power_max_day;
+	float *discharge_power_max_day;
+	float *charge_generated_day;
+	float *charge_consumed_day;
+	uint16_t *battery_capacity;
+	uint16_t *load_power;
+	uint16_t *panel_power;
+	uint16_t *charge_amp_hours_day;
+	uint16_t *discharge_amp_hours_day;
+	uint16_t *errors;
+	int8_t *controller_temperature;
+	int8_t *charging_state;
+	uint8_t *load_enable;
+	uint8_t *load_brightness;
+};
+
+/* allocate columns for 'size' samples, NULL if out of memory */
+struct renogy_batch *renogy_batch_new(size_t size);
+void renogy_batch_free(struct renogy_batch *b);
+
+/*
+ * Decode 'n' register blocks that start 'stride' registers apart, at
+ * most b->size. Like renogy_decode() a block must hold at least
+ * RENOGY_REG_COUNT registers, and the values are the same as it gives
+ * per block.
+ */
+void renogy_decode_batch(const uint16_t *regs, size_t stride, size_t n,
+		struct renogy_batch *b);
+
+/* copy sample 'i' out of a batch, to serialize it */
+void renogy_batch_sample(const struct renogy_batch *b, size_t i, struct renogy_sample *s);
+
+/* JSON message, returned string must be freed by the caller */
+char *renogy_json(const struct renogy_sample *s);
+
+/* CBOR message using the keys from schema.h, returns the encoded length */
+size_t renogy_cbor(const struct renogy_sample *s, uint8_t *buf, size_t size);
+
+#endif
@@ -0,0 +1,368 @@
+
+/**
+
+Copyright 2019 - Auke Kok <sofar@foo-projects.org
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject
+to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rra.h"
+
+/*
+ * File layout: the header, the archive headers, then per archive the
+ * consolidation state of the row being filled (one double per channel)
+ * and the ring of rows. Row 'slot % rows' holds the step starting at
+ * 'slot * step'.
+ */
+
+struct rra_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t channels;
+	uint32_t archives;
+};
+
+struct rra_archive {
+	uint32_t step;
+	uint32_t rows;
+	uint32_t cf;
+	uint32_t count;  // samples in the row being filled
+	int64_t slot;    // the row being filled, -1 before the first sample
+	uint64_t offset; // of the consolidation state, the rows follow it
+};
+
+_Static_assert(sizeof(struct rra_archive) == 32, "struct rra_archive layout changed");
+
+struct rra {
+	size_t size;
+	struct rra_header *h;
+	struct rra_archive *a;
+	int channels;
+};
+
+static const char *cf_names[RRA_CFS] = {
+	[RRA_AVERAGE] = "average",
+	[RRA_MIN] = "min",
+	[RRA_MAX] = "max",
+	[RRA_LAST] = "last",
+};
+
+const char *rra_cf_name(enum rra_cf cf)
+{
+	return cf_names[cf];
+}
+
+int rra_cf_parse(const char *name)
+{
+	for (int i = 0; i < RRA_CFS; i++)
+		if (strcasecmp(name, cf_names[i]) == 0)
+			return i;
+	return -1;
+}
+
+static double *acc(const struct rra *r, int i)
+{
+	return (double *)((char *)r->h + r->a[i].offset);
+}
+
+static float *row(const struct rra *r, int i, int64_t slot)
+{
+	float *rows = (float *)(acc(r, i) + r->channels);
+
+	return rows + (slot % r->a[i].rows) * r->channels;
+}
+
+static size_t layout(int channels, const struct rra_def *defs, int ndefs, uint64_t *offsets)
+{
+	size_t size = sizeof(struct rra_header) + ndefs * sizeof(struct rra_archive);
+
+	for (int i = 0; i < ndefs; i++) {
+		offsets[i] = size;
+		size += channels * sizeof(double);
+		size += (size_t)defs[i].rows * channels * sizeof(float);
+		// keep the next consolidation state aligned
+		size = (size + 7) & ~(size_t)7;
+	}
+
+	return size;
+}
+
+static bool matches(const struct rra *r, const struct rra_def *defs, int ndefs, const uint64_t *offsets)
+{
+	if ((r->h->magic != RRA_MAGIC) || (r->h->version != RRA_VERSION) ||
+	    (r->h->channels != (uint32_t)r->channels) || (r->h->archives != (uint32_t)ndefs))
+		return false;
+
+	for (int i = 0; i < ndefs; i++) {
+		if ((r->a[i].step != (uint32_t)defs[i].step) ||
+		    (r->a[i].rows != (uint32_t)defs[i].rows) ||
+		    (r->a[i].cf != (uint32_t)defs[i].cf) ||
+		    (r->a[i].offset != offsets[i]))
+			return false;
+	}
+
+	return true;
+}
+
+static void init(struct rra *r, const struct rra_def *defs, int ndefs, const uint64_t *offsets)
+{
+	r->h->magic = RRA_MAGIC;
+	r->h->version = RRA_VERSION;
+	r->h->channels = r->channels;
+	r->h->archives = ndefs;
+
+	for (int i = 0; i < ndefs; i++) {
+		r->a[i].step = defs[i].step;
+		r->a[i].rows = defs[i].rows;
+		r->a[i].cf = defs[i].cf;
+		r->a[i].count = 0;
+		r->a[i].slot = -1;
+		r->a[i].offset = offsets[i];
+
+		for (int s = 0; s < defs[i].rows; s++) {
+			float *v = row(r, i, s);
+
+			for (int c = 0; c < r->channels; c++)
+				v[c] = NAN;
+		}
+	}
+}
+
+struct rra *rra_open(const char *path, int channels, const struct rra_def *defs, int ndefs)
+{
+	uint64_t offsets[ndefs];
+	struct rra *r;
+	struct stat st;
+	int fd;
+
+	for (int i = 0; i < ndefs; i++) {
+		if ((defs[i].step <= 0) || (defs[i].rows <= 0)) {
+			fprintf(stderr, "Invalid archive definition %d\n", i);
+			return NULL;
+		}
+	}
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		exit(EXIT_FAILURE);
+	r->channels = channels;
+	r->size = layout(channels, defs, ndefs, offsets);
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+		free(r);
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		free(r);
+		return NULL;
+	}
+
+	// a file of the wrong size is reset below, size it first
+	if (((size_t)st.st_size != r->size) && (ftruncate(fd, r->size) < 0)) {
+		fprintf(stderr, "Unable to resize %s: %s\n", path, strerror(errno));
+		close(fd);
+		free(r);
+		return NULL;
+	}
+
+	r->h = mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (r->h == MAP_FAILED) {
+		fprintf(stderr, "Unable to map %s: %s\n", path, strerror(errno));
+		free(r);
+		return NULL;
+	}
+	r->a = (struct rra_archive *)(r->h + 1);
+
+	if (((size_t)st.st_size != r->size) || !matches(r, defs, ndefs, offsets)) {
+		if (st.st_size > 0)
+			fprintf(stderr, "%s has another layout, starting over\n", path);
+		init(r, defs, ndefs, offsets);
+	}
+
+	return r;
+}
+
+void rra_close(struct rra *r)
+{
+	if (!r)
+		return;
+
+	msync(r->h, r->size, MS_SYNC);
+	munmap(r->h, r->size);
+	free(r);
+}
+
+/* turn the consolidation state into the row of the current slot */
+static void consolidate(struct rra *r, int i)
+{
+	struct rra_archive *a = &r->a[i];
+	const double *v = acc(r, i);
+	float *out = row(r, i, a->slot);
+
+	for (int c = 0; c < r->channels; c++) {
+		if (a->count == 0)
+			out[c] = NAN;
+		else if (a->cf == RRA_AVERAGE)
+			out[c] = v[c] / a->count;
+		else
+			out[c] = v[c];
+	}
+}
+
+void rra_update(struct rra *r, time_t t, const float *values)
+{
+	for (uint32_t i = 0; i < r->h->archives; i++) {
+		struct rra_archive *a = &r->a[i];
+		int64_t slot = t / a->step;
+		double *v = acc(r, i);
+
+		// the clock went back, don't scribble over newer rows
+		if (slot < a->slot)
+			continue;
+
+		if (slot > a->slot) {
+			if (a->slot >= 0) {
+				consolidate(r, i);
+
+				// steps without any samples, at most a whole round
+				int64_t gap = slot - a->slot - 1;
+				if (gap > a->rows)
+					gap = a->rows;
+				for (int64_t s = slot - gap; s < slot; s++) {
+					float *empty = row(r, i, s);
+
+					for (int c = 0; c < r->channels; c++)
+						empty[c] = NAN;
+				}
+			}
+			a->slot = slot;
+			a->count = 0;
+		}
+
+		for (int c = 0; c < r->channels; c++) {
+			if (a->count == 0)
+				v[c] = values[c];
+			else if (a->cf == RRA_AVERAGE)
+				v[c] += values[c];
+			else if (a->cf == RRA_MIN)
+				v[c] = fmin(v[c], values[c]);
+			else if (a->cf == RRA_MAX)
+				v[c] = fmax(v[c], values[c]);
+			else
+				v[c] = values[c];
+		}
+		a->count++;
+	}
+}
+
+int rra_step(const struct rra *r, int archive)
+{
+	return r->a[archive].step;
+}
+
+/* unix time of the oldest row that is still there */
+static time_t oldest(const struct rra *r, int i)
+{
+	const struct rra_archive *a = &r->a[i];
+
+	return (a->slot - a->rows + 1) * a->step;
+}
+
+int rra_select(const struct rra *r, enum rra_cf cf, int step, time_t from)
+{
+	int best = -1;
+	int coarsest = -1;
+
+	for (uint32_t i = 0; i < r->h->archives; i++) {
+		const struct rra_archive *a = &r->a[i];
+
+		if (a->cf != cf)
+			continue;
+		if ((coarsest < 0) || (a->step > r->a[coarsest].step))
+			coarsest = i;
+		if ((a->step < (uint32_t)step) || (oldest(r, i) > from))
+			continue;
+		if ((best < 0) || (a->step < r->a[best].step))
+			best = i;
+	}
+
+	// nothing goes back that far, the coarsest one comes closest
+	return (best >= 0) ? best : coarsest;
+}
+
+size_t rra_fetch(const struct rra *r, int archive, time_t from, time_t to,
+		time_t *start, float *out, size_t max_rows)
+{
+	const struct rra_archive *a = &r->a[archive];
+	int64_t first = from / a->step;
+	int64_t last = to / a->step;
+	size_t n = 0;
+
+	*start = from;
+	if (a->slot < 0)
+		return 0;
+
+	if (first < a->slot - a->rows + 1)
+		first = a->slot - a->rows + 1;
+	if (first < 0)
+		first = 0;
+	if (last > a->slot)
+		last = a->slot;
+
+	*start = first * a->step;
+
+	if (!out)
+		return (last >= first) ? last - first + 1 : 0;
+
+	for (int64_t s = first; (s <= last) && (n < max_rows); s++, n++) {
+		float *dst = out + n * r->channels;
+
+		if (s == a->slot) {
+			const double *v = acc(r, archive);
+
+			for (int c = 0; c < r->channels; c++)
+				dst[c] = (a->cf == RRA_AVERAGE) ? v[c] / a->count : v[c];
+		} else {
+			memcpy(dst, row(r, archive, s), r->channels * sizeof(float));
+		}
+	}
+
+	return n;
+}
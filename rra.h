@@ -0,0 +1,98 @@
+
+/**
+
+Copyright 2019 - Auke Kok <sofar@foo-projects.org
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject
+to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**/
+
+#ifndef RRA_H
+#define RRA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * Round robin archive. A fixed size file holds a ring of rows for each
+ * of a number of archives, every archive with its own step and number
+ * of rows, and a consolidation function that turns the samples falling
+ * into one step into a row. Samples go into all archives at once, so the
+ * fine archives cover the recent past and the coarse ones go back
+ * further. The file is mmap()ed and never grows.
+ *
+ * A row holds one float per channel, NAN where no samples came in.
+ * Everything is in host byte order, like the snapshot files.
+ */
+
+#define RRA_MAGIC 0x41525252 // "RRRA"
+#define RRA_VERSION 1
+
+enum rra_cf {
+	RRA_AVERAGE,
+	RRA_MIN,
+	RRA_MAX,
+	RRA_LAST,
+	RRA_CFS
+};
+
+struct rra_def {
+	int step; // seconds per row
+	int rows;
+	enum rra_cf cf;
+};
+
+struct rra;
+
+/*
+ * Map the archive at 'path'. A missing file, or one made with other
+ * definitions, is (re)created empty. Returns NULL on failure.
+ */
+struct rra *rra_open(const char *path, int channels, const struct rra_def *defs, int ndefs);
+void rra_close(struct rra *r);
+
+/* add a sample of all channels taken at unix time 't' */
+void rra_update(struct rra *r, time_t t, const float *values);
+
+/*
+ * The archive to answer a query with: of those with consolidation 'cf'
+ * and at least 'step' seconds per row, the finest one that still goes
+ * back to 'from'. Returns -1 if there is no archive with 'cf'.
+ */
+int rra_select(const struct rra *r, enum rra_cf cf, int step, time_t from);
+
+int rra_step(const struct rra *r, int archive);
+
+/*
+ * Copy the rows of 'archive' from 'from' up to and including 'to' into
+ * 'out', at most 'max_rows' of them. The row being filled right now is
+ * included as far as it got. Sets '*start' to the time of the first row
+ * and returns the number of rows. With 'out' NULL the rows are only
+ * counted.
+ */
+size_t rra_fetch(const struct rra *r, int archive, time_t from, time_t to,
+		time_t *start, float *out, size_t max_rows);
+
+/* "average", "min", "max" or "last" */
+const char *rra_cf_name(enum rra_cf cf);
+int rra_cf_parse(const char *name); // -1 if unknown
+
+#endif
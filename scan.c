@@ -0,0 +1,352 @@
+
+/**
+
+Copyright 2019 - Auke Kok <sofar@foo-projects.org
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject
+to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <glob.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <modbus.h>
+
+#include "bus.h"
+#include "snapshot.h"
+
+/*
+ * Find the controllers on the serial ports. Every port is scanned by its
+ * own thread, trying baud rates in turn and every slave id at each of
+ * them by reading the identity registers. A port is done as soon as a
+ * device answers with a matching model, unless all of it is asked for.
+ * The response timeout starts out generous and shrinks to a few times
+ * the turnaround the devices on the port actually show.
+ */
+
+#define PORTS_MAX 16
+#define BAUDS_MAX 8
+#define DEVICES_MAX 64
+
+#define SLAVE_MIN 1
+#define SLAVE_MAX 247
+
+// ms a device may take to start answering, before one did
+#define TURNAROUND_INITIAL 100
+#define TURNAROUND_MIN 20
+#define TURNAROUND_MAX 500
+
+struct device {
+	int port;
+	int baud;
+	int slave;
+	char model[17];
+	uint32_t serial;
+	bool identified; // answered the identity read, not just an exception
+	double turnaround; // ms
+};
+
+static const char *ports[PORTS_MAX];
+static int nports = 0;
+static int bauds[BAUDS_MAX] = { 9600, 19200, 4800, 38400, 115200 };
+static int nbauds = 5;
+static int slave_min = SLAVE_MIN;
+static int slave_max = SLAVE_MAX;
+static const char *match = "";
+static bool all = false;
+
+static struct device devices[DEVICES_MAX];
+static int ndevices = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: modbus-scan [-a] [-b <baud,...>] [-s <first>-<last>] [-m <model>]\n"
+		"                   [-o <inventory>] [port...]\n"
+		"  -a  scan every baud rate and slave id, don't stop at the first match\n"
+		"  -m  only a model starting with this is a match\n");
+	exit(EXIT_FAILURE);
+}
+
+static double ms_since(const struct timespec *t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) * 1e3 + (now.tv_nsec - t->tv_nsec) / 1e6;
+}
+
+/* time on the wire for 'bytes', at 11 bits per character */
+static double frame_ms(int baud, int bytes)
+{
+	return bytes * 11 * 1000. / baud;
+}
+
+static void set_timeout(modbus_t *ctx, double ms)
+{
+	modbus_set_response_timeout(ctx, (int)ms / 1000, ((int)ms % 1000) * 1000);
+}
+
+static void found(const struct device *d)
+{
+	pthread_mutex_lock(&lock);
+	if (ndevices < DEVICES_MAX)
+		devices[ndevices++] = *d;
+	pthread_mutex_unlock(&lock);
+
+	fprintf(stderr, "%s: slave %d at %d baud: %s%s%s (%.0f ms)\n", ports[d->port],
+		d->slave, d->baud, d->identified ? "\"" : "", d->identified ? d->model : "unknown device",
+		d->identified ? "\"" : "", d->turnaround);
+}
+
+/* scan one port at one baud rate, returns true once a match was found */
+static bool scan_baud(int port, int baud)
+{
+	// request plus a reply with all the identity registers
+	double frame = frame_ms(baud, 8 + 5 + 2 * SNAPSHOT_IDENT_COUNT);
+	double turnaround = TURNAROUND_INITIAL;
+	double seen = 0;
+	modbus_t *ctx;
+	bool matched = false;
+
+	ctx = modbus_new_rtu(ports[port], baud, 'N', 8, 1);
+	if (!ctx)
+		return false;
+	if (modbus_connect(ctx) == -1) {
+		fprintf(stderr, "%s: %s\n", ports[port], modbus_strerror(errno));
+		modbus_free(ctx);
+		return false;
+	}
+
+	for (int slave = slave_min; (slave <= slave_max) && !matched; slave++) {
+		uint16_t regs[SNAPSHOT_IDENT_COUNT];
+		struct device d = { .port = port, .baud = baud, .slave = slave };
+		struct timespec start;
+		int ret;
+
+		modbus_set_slave(ctx, slave);
+		set_timeout(ctx, frame + turnaround);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		ret = modbus_read_registers(ctx, SNAPSHOT_IDENT_BASE, SNAPSHOT_IDENT_COUNT, regs);
+		d.turnaround = ms_since(&start) - frame;
+		if (d.turnaround < 0)
+			d.turnaround = 0;
+
+		if (ret == SNAPSHOT_IDENT_COUNT) {
+			d.identified = true;
+			for (int i = 0; i < 8; i++) {
+				d.model[2 * i] = MODBUS_GET_HIGH_BYTE(regs[i]);
+				d.model[2 * i + 1] = MODBUS_GET_LOW_BYTE(regs[i]);
+			}
+			d.model[16] = 0;
+			// space padded
+			for (int i = 15; (i >= 0) && ((d.model[i] == ' ') || (d.model[i] == 0)); i--)
+				d.model[i] = 0;
+			d.serial = ((uint32_t)regs[12] << 16) | regs[13];
+			matched = !all && (strncmp(d.model, match, strlen(match)) == 0);
+		} else if ((ret < 0) && (errno > MODBUS_ENOBASE) && (errno < EMBBADCRC)) {
+			// an exception still means someone is home
+		} else {
+			// garbage is likely the wrong baud rate or two devices talking
+			if ((ret < 0) && (errno != ETIMEDOUT))
+				modbus_flush(ctx);
+			continue;
+		}
+
+		found(&d);
+
+		// wait only a few times as long as the slowest device needed
+		if (d.turnaround > seen) {
+			seen = d.turnaround;
+			turnaround = 4 * seen;
+			if (turnaround < TURNAROUND_MIN)
+				turnaround = TURNAROUND_MIN;
+			if (turnaround > TURNAROUND_MAX)
+				turnaround = TURNAROUND_MAX;
+		}
+	}
+
+	modbus_close(ctx);
+	modbus_free(ctx);
+
+	return matched;
+}
+
+static void *scan_port(void *arg)
+{
+	int port = (int)(intptr_t)arg;
+
+	for (int b = 0; b < nbauds; b++) {
+		fprintf(stderr, "%s: scanning at %d baud\n", ports[port], bauds[b]);
+		if (scan_baud(port, bauds[b]))
+			break;
+	}
+
+	return NULL;
+}
+
+static int device_cmp(const void *a, const void *b)
+{
+	const struct device *x = a;
+	const struct device *y = b;
+
+	if (x->port != y->port)
+		return x->port - y->port;
+	if (x->baud != y->baud)
+		return x->baud - y->baud;
+	return x->slave - y->slave;
+}
+
+/* libconfig syntax, for modbus.inventory */
+static void write_inventory(FILE *f)
+{
+	time_t now = time(NULL);
+	char date[32];
+
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&now));
+	fprintf(f, "# modbus-scan inventory, %s\n", date);
+	fprintf(f, "devices = (");
+	for (int i = 0; i < ndevices; i++) {
+		const struct device *d = &devices[i];
+
+		fprintf(f, "%s\n\t{ device = \"%s\"; baud = %d; slave = %d;", i ? "," : "",
+			ports[d->port], d->baud, d->slave);
+		if (d->identified)
+			fprintf(f, " model = \"%s\"; serial = \"%08x\";", d->model, d->serial);
+		fprintf(f, " }");
+	}
+	fprintf(f, "\n);\n");
+}
+
+static void default_ports(void)
+{
+	static const char *patterns[] = { "/dev/ttyUSB*", "/dev/ttyACM*", "/dev/ttyAMA*" };
+	static struct bus_conf conf;
+	glob_t g;
+
+	// the configured port first, then whatever adapters are plugged in
+	bus_config_load(&conf);
+	ports[nports++] = conf.device;
+
+	for (size_t p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++) {
+		if (glob(patterns[p], 0, NULL, &g) != 0)
+			continue;
+		for (size_t i = 0; (i < g.gl_pathc) && (nports < PORTS_MAX); i++) {
+			if (strcmp(g.gl_pathv[i], conf.device) == 0)
+				continue;
+			ports[nports] = strdup(g.gl_pathv[i]);
+			if (!ports[nports])
+				exit(EXIT_FAILURE);
+			nports++;
+		}
+		globfree(&g);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t threads[PORTS_MAX];
+	const char *output = NULL;
+	struct timespec start;
+	FILE *f = stdout;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "ab:s:m:o:")) != -1) {
+		switch (opt) {
+		case 'a':
+			all = true;
+			break;
+		case 'b': {
+			char *p = optarg;
+
+			nbauds = 0;
+			while (*p && (nbauds < BAUDS_MAX)) {
+				bauds[nbauds] = strtol(p, &p, 10);
+				if (bauds[nbauds] <= 0)
+					usage();
+				nbauds++;
+				if (*p == ',')
+					p++;
+				else if (*p)
+					usage();
+			}
+			break;
+		}
+		case 's':
+			if ((sscanf(optarg, "%d-%d", &slave_min, &slave_max) != 2) ||
+			    (slave_min < SLAVE_MIN) || (slave_max > SLAVE_MAX) || (slave_min > slave_max))
+				usage();
+			break;
+		case 'm':
+			match = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	for (int i = optind; (i < argc) && (nports < PORTS_MAX); i++)
+		ports[nports++] = argv[i];
+	if (nports == 0)
+		default_ports();
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	// ports are independent, each gets a thread
+	for (int i = 0; i < nports; i++) {
+		if (pthread_create(&threads[i], NULL, scan_port, (void *)(intptr_t)i) != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (int i = 0; i < nports; i++)
+		pthread_join(threads[i], NULL);
+
+	fprintf(stderr, "Found %d devices on %d ports in %.1f s\n", ndevices, nports, ms_since(&start) / 1e3);
+
+	qsort(devices, ndevices, sizeof(devices[0]), device_cmp);
+
+	if (output) {
+		f = fopen(output, "w");
+		if (!f) {
+			fprintf(stderr, "Unable to write %s: %s\n", output, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+	write_inventory(f);
+	if (output)
+		fclose(f);
+
+	exit(ndevices ? EXIT_SUCCESS : EXIT_FAILURE);
+}
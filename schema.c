@@ -0,0 +1,139 @@
+
+/**
+
+Copyright 2019 - Auke Kok <sofar@foo-projects.org
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject
+to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**/
+
+#include <stddef.h>
+
+#include "schema.h"
+
+static const char *panel_keys[PANEL_KEY_MAX] = {
+	[SCHEMA_KEY] = "schema",
+	[PANEL_BATTERY_CAPACITY] = "battery_capacity",
+	[PANEL_BATTERY_VOLTAGE] = "battery_voltage",
+	[PANEL_BATTERY_CURRENT] = "battery_current",
+	[PANEL_CONTROLLER_TEMPERATURE] = "controller_temperature",
+	[PANEL_LOAD_VOLTAGE] = "load_voltage",
+	[PANEL_LOAD_CURRENT] = "load_current",
+	[PANEL_LOAD_POWER] = "load_power",
+	[PANEL_PANEL_VOLTAGE] = "panel_voltage",
+	[PANEL_PANEL_CURRENT] = "panel_current",
+	[PANEL_PANEL_POWER] = "panel_power",
+	[PANEL_BATTERY_VOLTAGE_MIN_DAY] = "battery_voltage_min_day",
+	[PANEL_BATTERY_VOLTAGE_MAX_DAY] = "battery_voltage_max_day",
+	[PANEL_CHARGE_CURRENT_MAX_DAY] = "charge_current_max_day",
+	[PANEL_DISCHARGE_CURRENT_MAX_DAY] = "discharge_current_max_day",
+	[PANEL_CHARGE_POWER_MAX_DAY] = "charge_power_max_day",
+	[PANEL_DISCHARGE_POWER_MAX_DAY] = "discharge_power_max_day",
+	[PANEL_CHARGE_AMP_HOURS_DAY] = "charge_amp_hours_day",
+	[PANEL_DISCHARGE_AMP_HOURS_DAY] = "discharge_amp_hours_day",
+	[PANEL_CHARGE_GENERATED_DAY] = "charge_generated_day",
+	[PANEL_CHARGE_CONSUMED_DAY] = "charge_consumed_day",
+	[PANEL_CHARGING_STATE] = "charging_state",
+	[PANEL_ERROR_STATE] = "error_state",
+	[PANEL_LOAD_ENABLE] = "load_enable",
+	[PANEL_LOAD_BRIGHTNESS] = "load_brightness",
+};
+
+static const char *system_keys[SYSTEM_KEY_MAX] = {
+	[SCHEMA_KEY] = "schema",
+	[SYSTEM_CPU_TEMPERATURE_AVERAGE] = "cpu_temperature_average",
+	[SYSTEM_LOAD_1] = "load_1",
+	[SYSTEM_LOAD_5] = "load_5",
+	[SYSTEM_LOAD_15] = "load_15",
+	[SYSTEM_PERFORMANCE_MODE] = "performance_mode",
+	[SYSTEM_POWER] = "power",
+};
+
+static const char *energy_keys[ENERGY_KEY_MAX] = {
+	[SCHEMA_KEY] = "schema",
+	[ENERGY_START] = "start",
+	[ENERGY_PERIOD] = "period",
+	[ENERGY_COVERED] = "covered",
+	[ENERGY_PANEL_WH] = "panel_wh",
+	[ENERGY_LOAD_WH] = "load_wh",
+	[ENERGY_BATTERY_WH] = "battery_wh",
+};
+
+static const char *history_keys[HISTORY_KEY_MAX] = {
+	[SCHEMA_KEY] = "schema",
+	[HISTORY_SEQ] = "seq",
+	[HISTORY_CHUNKS] = "chunks",
+	[HISTORY_START] = "start",
+	[HISTORY_STEP] = "step",
+	[HISTORY_CF] = "cf",
+	[HISTORY_CHANNELS] = "channels",
+	[HISTORY_ROWS] = "rows",
+	[HISTORY_DATA] = "data",
+};
+
+static const char *event_keys[EVENT_KEY_MAX] = {
+	[SCHEMA_KEY] = "schema",
+	[EVENT_RULE] = "rule",
+	[EVENT_TIME] = "time",
+	[EVENT_ACTIVE] = "active",
+	[EVENT_VALUE] = "value",
+	[EVENT_PREVIOUS] = "previous",
+	[EVENT_DETAIL] = "detail",
+};
+
+static const char *bus_keys[BUS_KEY_MAX] = {
+	[SCHEMA_KEY] = "schema",
+	[BUS_REQUESTS] = "requests",
+	[BUS_FAILURES] = "failures",
+	[BUS_ERRORS] = "errors",
+	[BUS_RETRIES] = "retries",
+	[BUS_RECONNECTS] = "reconnects",
+	[BUS_REJECTED] = "rejected",
+	[BUS_TRIPS] = "trips",
+	[BUS_RECOVERIES] = "recoveries",
+	[BUS_TRIPPED] = "tripped",
+};
+
+static const char *burst_keys[BURST_KEY_MAX] = {
+	[SCHEMA_KEY] = "schema",
+	[BURST_START] = "start",
+	[BURST_PERIOD] = "period",
+	[BURST_TEMPERATURE] = "temperature",
+	[BURST_CPU] = "cpu",
+};
+
+const char *schema_key_name(int schema, uint64_t key)
+{
+	if ((schema == SCHEMA_PANEL) && (key < PANEL_KEY_MAX))
+		return panel_keys[key];
+	if ((schema == SCHEMA_SYSTEM) && (key < SYSTEM_KEY_MAX))
+		return system_keys[key];
+	if ((schema == SCHEMA_ENERGY) && (key < ENERGY_KEY_MAX))
+		return energy_keys[key];
+	if ((schema == SCHEMA_HISTORY) && (key < HISTORY_KEY_MAX))
+		return history_keys[key];
+	if ((schema == SCHEMA_EVENT) && (key < EVENT_KEY_MAX))
+		return event_keys[key];
+	if ((schema == SCHEMA_BUS) && (key < BUS_KEY_MAX))
+		return bus_keys[key];
+	if ((schema == SCHEMA_BURST) && (key < BURST_KEY_MAX))
+		return burst_keys[key];
+	return NULL;
+}
@@ -0,0 +1,145 @@
+
+/**
+
+Copyright 2019 - Auke Kok <sofar@foo-projects.org
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject
+to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**/
+
+#ifndef SCHEMA_H
+#define SCHEMA_H
+
+#include <stdint.h>
+
+/*
+ * Numeric map keys used by the CBOR encoding. These are part of the
+ * published message format: never renumber or reuse a key, only append.
+ * Key 0 of every message carries the schema id so a consumer can tell
+ * the message types apart without looking at the topic.
+ */
+
+#define SCHEMA_KEY 0
+
+enum schema_id {
+	SCHEMA_PANEL = 1,
+	SCHEMA_SYSTEM = 2,
+	SCHEMA_ENERGY = 3,
+	SCHEMA_HISTORY = 4,
+	SCHEMA_EVENT = 5,
+	SCHEMA_BUS = 6,
+	SCHEMA_BURST = 7,
+};
+
+enum panel_key {
+	PANEL_BATTERY_CAPACITY = 1,
+	PANEL_BATTERY_VOLTAGE,
+	PANEL_BATTERY_CURRENT,
+	PANEL_CONTROLLER_TEMPERATURE,
+	PANEL_LOAD_VOLTAGE,
+	PANEL_LOAD_CURRENT,
+	PANEL_LOAD_POWER,
+	PANEL_PANEL_VOLTAGE,
+	PANEL_PANEL_CURRENT,
+	PANEL_PANEL_POWER,
+	PANEL_BATTERY_VOLTAGE_MIN_DAY,
+	PANEL_BATTERY_VOLTAGE_MAX_DAY,
+	PANEL_CHARGE_CURRENT_MAX_DAY,
+	PANEL_DISCHARGE_CURRENT_MAX_DAY,
+	PANEL_CHARGE_POWER_MAX_DAY,
+	PANEL_DISCHARGE_POWER_MAX_DAY,
+	PANEL_CHARGE_AMP_HOURS_DAY,
+	PANEL_DISCHARGE_AMP_HOURS_DAY,
+	PANEL_CHARGE_GENERATED_DAY,
+	PANEL_CHARGE_CONSUMED_DAY,
+	PANEL_CHARGING_STATE,    // index into the charging state table
+	PANEL_ERROR_STATE,       // fault bitmask
+	PANEL_LOAD_ENABLE,
+	PANEL_LOAD_BRIGHTNESS,
+	PANEL_KEY_MAX
+};
+
+enum system_key {
+	SYSTEM_CPU_TEMPERATURE_AVERAGE = 1,
+	SYSTEM_LOAD_1,
+	SYSTEM_LOAD_5,
+	SYSTEM_LOAD_15,
+	SYSTEM_PERFORMANCE_MODE,
+	SYSTEM_POWER,
+	SYSTEM_KEY_MAX
+};
+
+enum energy_key {
+	ENERGY_START = 1,        // unix time the period started
+	ENERGY_PERIOD,           // 0 for an hour, 1 for a day
+	ENERGY_COVERED,          // seconds of the period with samples
+	ENERGY_PANEL_WH,
+	ENERGY_LOAD_WH,
+	ENERGY_BATTERY_WH,
+	ENERGY_KEY_MAX
+};
+
+enum history_key {
+	HISTORY_SEQ = 1,         // chunk number, from 0
+	HISTORY_CHUNKS,          // chunks in the reply
+	HISTORY_START,           // unix time of the first row in this chunk
+	HISTORY_STEP,            // seconds per row
+	HISTORY_CF,              // consolidation function, e.g. "average"
+	HISTORY_CHANNELS,        // array of the keys of the columns
+	HISTORY_ROWS,            // rows in this chunk
+	HISTORY_DATA,            // zlib compressed rows of big endian floats
+	HISTORY_KEY_MAX
+};
+
+enum event_key {
+	EVENT_RULE = 1,          // name of the rule
+	EVENT_TIME,              // unix time of the sample
+	EVENT_ACTIVE,            // fault present or threshold crossed
+	EVENT_VALUE,             // fault bits, state index or smoothed value
+	EVENT_PREVIOUS,          // the value in the previous event
+	EVENT_DETAIL,            // fault names or charging state
+	EVENT_KEY_MAX
+};
+
+enum bus_key {
+	BUS_REQUESTS = 1,
+	BUS_FAILURES,
+	BUS_ERRORS,
+	BUS_RETRIES,
+	BUS_RECONNECTS,
+	BUS_REJECTED,
+	BUS_TRIPS,
+	BUS_RECOVERIES,
+	BUS_TRIPPED,             // circuit breaker open right now
+	BUS_KEY_MAX
+};
+
+enum burst_key {
+	BURST_START = 1,         // unix time of the first sample in ms
+	BURST_PERIOD,            // ms between samples
+	BURST_TEMPERATURE,       // array of average core temperatures
+	BURST_CPU,               // array of CPU busy percentages
+	BURST_KEY_MAX
+};
+
+/* JSON field name for a key, NULL if unknown */
+const char *schema_key_name(int schema, uint64_t key);
+
+#endif
@@ -0,0 +1,200 @@
+
+/**
+
+Copyright 2019 - Auke Kok <sofar@foo-projects.org
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject
+to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "sim.h"
+#include "renogy.h"
+#include "snapshot.h"
+
+// ms the controller takes to start answering
+#define SIM_TURNAROUND 10
+
+// load current at full brightness, in 10 mA
+#define SIM_LOAD_CURRENT 200
+
+struct sim_conn {
+	int fd;
+	int baud;
+};
+
+static modbus_mapping_t *map = NULL;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void sim_init(void)
+{
+	const char model[] = "SIM-CONTROLLER  ";
+	uint16_t *r;
+
+	map = modbus_mapping_new(0, 0, 0x10000, 0);
+	if (!map)
+		exit(EXIT_FAILURE);
+	r = map->tab_registers;
+
+	for (int i = 0; i < 8; i++)
+		r[SNAPSHOT_IDENT_BASE + i] = (model[2 * i] << 8) | model[2 * i + 1];
+	r[SNAPSHOT_IDENT_BASE + 12] = 0x0051;
+	r[SNAPSHOT_IDENT_BASE + 13] = 0x4d00;
+
+	r = map->tab_registers + RENOGY_REG_BASE;
+	r[0x0] = 80;                 // battery %
+	r[0x1] = 128;                // battery 12.8 V
+	r[0x2] = 150;                // charging 1.5 A
+	r[0x3] = (25 << 8) | 25;     // controller, battery 25 C
+	r[0x4] = 128;                // load 12.8 V
+	r[0x7] = 180;                // panel 18.0 V
+	r[0x8] = 210;                // panel 2.1 A
+	r[0x9] = 37;                 // panel 37 W
+	r[0x20] = 0x02;              // mppt charging, load off
+}
+
+/* the load registers follow the switch and dimmer settings */
+static void sim_update(void)
+{
+	uint16_t *r = map->tab_registers + RENOGY_REG_BASE;
+	int on = map->tab_registers[0x10a] ? 1 : 0;
+	int brightness = map->tab_registers[0xe001] & 0x7f;
+
+	r[0x5] = on * brightness * SIM_LOAD_CURRENT / 100;
+	r[0x6] = r[0x4] * r[0x5] / 1000;
+	r[0x20] = (r[0x20] & 0xff) | (on << 15) | (brightness << 8);
+}
+
+/* bytes on the wire for an RTU reply to 'req' */
+static int reply_bytes(const uint8_t *req)
+{
+	switch (req[0]) {
+	case 0x03:
+	case 0x04:
+		return 5 + 2 * ((req[3] << 8) | req[4]);
+	default:
+		return 8;
+	}
+}
+
+static void *sim_serve(void *arg)
+{
+	struct sim_conn *conn = arg;
+	uint8_t req[MODBUS_TCP_MAX_ADU_LENGTH];
+	modbus_t *ctx;
+	int header;
+	int len;
+
+	ctx = modbus_new_tcp("127.0.0.1", MODBUS_TCP_DEFAULT_PORT);
+	if (!ctx) {
+		close(conn->fd);
+		free(conn);
+		return NULL;
+	}
+	modbus_set_socket(ctx, conn->fd);
+	header = modbus_get_header_length(ctx);
+
+	// until the client closes its end
+	while ((len = modbus_receive(ctx, req)) >= 0) {
+		int bytes;
+
+		if (len == 0)
+			continue;
+
+		// an RTU request has an address byte and crc instead of the header
+		bytes = (len - header + 3) + reply_bytes(req + header);
+
+		usleep(bytes * 11 * 1000000LL / conn->baud + SIM_TURNAROUND * 1000);
+
+		pthread_mutex_lock(&lock);
+		modbus_reply(ctx, req, len, map);
+		sim_update();
+		pthread_mutex_unlock(&lock);
+	}
+
+	modbus_close(ctx);
+	modbus_free(ctx);
+	free(conn);
+
+	return NULL;
+}
+
+/*
+ * The controller runs on a thread at the other end of a socket pair,
+ * speaking Modbus TCP framing like the gateway does.
+ */
+modbus_t *sim_open(const struct bus_conf *conf)
+{
+	struct sim_conn *conn;
+	pthread_attr_t attr;
+	pthread_t thread;
+	modbus_t *ctx;
+	int sv[2];
+
+	pthread_mutex_lock(&lock);
+	if (!map)
+		sim_init();
+	pthread_mutex_unlock(&lock);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+		fprintf(stderr, "socketpair(): %s\n", strerror(errno));
+		return NULL;
+	}
+
+	conn = malloc(sizeof(*conn));
+	if (!conn)
+		exit(EXIT_FAILURE);
+	conn->fd = sv[1];
+	conn->baud = (conf->baud > 0) ? conf->baud : 9600;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, sim_serve, conn) != 0) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(errno));
+		pthread_attr_destroy(&attr);
+		close(sv[0]);
+		close(sv[1]);
+		free(conn);
+		return NULL;
+	}
+	pthread_attr_destroy(&attr);
+
+	ctx = modbus_new_tcp("127.0.0.1", MODBUS_TCP_DEFAULT_PORT);
+	if (!ctx) {
+		fprintf(stderr, "Unable to create the libmodbus context: %s\n", strerror(errno));
+		// the thread goes away when it sees the socket closed
+		close(sv[0]);
+		return NULL;
+	}
+
+	modbus_set_socket(ctx, sv[0]);
+	modbus_set_slave(ctx, conf->slave);
+
+	return ctx;
+}
@@ -0,0 +1,48 @@
+
+/**
+
+Copyright 2019 - Auke Kok <sofar@foo-projects.org
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject
+to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**/
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <modbus.h>
+
+#include "bus.h"
+
+/*
+ * A simulated charge controller, so the tools and daemons run on a box
+ * without one. Setting the modbus device to SIM_DEVICE gives a context
+ * that talks to it instead of a serial port. Replies take as long as
+ * they would at the configured baud rate. Writes to the load switch and
+ * dimmer show up in the status registers like they do on the real one,
+ * and all contexts in a process share the same controller. Only built
+ * with --enable-sim.
+ */
+#define SIM_DEVICE "sim"
+
+/* a connected context, NULL on failure */
+modbus_t *sim_open(const struct bus_conf *conf);
+
+#endif
@@ -0,0 +1,162 @@
+
+/**
+
+Copyright 2019 - Auke Kok <sofar@foo-projects.org
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject
+to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+
+static int read_block(modbus_t *ctx, int base, int count, uint16_t *regs)
+{
+	int ret = modbus_read_registers(ctx, base, count, regs);
+
+	if (ret != count) {
+		fprintf(stderr, "Failed to read registers %04x-%04x: %s\n",
+			base, base + count - 1, modbus_strerror(errno));
+		memset(regs, 0, count * sizeof(*regs));
+		return -1;
+	}
+
+	return 0;
+}
+
+int snapshot_read(modbus_t *ctx, struct snapshot *s)
+{
+	struct timespec ts;
+
+	memset(s, 0, sizeof(*s));
+	s->magic = SNAPSHOT_MAGIC;
+	s->version = SNAPSHOT_VERSION;
+
+	if (read_block(ctx, SNAPSHOT_IDENT_BASE, SNAPSHOT_IDENT_COUNT, s->ident) == 0)
+		s->valid |= SNAPSHOT_IDENT;
+
+	if (read_block(ctx, SNAPSHOT_LIVE_BASE, SNAPSHOT_LIVE_COUNT, s->live) < 0)
+		return -1;
+	s->valid |= SNAPSHOT_LIVE;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	s->time_ns = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+	if (read_block(ctx, SNAPSHOT_EEPROM_BASE, SNAPSHOT_EEPROM_COUNT, s->eeprom) == 0)
+		s->valid |= SNAPSHOT_EEPROM;
+
+	return 0;
+}
+
+int snapshot_append(const char *path, const struct snapshot *s)
+{
+	int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	struct stat st;
+
+	if (fd < 0) {
+		fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	// a torn record would shift every record after it
+	if ((fstat(fd, &st) < 0) || (st.st_size % sizeof(*s) != 0)) {
+		fprintf(stderr, "%s is not a snapshot file\n", path);
+		close(fd);
+		return -1;
+	}
+
+	if (write(fd, s, sizeof(*s)) != sizeof(*s)) {
+		fprintf(stderr, "Unable to write %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return close(fd);
+}
+
+const struct snapshot *snapshot_map(const char *path, size_t *count)
+{
+	const struct snapshot *s;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	if ((st.st_size == 0) || (st.st_size % sizeof(*s) != 0)) {
+		fprintf(stderr, "%s is not a snapshot file\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	s = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (s == MAP_FAILED) {
+		fprintf(stderr, "Unable to map %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	*count = st.st_size / sizeof(*s);
+
+	for (size_t i = 0; i < *count; i++) {
+		if ((s[i].magic != SNAPSHOT_MAGIC) || (s[i].version != SNAPSHOT_VERSION)) {
+			fprintf(stderr, "%s: record %zu has a bad magic or version\n", path, i);
+			snapshot_unmap(s, *count);
+			return NULL;
+		}
+	}
+
+	return s;
+}
+
+void snapshot_unmap(const struct snapshot *s, size_t count)
+{
+	munmap((void *)s, count * sizeof(*s));
+}
+
+int snapshot_reg(const struct snapshot *s, int addr)
+{
+	if ((s->valid & SNAPSHOT_IDENT) && (addr >= SNAPSHOT_IDENT_BASE) &&
+			(addr < SNAPSHOT_IDENT_BASE + SNAPSHOT_IDENT_COUNT))
+		return s->ident[addr - SNAPSHOT_IDENT_BASE];
+	if ((s->valid & SNAPSHOT_LIVE) && (addr >= SNAPSHOT_LIVE_BASE) &&
+			(addr < SNAPSHOT_LIVE_BASE + SNAPSHOT_LIVE_COUNT))
+		return s->live[addr - SNAPSHOT_LIVE_BASE];
+	if ((s->valid & SNAPSHOT_EEPROM) && (addr >= SNAPSHOT_EEPROM_BASE) &&
+			(addr < SNAPSHOT_EEPROM_BASE + SNAPSHOT_EEPROM_COUNT))
+		return s->eeprom[addr - SNAPSHOT_EEPROM_BASE];
+	return -1;
+}
@@ -0,0 +1,89 @@
+
+/**
+
+Copyright 2019 - Auke Kok <sofar@foo-projects.org
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject
+to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**/
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <modbus.h>
+
+/*
+ * Fixed size binary register snapshots. A snapshot file is nothing but
+ * records appended back to back, so it can be mmap()ed and indexed
+ * directly. Records are in host byte order; the magic tells if a file
+ * came from a machine with the other one.
+ */
+
+#define SNAPSHOT_MAGIC 0x50534e52 // "RNSP"
+#define SNAPSHOT_VERSION 1
+
+/* identity: model, versions and serial number */
+#define SNAPSHOT_IDENT_BASE 0x000c
+#define SNAPSHOT_IDENT_COUNT 0x0e
+/* live data, the block renogy_decode() works on */
+#define SNAPSHOT_LIVE_BASE 0x0100
+#define SNAPSHOT_LIVE_COUNT 0x23
+/* settings */
+#define SNAPSHOT_EEPROM_BASE 0xe001
+#define SNAPSHOT_EEPROM_COUNT 0x21
+
+/* which blocks could be read */
+#define SNAPSHOT_IDENT  0x01
+#define SNAPSHOT_LIVE   0x02
+#define SNAPSHOT_EEPROM 0x04
+
+struct snapshot {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t valid;   // SNAPSHOT_* blocks present
+	int64_t time_ns;  // CLOCK_REALTIME of the live block read
+	uint16_t ident[SNAPSHOT_IDENT_COUNT];
+	uint16_t live[SNAPSHOT_LIVE_COUNT];
+	uint16_t eeprom[SNAPSHOT_EEPROM_COUNT];
+	uint8_t reserved[12];
+};
+
+_Static_assert(sizeof(struct snapshot) == 192, "snapshot record size changed");
+
+/* read all blocks, returns -1 if not even the live block could be read */
+int snapshot_read(modbus_t *ctx, struct snapshot *s);
+
+/* append one record to 'path', created if needed */
+int snapshot_append(const char *path, const struct snapshot *s);
+
+/*
+ * Map a snapshot file read-only. Returns NULL on error, otherwise the
+ * records and their number in 'count'. Unmap with snapshot_unmap().
+ */
+const struct snapshot *snapshot_map(const char *path, size_t *count);
+void snapshot_unmap(const struct snapshot *s, size_t count);
+
+/* register value by address, -1 if outside the snapshot or not read */
+int snapshot_reg(const struct snapshot *s, int addr);
+
+#endif
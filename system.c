@@ -35,66 +35,216 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <signal.h>
 #include <limits.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/timerfd.h>
 
-#include <mosquitto.h>
 #include <libconfig.h>
 
-#define CONFIG_PATH "/etc/mqtt.conf"
+#include "mqtt.h"
+#include "conf.h"
+#include "metrics.h"
+#include "cbor.h"
+#include "schema.h"
 
+// temperature inputs looked at
+#define SENSORS_MAX 32
+
+// burst mode limits
+#define BURST_PERIOD_MIN 10
+#define BURST_PERIOD_MAX 1000
+#define BURST_DURATION_MAX 3600
+#define BURST_SAMPLES_MAX (1000 / BURST_PERIOD_MIN)
+
+struct system_conf {
+	int interval;  // seconds between normal idle publishes
+	char *topic;   // topics are /<hostname>/<topic>/{state,control}
+	char *hwmon;   // hwmon directory with the tempN_input files
+	int metrics_port; // OpenMetrics on localhost, 0 to disable
+	bool cbor;
+};
+
+static struct system_conf sconf;
+
+static char hostname[HOST_NAME_MAX+1];
 static char *topic_control = NULL;
 static char *topic_state = NULL;
+static struct mqtt_topic *state_topic = NULL;
+static struct mqtt_topic *burst_topic = NULL;
+
+// kept open and read with pread(), a burst reads them many times a second
+static int sensor_fd[SENSORS_MAX];
+static int sensors = 0;
+static int loadavg_fd = -1;
+static int stat_fd = -1;
+
+// high rate sampling for a while, batched into a message per second
+static struct {
+	int fd;                 // timerfd, -1 while not in a burst
+	int period;             // ms
+	struct timespec end;
+	struct timespec start;  // of the batch being filled
+	int64_t start_ms;       // the same in unix time
+	int n;
+	float temp[BURST_SAMPLES_MAX];
+	float cpu[BURST_SAMPLES_MAX];
+	unsigned long long busy, total; // /proc/stat at the last sample
+} burst = { .fd = -1 };
+
+static int metrics_fd = -1;
 
 static int performance_mode = 1; // 0 == powersave
 static int power_on = 1; // 0 == off
 
-// 5 minute intervals between normal idle publishes
-#define PUBLISH_INTERVAL 300
+static struct timespec start_time;
+static bool sampled = false;
 
 void sigfunc(int s __attribute__ ((unused)))
 {
 	power_on = 0;
 }
 
-void publish_state(struct mosquitto *mosq)
+static void close_sensors(void)
 {
-	char *msg = NULL;
-	int cores = 0;
-	int n = 0;
-	FILE *loadavg;
-	float temp = 0.;
-	float load1, load5, load15;
+	for (int i = 0; i < sensors; i++)
+		close(sensor_fd[i]);
+	sensors = 0;
+}
 
-	/* CPU/system health */
-	for (;;) {
+static void open_sensors(const char *hwmon)
+{
+	close_sensors();
+
+	for (int n = 0; sensors < SENSORS_MAX; n++) {
 		char *fname = NULL;
-		FILE *f;
-		int t;
+		int fd;
 
-		if (asprintf(&fname, "/sys/devices/platform/coretemp.0/hwmon/hwmon0/temp%i_input", n++) < 0)
+		if (asprintf(&fname, "%s/temp%i_input", hwmon, n) < 0)
 			exit(EXIT_FAILURE);
-		f = fopen(fname, "r");
+		fd = open(fname, O_RDONLY | O_CLOEXEC);
 		free(fname);
-		if (!f) {
-			if (cores == 0)
+		if (fd < 0) {
+			// numbering may not start at 0, but don't search forever
+			if ((sensors == 0) && (n < SENSORS_MAX))
 				continue;
 			break;
 		}
-		if (fscanf(f, "%i", &t) != 1)
-			exit(EXIT_FAILURE);
-		fclose(f);
-		temp += (float)t / 1000.;
+		sensor_fd[sensors++] = fd;
+	}
+
+	if (sensors == 0)
+		fprintf(stderr, "No temperature inputs in %s\n", hwmon);
+}
+
+/* read a whole small proc or sysfs file again, NUL terminated */
+static int reread(int fd, char *buf, size_t size)
+{
+	ssize_t len = pread(fd, buf, size - 1, 0);
+
+	if (len < 0)
+		return -1;
+	buf[len] = 0;
+	return 0;
+}
+
+static float read_temperature(void)
+{
+	float temp = 0.;
+	int cores = 0;
+
+	for (int i = 0; i < sensors; i++) {
+		char buf[32];
+
+		if (reread(sensor_fd[i], buf, sizeof(buf)) < 0)
+			continue;
+		temp += atoi(buf) / 1000.;
 		cores++;
 	}
-	temp = temp / (float)cores;
+
+	return (cores > 0) ? temp / cores : 0.;
+}
+
+/* busy and total jiffies of all CPUs */
+static int read_cpu(unsigned long long *busy, unsigned long long *total)
+{
+	unsigned long long v[8] = { 0 };
+	char buf[256];
+
+	if ((reread(stat_fd, buf, sizeof(buf)) < 0) ||
+	    (sscanf(buf, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+		    &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) < 4))
+		return -1;
+
+	*total = 0;
+	for (int i = 0; i < 8; i++)
+		*total += v[i];
+	// idle and iowait
+	*busy = *total - v[3] - v[4];
+
+	return 0;
+}
+
+void publish_state(void)
+{
+	char *msg = NULL;
+	char buf[128];
+	float temp;
+	float load1, load5, load15;
+
+	/* CPU/system health */
+	temp = read_temperature();
 
 	// load?
-	loadavg = fopen("/proc/loadavg", "r");
-	if (!loadavg)
+	if ((reread(loadavg_fd, buf, sizeof(buf)) < 0) ||
+	    (sscanf(buf, "%f %f %f", &load1, &load5, &load15) != 3))
 		exit(EXIT_FAILURE);
-	if (fscanf(loadavg, "%f %f %f", &load1, &load5, &load15) != 3)
-		exit(EXIT_FAILURE);
-	fclose(loadavg);
-	
+
+	if (!sampled) {
+		struct timespec now;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		fprintf(stderr, "First sample %.3f s after start\n",
+			(now.tv_sec - start_time.tv_sec) + (now.tv_nsec - start_time.tv_nsec) / 1e9);
+		sampled = true;
+	}
+
+	if (metrics_fd >= 0) {
+		metrics_begin();
+		metrics_gauge("system_cpu_temperature_celsius", "Average core temperature", temp);
+		metrics_gauge("system_load1", "1 minute load average", load1);
+		metrics_gauge("system_load5", "5 minute load average", load5);
+		metrics_gauge("system_load15", "15 minute load average", load15);
+		metrics_gauge("system_performance_mode", "Performance (1) or powersave (0) mode", performance_mode);
+		metrics_gauge("system_power", "System powered on", power_on);
+		metrics_end();
+	}
+
+	if (sconf.cbor) {
+		uint8_t buf[64];
+		struct cbor c;
+
+		cbor_init(&c, buf, sizeof(buf));
+		cbor_map(&c, SYSTEM_KEY_MAX);
+		cbor_uint(&c, SCHEMA_KEY);
+		cbor_uint(&c, SCHEMA_SYSTEM);
+		cbor_uint(&c, SYSTEM_CPU_TEMPERATURE_AVERAGE);
+		cbor_float(&c, temp);
+		cbor_uint(&c, SYSTEM_LOAD_1);
+		cbor_float(&c, load1);
+		cbor_uint(&c, SYSTEM_LOAD_5);
+		cbor_float(&c, load5);
+		cbor_uint(&c, SYSTEM_LOAD_15);
+		cbor_float(&c, load15);
+		cbor_uint(&c, SYSTEM_PERFORMANCE_MODE);
+		cbor_int(&c, performance_mode);
+		cbor_uint(&c, SYSTEM_POWER);
+		cbor_int(&c, power_on);
+
+		if (!cbor_ok(&c))
+			exit(EXIT_FAILURE);
+		mqtt_publish(state_topic, buf, c.len);
+		return;
+	}
+
 	// craft msg
 	if (asprintf(&msg, "{ "
 			"\"cpu_temperature_average\":\"%.1f\","
@@ -110,18 +260,143 @@ void publish_state(struct mosquitto *mosq)
 		exit(EXIT_FAILURE);
 
 	// send it
-	if (mosquitto_publish(mosq, NULL, topic_state, strlen(msg), msg, 0, true) != 0)
-		exit(EXIT_FAILURE);
+	mqtt_publish(state_topic, msg, strlen(msg));
 
 	free(msg);
 }
 
-static void message_callback(
-		struct mosquitto *mosq,
-		void *obj __attribute__ ((unused)),
-		const struct mosquitto_message *message)
+static void publish_burst(void)
+{
+	if (burst.n == 0)
+		return;
+
+	if (sconf.cbor) {
+		uint8_t buf[64 + 2 * 5 * BURST_SAMPLES_MAX];
+		struct cbor c;
+
+		cbor_init(&c, buf, sizeof(buf));
+		cbor_map(&c, BURST_KEY_MAX);
+		cbor_uint(&c, SCHEMA_KEY);
+		cbor_uint(&c, SCHEMA_BURST);
+		cbor_uint(&c, BURST_START);
+		cbor_int(&c, burst.start_ms);
+		cbor_uint(&c, BURST_PERIOD);
+		cbor_uint(&c, burst.period);
+		cbor_uint(&c, BURST_TEMPERATURE);
+		cbor_array(&c, burst.n);
+		for (int i = 0; i < burst.n; i++)
+			cbor_float(&c, burst.temp[i]);
+		cbor_uint(&c, BURST_CPU);
+		cbor_array(&c, burst.n);
+		for (int i = 0; i < burst.n; i++)
+			cbor_float(&c, burst.cpu[i]);
+
+		if (!cbor_ok(&c))
+			exit(EXIT_FAILURE);
+		mqtt_publish(burst_topic, buf, c.len);
+	} else {
+		char msg[64 + 2 * 10 * BURST_SAMPLES_MAX];
+		int len;
+
+		len = snprintf(msg, sizeof(msg), "{\"start\":\"%lld\",\"period\":\"%d\",\"temperature\":[",
+			(long long)burst.start_ms, burst.period);
+		for (int i = 0; i < burst.n; i++)
+			len += snprintf(msg + len, sizeof(msg) - len, "%s\"%.1f\"", i ? "," : "", burst.temp[i]);
+		len += snprintf(msg + len, sizeof(msg) - len, "],\"cpu\":[");
+		for (int i = 0; i < burst.n; i++)
+			len += snprintf(msg + len, sizeof(msg) - len, "%s\"%.0f\"", i ? "," : "", burst.cpu[i]);
+		len += snprintf(msg + len, sizeof(msg) - len, "]}");
+		mqtt_publish(burst_topic, msg, len);
+	}
+
+	burst.n = 0;
+}
+
+static void stop_burst(void)
+{
+	publish_burst();
+	close(burst.fd);
+	burst.fd = -1;
+	fprintf(stderr, "Burst over\n");
+}
+
+static void start_burst(int period, int duration)
+{
+	struct itimerspec its = {
+		.it_interval = { period / 1000, (period % 1000) * 1000000L },
+		.it_value = { period / 1000, (period % 1000) * 1000000L },
+	};
+
+	if (burst.fd >= 0)
+		stop_burst();
+
+	burst.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (burst.fd < 0) {
+		fprintf(stderr, "timerfd_create: %s\n", strerror(errno));
+		return;
+	}
+	if (timerfd_settime(burst.fd, 0, &its, NULL) < 0) {
+		fprintf(stderr, "timerfd_settime: %s\n", strerror(errno));
+		close(burst.fd);
+		burst.fd = -1;
+		return;
+	}
+
+	burst.period = period;
+	burst.n = 0;
+	clock_gettime(CLOCK_MONOTONIC, &burst.end);
+	burst.end.tv_sec += duration;
+	if (read_cpu(&burst.busy, &burst.total) < 0)
+		burst.busy = burst.total = 0;
+
+	fprintf(stderr, "Sampling every %d ms for %d s\n", period, duration);
+}
+
+/* one timer tick of a burst */
+static void burst_sample(void)
+{
+	unsigned long long busy, total;
+	struct timespec now, wall;
+	uint64_t ticks;
+
+	// missed ticks are just missed, the samples say when they were taken
+	if (read(burst.fd, &ticks, sizeof(ticks)) != sizeof(ticks))
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if ((now.tv_sec > burst.end.tv_sec) ||
+	    ((now.tv_sec == burst.end.tv_sec) && (now.tv_nsec >= burst.end.tv_nsec))) {
+		stop_burst();
+		return;
+	}
+
+	// a message per second
+	if ((burst.n > 0) && ((now.tv_sec - burst.start.tv_sec) * 1000 +
+			(now.tv_nsec - burst.start.tv_nsec) / 1000000 >= 1000))
+		publish_burst();
+	if (burst.n == 0) {
+		burst.start = now;
+		clock_gettime(CLOCK_REALTIME, &wall);
+		burst.start_ms = (int64_t)wall.tv_sec * 1000 + wall.tv_nsec / 1000000;
+	}
+
+	burst.temp[burst.n] = read_temperature();
+	burst.cpu[burst.n] = 0;
+	if ((read_cpu(&busy, &total) == 0) && (total > burst.total)) {
+		burst.cpu[burst.n] = 100. * (busy - burst.busy) / (total - burst.total);
+		burst.busy = busy;
+		burst.total = total;
+	}
+	burst.n++;
+
+	if (burst.n == BURST_SAMPLES_MAX)
+		publish_burst();
+}
+
+static void message_callback(const struct mosquitto_message *message)
 {
 	char *tmp = NULL;
+	int period, duration;
 
 	// use strncmp() instead?
 	if (!asprintf(&tmp, "%.*s", message->payloadlen, (char *)message->payload))
@@ -130,7 +405,7 @@ static void message_callback(
 	if (strcmp(tmp, "poweroff") == 0) {
 		fprintf(stderr, "Halting the system\n");
 		power_on = 0;
-		publish_state(mosq);
+		publish_state();
 		// then do the actual poweroff
 		if (system("/usr/bin/systemctl --no-block poweroff") != 0)
 			fprintf(stderr, "Error calling systemctl poweroff\n");
@@ -138,114 +413,221 @@ static void message_callback(
 		if (performance_mode == 1) {
 			fprintf(stderr, "Switching to powersave mode \n");
 			performance_mode = 0;
-			publish_state(mosq);
+			publish_state();
 			if (system("/usr/bin/systemctl start powersave.service") != 0)
 				fprintf(stderr, "Error enabling powersave mode\n");
 		}
+	} else if (sscanf(tmp, "burst %d %d", &period, &duration) == 2) {
+		if (duration == 0) {
+			if (burst.fd >= 0)
+				stop_burst();
+		} else if ((period < BURST_PERIOD_MIN) || (period > BURST_PERIOD_MAX) ||
+				(duration < 0) || (duration > BURST_DURATION_MAX)) {
+			mqtt_ack("invalid");
+			free(tmp);
+			return;
+		} else {
+			start_burst(period, duration);
+		}
 	} else if (strcmp(tmp, "performance") == 0) {
 		if (performance_mode == 0) {
 			fprintf(stderr, "Switching to performance mode\n");
 			performance_mode = 1;
-			publish_state(mosq);
+			publish_state();
 			if (system("/usr/bin/systemctl stop powersave.service") != 0)
 				fprintf(stderr, "Error disabling powersave mode\n");
 		}
+	} else {
+		mqtt_ack("invalid");
+		free(tmp);
+		return;
 	}
 
+	mqtt_ack("ok");
+
 	free(tmp);
 }
 
-int main(void)
+static int system_config(const config_t *cfg, struct system_conf *conf)
 {
-	struct mosquitto *mosq = NULL;
-	int ret;
-	config_t cfg;
-	const char *conf_server;
-	int conf_port;
-	time_t publish_time = time(NULL) - (time_t)PUBLISH_INTERVAL;
+	const char *encoding = conf_string(cfg, "encoding", "json");
+
+	if (strcmp(encoding, "cbor") == 0) {
+		conf->cbor = true;
+	} else if (strcmp(encoding, "json") == 0) {
+		conf->cbor = false;
+	} else {
+		fprintf(stderr, "Unknown encoding \"%s\" in " CONFIG_PATH "\n", encoding);
+		return -1;
+	}
 
-	// parse configs
-	config_init(&cfg);
-	if (!config_read_file(&cfg, CONFIG_PATH)) {
-		fprintf(stderr, "%s:%d - %s\n", config_error_file(&cfg), config_error_line(&cfg), config_error_text(&cfg));
-		exit(EXIT_FAILURE);
+	conf->interval = conf_int(cfg, "system.interval", 300);
+	if (conf->interval <= 0) {
+		fprintf(stderr, "Invalid system.interval in " CONFIG_PATH "\n");
+		return -1;
 	}
 
-	if (!config_lookup_string(&cfg, "server", &conf_server)) {
-		fprintf(stderr, "No server defined in " CONFIG_PATH "\n");
+	conf->metrics_port = conf_int(cfg, "system.metrics_port", 0);
+
+	conf->topic = strdup(conf_string(cfg, "system.topic", "system"));
+	conf->hwmon = strdup(conf_string(cfg, "system.hwmon", "/sys/devices/platform/coretemp.0/hwmon/hwmon0"));
+	if (!conf->topic || !conf->hwmon)
 		exit(EXIT_FAILURE);
-	}
-	if (!config_lookup_int(&cfg, "port", &conf_port)) {
-		fprintf(stderr, "No port defined in " CONFIG_PATH "\n");
+
+	return 0;
+}
+
+static void system_config_free(struct system_conf *conf)
+{
+	free(conf->topic);
+	free(conf->hwmon);
+}
+
+static void setup_topics(void)
+{
+	char *name = NULL;
+
+	free(topic_state);
+	free(topic_control);
+
+	if (asprintf(&topic_state, "/%s/%s/state", hostname, sconf.topic) < 0)
+		exit(EXIT_FAILURE);
+	if (asprintf(&topic_control, "/%s/%s/control", hostname, sconf.topic) < 0)
+		exit(EXIT_FAILURE);
+
+	// let the broker drop a retained sample once two more should have arrived
+	state_topic = mqtt_topic_rename(state_topic, topic_state, MQTT_OVERWRITE,
+			true, 2 * sconf.interval);
+
+	// burst batches are a series, none of them may be overwritten
+	if (asprintf(&name, "/%s/%s/burst", hostname, sconf.topic) < 0)
 		exit(EXIT_FAILURE);
+	burst_topic = mqtt_topic_rename(burst_topic, name, MQTT_QUEUE, false, 0);
+	free(name);
+}
+
+static void reload_config(void)
+{
+	struct system_conf nconf;
+	config_t cfg;
+
+	if (conf_load(&cfg) < 0)
+		return;
+	if (system_config(&cfg, &nconf) < 0) {
+		config_destroy(&cfg);
+		return;
 	}
+	config_destroy(&cfg);
+
+	fprintf(stderr, "Reloading " CONFIG_PATH "\n");
+
+	bool topics_changed = (strcmp(sconf.topic, nconf.topic) != 0) ||
+		(sconf.interval != nconf.interval);
 
-	fprintf(stderr, "MQTT server: %s:%d\n", conf_server, conf_port);
+	if (strcmp(sconf.hwmon, nconf.hwmon) != 0)
+		open_sensors(nconf.hwmon);
+
+	if (sconf.metrics_port != nconf.metrics_port) {
+		if (metrics_fd >= 0)
+			close(metrics_fd);
+		metrics_fd = (nconf.metrics_port > 0) ? metrics_listen(nconf.metrics_port) : -1;
+	}
+
+	system_config_free(&sconf);
+	sconf = nconf;
+
+	if (topics_changed) {
+		setup_topics();
+		mqtt_subscribe((const char *[]){ topic_control, NULL });
+		fprintf(stderr, "state topic = %s, control topic = %s\n",
+			topic_state, topic_control);
+	}
+}
+
+int main(void)
+{
+	config_t cfg;
+	struct mqtt_conf conf;
+	struct pollfd fds[2 + METRICS_FDS];
+	time_t publish_time;
+
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+	// parse configs
+	conf_read(&cfg);
+	mqtt_config(&cfg, &conf);
+	if (system_config(&cfg, &sconf) < 0)
+		exit(EXIT_FAILURE);
+
+	fds[0].fd = conf_watch();
+	fds[0].events = POLLIN;
+
+	if (sconf.metrics_port > 0)
+		metrics_fd = metrics_listen(sconf.metrics_port);
+
+	open_sensors(sconf.hwmon);
+	loadavg_fd = open("/proc/loadavg", O_RDONLY | O_CLOEXEC);
+	stat_fd = open("/proc/stat", O_RDONLY | O_CLOEXEC);
+	if ((loadavg_fd < 0) || (stat_fd < 0))
+		exit(EXIT_FAILURE);
 
 	// what to do if terminated
 	signal(SIGINT, sigfunc);
 	signal(SIGTERM, sigfunc);
 
 	// use system hostname here
-	char hostname[HOST_NAME_MAX+1];
 	hostname[HOST_NAME_MAX] = 0;
 	if (gethostname(hostname, HOST_NAME_MAX) != 0)
 		exit(EXIT_FAILURE);
 
-	// setup topics
-	if (!asprintf(&topic_state, "/%s/system/state", hostname))
-		exit(EXIT_FAILURE);
-	if (!asprintf(&topic_control, "/%s/system/control", hostname))
-		exit(EXIT_FAILURE);
-
 	/* setup mqtt */
-	mosquitto_lib_init();
-	mosq = mosquitto_new(NULL, true, NULL);
-	if (!mosq)
-		exit(EXIT_FAILURE);
+	setup_topics();
+	mqtt_connect(&conf, (const char *[]){ topic_control, NULL }, message_callback);
 
-	mosquitto_message_callback_set(mosq, message_callback);
+	fprintf(stderr, "state topic = %s, control topic = %s\n",
+		topic_state, topic_control);
 
-	while (mosquitto_connect(mosq, conf_server, conf_port, 15) != 0) {
-		fprintf(stderr, "Waiting for connection to server\n");
-		sleep(15);
-	}
+	// the first state goes out right away, not after the first timeout
+	publish_time = time(NULL);
+	publish_state();
 
-	ret = mosquitto_subscribe(mosq, NULL, topic_control, 0);
-	if (ret != 0) {
-		fprintf(stderr, "mosquitto_subscribe: %d: %s\n", ret, strerror(errno));
-	}
+	for (;;) {
+		int timeout = 15000;
+		int nmetrics = metrics_poll(metrics_fd, fds + 2, &timeout);
 
-	fprintf(stderr, "connected, state topic = %s, control topic = %s\n",
-		topic_state, topic_control);
+		fds[1].fd = burst.fd;
+		fds[1].events = POLLIN;
+		mqtt_loop(timeout, fds, 2 + nmetrics);
+
+		// a control message may just have ended the burst
+		if ((fds[1].revents & POLLIN) && (burst.fd >= 0))
+			burst_sample();
+
+		if ((fds[0].revents & POLLIN) && conf_changed(fds[0].fd))
+			reload_config();
+
+		metrics_serve(metrics_fd, fds + 2, nmetrics);
 
-	for (;;) {
-		ret = mosquitto_loop(mosq, 15000, 1);
-		if ((ret == MOSQ_ERR_CONN_LOST) || (ret == MOSQ_ERR_NO_CONN)) {
-			sleep(5);
-			mosquitto_reconnect(mosq);
-		} else if (ret != MOSQ_ERR_SUCCESS) {
-			fprintf(stderr, "mosquitto_loop(): %d, %s\n", ret, strerror(errno));
-			exit(EXIT_FAILURE);
-		}
-		
 		if (power_on == 0) {
-			publish_state(mosq);
+			publish_state();
 			break;
 		}
 
 		time_t now = time(NULL);
-		if (now - publish_time > (time_t)PUBLISH_INTERVAL) {
+		if (now - publish_time > (time_t)sconf.interval) {
 			publish_time = now;
-			publish_state(mosq);
+			publish_state();
 		}
 	}
 
-	mosquitto_disconnect(mosq);
-	mosquitto_loop_stop(mosq, false);
-	mosquitto_destroy(mosq);
-	mosquitto_lib_cleanup();
+	if (burst.fd >= 0)
+		stop_burst();
 
+	mqtt_close();
+
+	close_sensors();
+	close(loadavg_fd);
+	close(stat_fd);
+	system_config_free(&sconf);
 	config_destroy(&cfg);
 }
-
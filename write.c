@@ -28,56 +28,270 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <ctype.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
 
 #include <modbus.h>
 
-long int get_num(char *s)
+#include "bus.h"
+
+struct reg {
+	int addr;
+	uint16_t val;
+	int line;
+};
+
+// the profile, sorted by address
+static struct reg *regs = NULL;
+static int nregs = 0;
+
+// 0x for hex, a leading 0 for octal, and nothing may follow the number
+static bool get_num(const char *s, long int *num)
 {
-	if ((strlen(s) > 2) && (s[0] == '0') && (s[1] == 'x')) {
-		return strtol(s, NULL, 16);
-	} else if ((strlen(s) > 1) && (s[0] == '0')) {
-		return strtol(s, NULL, 8);
-	} else {
-		return strtol(s, NULL, 10);
+	int base = 10;
+	char *end;
+
+	if ((s[0] == '0') && (s[1] == 'x'))
+		base = 16;
+	else if (s[0] == '0')
+		base = 8;
+
+	errno = 0;
+	*num = strtol(s, &end, base);
+	return (end != s) && (*end == 0) && (errno == 0);
+}
+
+static char *trim(char *s)
+{
+	char *e;
+
+	while (isspace((unsigned char)*s))
+		s++;
+	e = s + strlen(s);
+	while ((e > s) && isspace((unsigned char)e[-1]))
+		*--e = 0;
+
+	return s;
+}
+
+static int cmp_reg(const void *a, const void *b)
+{
+	const struct reg *ra = a;
+	const struct reg *rb = b;
+
+	if (ra->addr != rb->addr)
+		return ra->addr - rb->addr;
+	return ra->line - rb->line;
+}
+
+/*
+ * Read "addr=value" lines, blank lines and # comments are skipped. A
+ * register that is listed twice gets the last value.
+ */
+static void read_profile(FILE *f, const char *name)
+{
+	char *line = NULL;
+	size_t size = 0;
+	int lineno = 0;
+	int n = 0;
+
+	while (getline(&line, &size, f) >= 0) {
+		char *c, *a, *v;
+		long int addr, val;
+
+		lineno++;
+		if ((c = strchr(line, '#')))
+			*c = 0;
+		a = trim(line);
+		if (!*a)
+			continue;
+
+		v = strchr(a, '=');
+		if (!v) {
+			fprintf(stderr, "%s:%d: expected addr=value\n", name, lineno);
+			exit(EXIT_FAILURE);
+		}
+		*v++ = 0;
+		a = trim(a);
+		v = trim(v);
+
+		if (!get_num(a, &addr) || !get_num(v, &val) || (addr < 0) || (addr > 0xffff) ||
+				(val < 0) || (val > 0xffff)) {
+			fprintf(stderr, "%s:%d: invalid register or value\n", name, lineno);
+			exit(EXIT_FAILURE);
+		}
+
+		if (nregs == n) {
+			n = n ? n * 2 : 64;
+			regs = realloc(regs, n * sizeof(*regs));
+			if (!regs)
+				exit(EXIT_FAILURE);
+		}
+		regs[nregs].addr = addr;
+		regs[nregs].val = val;
+		regs[nregs].line = lineno;
+		nregs++;
+	}
+	free(line);
+
+	if (ferror(f)) {
+		fprintf(stderr, "Error reading %s: %s\n", name, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	qsort(regs, nregs, sizeof(*regs), cmp_reg);
+	n = 0;
+	for (int i = 0; i < nregs; i++) {
+		if ((n > 0) && (regs[n - 1].addr == regs[i].addr))
+			n--;
+		regs[n++] = regs[i];
+	}
+	nregs = n;
+}
+
+static int write_range(modbus_t *ctx, int addr, int count, const uint16_t *val)
+{
+	// a single register goes out as function 0x06, like before
+	if (count == 1)
+		return modbus_write_register(ctx, addr, val[0]);
+	return modbus_write_registers(ctx, addr, count, val);
+}
+
+/*
+ * Apply one run of adjacent registers: read what the device has, write
+ * only the parts that differ and read the run back to verify it.
+ * Returns the number of registers that did not end up as asked.
+ */
+static int apply_run(modbus_t *ctx, const struct reg *run, int count)
+{
+	uint16_t want[MODBUS_MAX_WRITE_REGISTERS];
+	uint16_t have[MODBUS_MAX_WRITE_REGISTERS];
+	int base = run[0].addr;
+	int changed = 0;
+	int bad = 0;
+
+	for (int i = 0; i < count; i++)
+		want[i] = run[i].val;
+
+	if (modbus_read_registers(ctx, base, count, have) != count) {
+		fprintf(stderr, "Error reading 0x%04x-0x%04x: %s\n", base, base + count - 1,
+			modbus_strerror(errno));
+		return count;
+	}
+
+	for (int i = 0; i < count; ) {
+		int j = i;
+
+		if (have[i] == want[i]) {
+			i++;
+			continue;
+		}
+		while ((j < count) && (have[j] != want[j]))
+			j++;
+
+		fprintf(stderr, "Writing 0x%04x-0x%04x\n", base + i, base + j - 1);
+		if (write_range(ctx, base + i, j - i, &want[i]) < 0)
+			fprintf(stderr, "Error writing registers: %s\n", modbus_strerror(errno));
+		changed += j - i;
+		i = j;
+	}
+
+	if (changed == 0)
+		return 0;
+
+	if (modbus_read_registers(ctx, base, count, have) != count) {
+		fprintf(stderr, "Error verifying 0x%04x-0x%04x: %s\n", base, base + count - 1,
+			modbus_strerror(errno));
+		return count;
+	}
+
+	for (int i = 0; i < count; i++) {
+		if (have[i] != want[i]) {
+			fprintf(stderr, "0x%04x is %u, expected %u\n", base + i, have[i], want[i]);
+			bad++;
+		}
 	}
+
+	return bad;
+}
+
+static int apply_profile(modbus_t *ctx)
+{
+	int bad = 0;
+
+	for (int i = 0; i < nregs; ) {
+		int j = i + 1;
+
+		// one transaction per run of adjacent registers
+		while ((j < nregs) && (regs[j].addr == regs[j - 1].addr + 1) &&
+				(j - i < MODBUS_MAX_WRITE_REGISTERS))
+			j++;
+
+		bad += apply_run(ctx, &regs[i], j - i);
+		i = j;
+	}
+
+	return bad;
 }
 
 int main(int argc, char *argv[]) {
+	struct bus_conf conf;
 	modbus_t *ctx;
+	long int addr, val;
+	int bad = 0;
 
 	// parse args
-	if (argc != 3) {
-		fprintf(stderr, "Usage: modbus_write <offset> <value>\n");
+	if ((argc != 2) && (argc != 3)) {
+		fprintf(stderr, "Usage: modbus_write <offset> <value>\n"
+			"       modbus_write <profile|->\n");
 		exit(EXIT_FAILURE);
 	}
 
-	long int addr = get_num(argv[1]);
-	long int val = get_num(argv[2]);
+	if (argc == 2) {
+		FILE *f = stdin;
 
-	fprintf(stderr, "Writing %li:%li\n", addr, val);
+		if (strcmp(argv[1], "-") != 0) {
+			f = fopen(argv[1], "r");
+			if (!f) {
+				fprintf(stderr, "Unable to open %s: %s\n", argv[1], strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+		}
+		read_profile(f, argv[1]);
+		if (f != stdin)
+			fclose(f);
+	} else if (!get_num(argv[1], &addr) || !get_num(argv[2], &val) || (addr < 0) ||
+			(addr > 0xffff) || (val < 0) || (val > 0xffff)) {
+		fprintf(stderr, "Invalid register or value\n");
+		exit(EXIT_FAILURE);
+	}
 
 	// setup modbus
-	ctx = modbus_new_rtu("/dev/ttyS1", 9600, 'N', 8, 1);
-	if (!ctx) {
-		perror("Unable to create the libmodbus context\n");
+	bus_config_load(&conf);
+	ctx = bus_open(&conf);
+	if (!ctx)
 		exit(EXIT_FAILURE);
-	}
+	bus_config_free(&conf);
 
-	modbus_set_slave(ctx, 1);
+	if (argc == 2) {
+		bad = apply_profile(ctx);
+		fprintf(stderr, "%d registers in profile, %d not as expected\n", nregs, bad);
+		free(regs);
+	} else {
+		fprintf(stderr, "Writing %li:%li\n", addr, val);
 
-	// do the actual write
-	if (modbus_connect(ctx) == -1) {
-		fprintf(stderr, "Connection failed: %s\n", modbus_strerror(errno));
-		modbus_free(ctx);
-		exit(EXIT_FAILURE);
+		// do the actual write
+		if (modbus_write_register(ctx, addr, val) < 0) {
+			fprintf(stderr, "Error writing register: %s\n", strerror(errno));
+			bad = 1;
+		}
 	}
 
-	if (modbus_write_register(ctx, addr, val) < 0)
-		fprintf(stderr, "Error writing register: %s\n", strerror(errno));
-
 	modbus_close(ctx);
 	modbus_free(ctx);
+
+	return bad ? EXIT_FAILURE : EXIT_SUCCESS;
 }